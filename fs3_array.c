@@ -0,0 +1,688 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_array.c
+//  Description    : This is the implementation of the FS3 device array. The
+//                   disk is either cut into stripe units of a few sectors
+//                   that go to the units in turn, or kept whole on each of two
+//                   mirrors. Each unit has a worker thread that sleeps until a
+//                   batch is issued and works through its share of it in track
+//                   order. The workers only drive their unit and log the
+//                   commands they sent, the metrics and the simulated clock
+//                   are charged on the driver's thread once the batch is done.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_array.h>
+#include <fs3_driver.h>
+#include <fs3_metrics.h>
+#include <fs3_latency.h>
+#ifdef FS3_LOCAL_CONTROLLER
+#include <fs3_local_controller.h>
+#endif
+
+//
+// Support Macros/Data
+#define ARRAY_SEEK_AVOIDED FS3_OP_MAXVAL // Logged when the head was already on the track
+#define ARRAY_DISTANCE(a, b) (((a) > (b)) ? (a) - (b) : (b) - (a))
+#define FS3_ARRAY_TEST_TRACKS 8 // Disk mirrored by the unit test
+#define FS3_ARRAY_TEST_SECTORS 64
+
+typedef struct {
+	uint8_t op;
+	uint32_t track;
+} ArrayEvent;
+
+// One command of a batch as a unit sees it, a mirrored write is one per mirror
+typedef struct {
+	FS3ArrayOp *op;
+	int16_t ret;
+} ArrayCommand;
+
+typedef struct {
+	uint32_t head;        // Track of the head, FS3_UNKNOWN_TRACK if not known
+	pthread_t worker;
+	ArrayCommand *queue;  // The unit's share of the batch being issued
+	uint32_t queued;
+	uint32_t queueCapacity;
+	ArrayEvent *events;   // Commands sent, charged once the batch is done
+	uint32_t eventCount;
+	uint32_t eventCapacity;
+	uint64_t *stale;      // Mirror sectors behind the other mirror, rewritten by the resync
+	uint64_t staleCount;
+	// Metrics
+	uint64_t commands;
+	uint64_t reads;       // Sector reads served
+	uint64_t batches;
+	uint64_t seeks;
+	uint64_t seekTracks;  // Tracks crossed by the seeks
+} ArrayDevice;
+
+uint8_t arrayMode = FS3_ARRAY_STRIPED;
+uint32_t arrayNextMirror;  // Mirror a read goes to when the mirrors tie
+uint32_t arrayDeviceCount = 1;
+uint32_t arrayStripeUnit = FS3_ARRAY_DEFAULT_UNIT;
+uint32_t arrayTrackSize;
+uint32_t arrayDeviceTracks;
+ArrayDevice arrayDevices[FS3_ARRAY_MAX_DEVICES];
+int8_t arrayRunning = 0;
+uint64_t arrayBatches;
+uint64_t arrayReadRetries;
+uint64_t arrayResynced;
+
+// Workers wait for the batch generation to move and report back when their share is done
+pthread_mutex_t arrayLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t arrayWork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t arrayDone = PTHREAD_COND_INITIALIZER;
+uint64_t arrayGeneration;
+uint32_t arrayPending;
+int8_t arrayStopping;
+
+//
+// Implementation
+
+// The bus of one unit
+static FS3CmdBlk unitSyscall(uint32_t d, FS3CmdBlk cmdblock, void *buf) {
+#ifdef FS3_LOCAL_CONTROLLER
+	return(fs3_local_syscall(d, cmdblock, buf));
+#else
+	return(fs3_syscall(cmdblock, buf));
+#endif
+}
+
+// Notes a command sent to a unit, a lost note only costs its metrics
+static void logEvent(ArrayDevice *dev, uint8_t op, uint32_t track) {
+	uint32_t capacity = (dev->eventCapacity > 0) ? dev->eventCapacity * 2 : FS3_ARRAY_BATCH * 2;
+	ArrayEvent *events;
+	if(dev->eventCount == dev->eventCapacity){
+		if((events = realloc(dev->events, sizeof(ArrayEvent) * capacity)) == NULL){
+			return;
+		}
+		dev->events = events;
+		dev->eventCapacity = capacity;
+	}
+	dev->events[dev->eventCount].op = op;
+	dev->events[dev->eventCount].track = track;
+	dev->eventCount++;
+}
+
+// Sends one command to a unit
+static int16_t deviceCommand(uint32_t d, uint8_t op, uint16_t sec, uint32_t track, void *buf) {
+	FS3CmdBlk command = unitSyscall(d, construct_fs3_cmdblk(op, sec, track, 0), buf);
+	uint8_t returnedOp, returnedRet;
+	uint16_t returnedSec;
+	uint32_t returnedTrack;
+	logEvent(&arrayDevices[d], op, track);
+	arrayDevices[d].commands++;
+	return((deconstruct_fs3_cmdblk(command, &returnedOp, &returnedSec, &returnedTrack, &returnedRet) != 0) ? -1 : 0);
+}
+
+// Charges the commands a unit logged to the metrics and the simulated clock
+static void chargeDevice(uint32_t d) {
+	ArrayDevice *dev = &arrayDevices[d];
+	uint32_t i;
+	for(i = 0; i < dev->eventCount; i++){
+		if(dev->events[i].op == ARRAY_SEEK_AVOIDED){
+			fs3_metrics_seek(1);
+			continue;
+		}
+		if(dev->events[i].op == FS3_OP_TSEEK){
+			fs3_metrics_seek(0);
+		}
+		fs3_metrics_bus_op(dev->events[i].op);
+		fs3_latency_charge_device(d, dev->events[i].op, dev->events[i].track);
+	}
+	dev->eventCount = 0;
+}
+
+// Finds the place on the units of a sector of the disk, and the unit too when striped
+static void mapOp(FS3ArrayOp *op) {
+	uint64_t idx = (uint64_t)op->track * arrayTrackSize + op->sect;
+	uint64_t stripe = idx / arrayStripeUnit;
+	uint64_t devIdx = (stripe / arrayDeviceCount) * arrayStripeUnit + idx % arrayStripeUnit;
+	if(arrayMode == FS3_ARRAY_MIRRORED){
+		op->device = 0;
+		op->devTrack = op->track;
+		op->devSect = op->sect;
+		return;
+	}
+	op->device = stripe % arrayDeviceCount;
+	op->devTrack = devIdx / arrayTrackSize;
+	op->devSect = devIdx % arrayTrackSize;
+}
+
+// Runs one command on a unit, seeking first when the head is elsewhere
+static int16_t runCommand(uint32_t d, FS3ArrayOp *op) {
+	ArrayDevice *dev = &arrayDevices[d];
+	if(dev->head == op->devTrack){
+		logEvent(dev, ARRAY_SEEK_AVOIDED, op->devTrack);
+	}else{
+		if(dev->head != FS3_UNKNOWN_TRACK){
+			dev->seeks++;
+			dev->seekTracks += ARRAY_DISTANCE(dev->head, op->devTrack);
+		}
+		if(deviceCommand(d, FS3_OP_TSEEK, 0, op->devTrack, NULL) != 0){
+			dev->head = FS3_UNKNOWN_TRACK;
+			return(-1);
+		}
+		dev->head = op->devTrack;
+	}
+	dev->reads += (op->op == FS3_OP_RDSECT);
+	return(deviceCommand(d, op->op, op->devSect, 0, op->buf));
+}
+
+// Whether a unit's copy of a sector is behind the other mirror
+static int8_t isStale(uint32_t d, uint64_t idx) {
+	return(arrayDevices[d].stale != NULL && ((arrayDevices[d].stale[idx / 64] >> (idx % 64)) & 1));
+}
+
+static void setStale(uint32_t d, uint64_t idx, int8_t stale) {
+	uint64_t bit = (uint64_t)1 << (idx % 64);
+	if(stale && !isStale(d, idx)){
+		arrayDevices[d].stale[idx / 64] |= bit;
+		arrayDevices[d].staleCount++;
+	}else if(!stale && isStale(d, idx)){
+		arrayDevices[d].stale[idx / 64] &= ~bit;
+		arrayDevices[d].staleCount--;
+	}
+}
+
+// Picks the mirror for a read, the one whose head will be closest once the
+// commands already queued on it are counted. A tie goes to the shorter queue,
+// then to the mirrors in turn, as single reads with both heads on the same
+// track always tie. A stale copy is never read.
+static uint32_t pickMirror(FS3ArrayOp *op, const uint32_t *planned) {
+	uint64_t idx = (uint64_t)op->devTrack * arrayTrackSize + op->devSect, cost, best = UINT64_MAX;
+	uint32_t i, d, pick = 0;
+	for(i = 0; i < arrayDeviceCount; i++){
+		d = (arrayNextMirror + i) % arrayDeviceCount;
+		if(isStale(d, idx)){
+			continue;
+		}
+		cost = ((planned[d] == FS3_UNKNOWN_TRACK) ? arrayDeviceTracks : ARRAY_DISTANCE(planned[d], op->devTrack)) +
+			(uint64_t)arrayDevices[d].queued * FS3_ARRAY_QUEUE_WEIGHT;
+		if(cost < best || (cost == best && arrayDevices[d].queued < arrayDevices[pick].queued)){
+			best = cost;
+			pick = d;
+		}
+	}
+	arrayNextMirror = (pick + 1) % arrayDeviceCount;
+	return(pick);
+}
+
+// Orders a unit's share of a batch by place on the unit, so the head sweeps once
+static int compareCommands(const void *a, const void *b) {
+	const FS3ArrayOp *x = ((const ArrayCommand *)a)->op, *y = ((const ArrayCommand *)b)->op;
+	if(x->devTrack != y->devTrack){
+		return((x->devTrack < y->devTrack) ? -1 : 1);
+	}
+	return((int)x->devSect - (int)y->devSect);
+}
+
+static void enqueue(uint32_t d, FS3ArrayOp *op) {
+	ArrayDevice *dev = &arrayDevices[d];
+	dev->queue[dev->queued].op = op;
+	dev->queue[dev->queued].ret = -1;
+	dev->queued++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : planBatch
+// Description  : Hand every unit its share of a batch. Striped commands go
+//                to the unit holding the sector. Mirrored writes go to both
+//                mirrors, and each read goes to the mirror that is nearest.
+//
+// Inputs       : ops - the commands
+//                count - the number of commands
+// Outputs      : 0 if successful, -1 if failure
+
+static int16_t planBatch(FS3ArrayOp *ops, uint32_t count) {
+	uint32_t planned[FS3_ARRAY_MAX_DEVICES], i, d;
+	ArrayCommand *queue;
+	for(d = 0; d < arrayDeviceCount; d++){
+		arrayDevices[d].queued = 0;
+		planned[d] = arrayDevices[d].head;
+		if(arrayDevices[d].queueCapacity < count){
+			if((queue = realloc(arrayDevices[d].queue, sizeof(ArrayCommand) * count)) == NULL){
+				return(-1);
+			}
+			arrayDevices[d].queue = queue;
+			arrayDevices[d].queueCapacity = count;
+		}
+	}
+	for(i = 0; i < count; i++){
+		mapOp(&ops[i]);
+		ops[i].ret = -1;
+		if(arrayMode != FS3_ARRAY_MIRRORED){
+			enqueue(ops[i].device, &ops[i]);
+		}else if(ops[i].op == FS3_OP_WRSECT){
+			for(d = 0; d < arrayDeviceCount; d++){
+				enqueue(d, &ops[i]);
+			}
+		}
+	}
+	// Reads are balanced once the writes are in the queues
+	for(i = 0; i < count && arrayMode == FS3_ARRAY_MIRRORED; i++){
+		if(ops[i].op != FS3_OP_WRSECT){
+			ops[i].device = pickMirror(&ops[i], planned);
+			planned[ops[i].device] = ops[i].devTrack;
+			enqueue(ops[i].device, &ops[i]);
+		}
+	}
+	for(d = 0; d < arrayDeviceCount; d++){
+		qsort(arrayDevices[d].queue, arrayDevices[d].queued, sizeof(ArrayCommand), compareCommands);
+	}
+	return(0);
+}
+
+// Runs a unit's share of the batch
+static void runQueue(uint32_t d) {
+	ArrayDevice *dev = &arrayDevices[d];
+	uint32_t i;
+	for(i = 0; i < dev->queued; i++){
+		dev->queue[i].ret = runCommand(d, dev->queue[i].op);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : resyncMirrors
+// Description  : Copy the sectors a mirror missed (a failed write, or a read
+//                that only the other mirror could serve) from the mirror that
+//                has them. Sectors that fail again stay stale for next time.
+//
+// Inputs       : none
+// Outputs      : none
+
+static void resyncMirrors(void) {
+	char sector[FS3_SECTOR_SIZE];
+	FS3ArrayOp copy = { .buf = sector };
+	uint64_t words = ((uint64_t)arrayDeviceTracks * arrayTrackSize + 63) / 64, w, bits, idx;
+	uint32_t d, src;
+	for(d = 0; d < arrayDeviceCount; d++){
+		for(w = 0; w < words && arrayDevices[d].staleCount > 0; w++){
+			for(bits = arrayDevices[d].stale[w]; bits != 0; bits &= bits - 1){
+				idx = w * 64 + __builtin_ctzll(bits);
+				copy.devTrack = idx / arrayTrackSize;
+				copy.devSect = idx % arrayTrackSize;
+				for(src = 0; src < arrayDeviceCount && (src == d || isStale(src, idx)); src++);
+				if(src == arrayDeviceCount){
+					continue;
+				}
+				copy.op = FS3_OP_RDSECT;
+				if(runCommand(src, &copy) != 0){
+					continue;
+				}
+				copy.op = FS3_OP_WRSECT;
+				if(runCommand(d, &copy) == 0){
+					setStale(d, idx, 0);
+					arrayResynced++;
+				}
+			}
+		}
+	}
+	for(d = 0; d < arrayDeviceCount; d++){
+		chargeDevice(d);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : finishBatch
+// Description  : Charge a batch that ran and settle its commands. A mirrored
+//                write is done once one mirror has it, the mirrors that
+//                missed it are resynced. A mirrored read that failed is
+//                tried on the other mirror.
+//
+// Inputs       : count - the number of commands in the batch
+// Outputs      : none
+
+static void finishBatch(uint32_t count) {
+	ArrayDevice *dev;
+	ArrayCommand *cmd;
+	uint64_t idx;
+	uint32_t i, d, other;
+	int8_t resync = 0;
+	fs3_latency_batch_begin();
+	for(d = 0; d < arrayDeviceCount; d++){
+		chargeDevice(d);
+		arrayDevices[d].batches += (count > 1 && arrayDevices[d].queued > 0);
+	}
+	fs3_latency_batch_end();
+	for(d = 0; d < arrayDeviceCount; d++){
+		for(i = 0; i < arrayDevices[d].queued; i++){
+			cmd = &arrayDevices[d].queue[i];
+			if(cmd->ret == 0){
+				cmd->op->ret = 0;
+			}
+		}
+	}
+	if(arrayMode != FS3_ARRAY_MIRRORED){
+		return;
+	}
+	for(d = 0; d < arrayDeviceCount; d++){
+		dev = &arrayDevices[d];
+		for(i = 0; i < dev->queued; i++){
+			cmd = &dev->queue[i];
+			idx = (uint64_t)cmd->op->devTrack * arrayTrackSize + cmd->op->devSect;
+			if(cmd->op->op == FS3_OP_WRSECT && cmd->op->ret == 0){
+				// The other mirror has it, this one catches up in the resync
+				setStale(d, idx, cmd->ret != 0);
+				resync |= (cmd->ret != 0);
+			}else if(cmd->op->op == FS3_OP_RDSECT && cmd->ret != 0){
+				for(other = 0; other < arrayDeviceCount && cmd->op->ret != 0; other++){
+					if(other != d && !isStale(other, idx) && runCommand(other, cmd->op) == 0){
+						cmd->op->ret = 0;
+						arrayReadRetries++;
+						setStale(d, idx, 1);
+						resync = 1;
+					}
+					chargeDevice(other);
+				}
+			}
+		}
+	}
+	if(resync){
+		resyncMirrors();
+	}
+}
+
+// Worker of one unit, runs its share of every batch
+static void *arrayWorker(void *arg) {
+	uint32_t d = (uint32_t)(uintptr_t)arg;
+	uint64_t seen = 0;
+	pthread_mutex_lock(&arrayLock);
+	while(1){
+		while(!arrayStopping && arrayGeneration == seen){
+			pthread_cond_wait(&arrayWork, &arrayLock);
+		}
+		if(arrayStopping){
+			break;
+		}
+		seen = arrayGeneration;
+		pthread_mutex_unlock(&arrayLock);
+		runQueue(d);
+		pthread_mutex_lock(&arrayLock);
+		if(--arrayPending == 0){
+			pthread_cond_signal(&arrayDone);
+		}
+	}
+	pthread_mutex_unlock(&arrayLock);
+	return(NULL);
+}
+
+// Stops and joins the first "count" workers
+static void stopWorkers(uint32_t count) {
+	uint32_t d;
+	pthread_mutex_lock(&arrayLock);
+	arrayStopping = 1;
+	pthread_cond_broadcast(&arrayWork);
+	pthread_mutex_unlock(&arrayLock);
+	for(d = 0; d < count; d++){
+		pthread_join(arrayDevices[d].worker, NULL);
+	}
+}
+
+int fs3_array_configure(uint32_t devices, uint32_t stripeUnit) {
+#ifndef FS3_LOCAL_CONTROLLER
+	if(devices > 1){
+		logMessage(LOG_ERROR_LEVEL, "A device array needs the local controller (make FS3_CONTROLLER=local).");
+		return(-1);
+	}
+#endif
+	if(devices == 0 || devices > FS3_ARRAY_MAX_DEVICES || devices > FS3_LATENCY_MAX_DEVICES || stripeUnit == 0){
+		return(-1);
+	}
+	arrayMode = FS3_ARRAY_STRIPED;
+	arrayDeviceCount = devices;
+	arrayStripeUnit = stripeUnit;
+	return(0);
+}
+
+int fs3_array_mirror(void) {
+	if(fs3_array_configure(FS3_ARRAY_MIRRORS, FS3_ARRAY_DEFAULT_UNIT) != 0){
+		return(-1);
+	}
+	arrayMode = FS3_ARRAY_MIRRORED;
+	return(0);
+}
+
+uint32_t fs3_array_devices(void) {
+	return(arrayDeviceCount);
+}
+
+uint32_t fs3_array_batch(void) {
+	return(arrayDeviceCount * ((arrayStripeUnit > FS3_ARRAY_BATCH) ? arrayStripeUnit : FS3_ARRAY_BATCH));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_array_mount
+// Description  : Mount every unit of the array and start the workers. A
+//                striped unit gets every n-th stripe unit of the disk, a
+//                mirror the whole disk, with the same sectors per track.
+//
+// Inputs       : tracks - tracks of the disk the driver sees
+//                trackSize - sectors per track of the disk
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_array_mount(uint32_t tracks, uint32_t trackSize) {
+	uint64_t stripes, share;
+	uint32_t d;
+	int ret = 0;
+	if(arrayRunning){
+		return(-1);
+	}
+	arrayTrackSize = trackSize;
+	stripes = ((uint64_t)tracks * trackSize + arrayStripeUnit - 1) / arrayStripeUnit;
+	share = ((stripes + arrayDeviceCount - 1) / arrayDeviceCount) * arrayStripeUnit;
+	arrayDeviceTracks = (arrayMode == FS3_ARRAY_MIRRORED) ? tracks : (share + trackSize - 1) / trackSize;
+#ifdef FS3_LOCAL_CONTROLLER
+	if(fs3_local_set_units(arrayDeviceCount, arrayDeviceTracks, trackSize) != 0){
+		return(-1);
+	}
+#endif
+	arrayBatches = 0;
+	arrayNextMirror = 0;
+	arrayReadRetries = 0;
+	arrayResynced = 0;
+	// The units spin up together
+	fs3_latency_batch_begin();
+	for(d = 0; d < arrayDeviceCount; d++){
+		memset(&arrayDevices[d], 0x0, sizeof(ArrayDevice));
+		arrayDevices[d].head = FS3_UNKNOWN_TRACK;
+		if(arrayMode == FS3_ARRAY_MIRRORED &&
+				(arrayDevices[d].stale = calloc(((uint64_t)tracks * trackSize + 63) / 64, sizeof(uint64_t))) == NULL){
+			ret = -1;
+		}else if(deviceCommand(d, FS3_OP_MOUNT, 0, 0, NULL) != 0){
+			logMessage(LOG_ERROR_LEVEL, "Failure mounting unit %u of the device array.", d);
+			ret = -1;
+		}
+		chargeDevice(d);
+	}
+	fs3_latency_batch_end();
+	arrayStopping = 0;
+	arrayGeneration = 0;
+	for(d = 0; d < arrayDeviceCount && ret == 0; d++){
+		if(pthread_create(&arrayDevices[d].worker, NULL, arrayWorker, (void *)(uintptr_t)d) != 0){
+			logMessage(LOG_ERROR_LEVEL, "Failure starting the worker of unit %u.", d);
+			stopWorkers(d);
+			ret = -1;
+		}
+	}
+	if(ret != 0){
+		for(d = 0; d < arrayDeviceCount; d++){
+			free(arrayDevices[d].stale);
+			free(arrayDevices[d].events);
+			arrayDevices[d].stale = NULL;
+			arrayDevices[d].events = NULL;
+		}
+		return(-1);
+	}
+	arrayRunning = 1;
+	logMessage(FS3DriverLLevel, "Device array mounted, %u units of %u tracks.", arrayDeviceCount, arrayDeviceTracks);
+	return(0);
+}
+
+int fs3_array_unmount(void) {
+	uint32_t d;
+	int ret = 0;
+	if(!arrayRunning){
+		return(-1);
+	}
+	stopWorkers(arrayDeviceCount);
+	arrayRunning = 0;
+	fs3_latency_batch_begin();
+	for(d = 0; d < arrayDeviceCount; d++){
+		if(deviceCommand(d, FS3_OP_UMOUNT, 0, 0, NULL) != 0){
+			ret = -1;
+		}
+		chargeDevice(d);
+		if(arrayDevices[d].staleCount > 0){
+			logMessage(LOG_ERROR_LEVEL, "Unit %u unmounted with %lu sectors behind its mirror.", d, arrayDevices[d].staleCount);
+		}
+		free(arrayDevices[d].queue);
+		free(arrayDevices[d].events);
+		free(arrayDevices[d].stale);
+		arrayDevices[d].queue = NULL;
+		arrayDevices[d].events = NULL;
+		arrayDevices[d].stale = NULL;
+		arrayDevices[d].queueCapacity = 0;
+		arrayDevices[d].eventCapacity = 0;
+	}
+	fs3_latency_batch_end();
+	return(ret);
+}
+
+int16_t fs3_array_io(FS3ArrayOp *op) {
+	return(fs3_array_submit(op, 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_array_submit
+// Description  : Issue a batch of sector commands. Every unit is handed its
+//                share, sorted by track, and the driver's thread sleeps until
+//                the last unit is done. The clock moves by the busiest unit.
+//
+// Inputs       : ops - the commands, each gets its ret filled in
+//                count - the number of commands
+// Outputs      : 0 if every command succeeded, -1 otherwise
+
+int16_t fs3_array_submit(FS3ArrayOp *ops, uint32_t count) {
+	uint32_t i, d, busy = 0;
+	int16_t ret = 0;
+	if(!arrayRunning || planBatch(ops, count) != 0){
+		return(-1);
+	}
+	for(d = 0; d < arrayDeviceCount; d++){
+		busy += (arrayDevices[d].queued > 0);
+	}
+	if(busy <= 1){
+		// A single unit at work is driven from this thread, waking the workers costs more
+		for(d = 0; d < arrayDeviceCount; d++){
+			runQueue(d);
+		}
+	}else{
+		pthread_mutex_lock(&arrayLock);
+		arrayPending = arrayDeviceCount;
+		arrayGeneration++;
+		pthread_cond_broadcast(&arrayWork);
+		while(arrayPending > 0){
+			pthread_cond_wait(&arrayDone, &arrayLock);
+		}
+		pthread_mutex_unlock(&arrayLock);
+	}
+	finishBatch(count);
+	arrayBatches += (count > 1);
+	for(i = 0; i < count; i++){
+		if(ops[i].ret != 0){
+			ret = -1;
+		}
+	}
+	return(ret);
+}
+
+int fs3_array_log_metrics(void) {
+	ArrayDevice *dev;
+	uint32_t d;
+	if(arrayMode == FS3_ARRAY_MIRRORED){
+		logMessage(LOG_OUTPUT_LEVEL, "** FS3 Device Array (%u mirrors) **", arrayDeviceCount);
+	}else{
+		logMessage(LOG_OUTPUT_LEVEL, "** FS3 Device Array (%u units, stripe unit %u sectors) **", arrayDeviceCount, arrayStripeUnit);
+	}
+	logMessage(LOG_OUTPUT_LEVEL, "Batches issued           [%9lu]", arrayBatches);
+	if(arrayMode == FS3_ARRAY_MIRRORED){
+		logMessage(LOG_OUTPUT_LEVEL, "Reads retried            [%9lu]", arrayReadRetries);
+		logMessage(LOG_OUTPUT_LEVEL, "Sectors resynced         [%9lu]", arrayResynced);
+	}
+	for(d = 0; d < arrayDeviceCount; d++){
+		dev = &arrayDevices[d];
+		logMessage(LOG_OUTPUT_LEVEL, "Unit %-2u commands         [%9lu], reads [%9lu], batches [%9lu], seek distance [%8.2f tracks]", d,
+			dev->commands, dev->reads, dev->batches, (dev->seeks > 0) ? (double)dev->seekTracks / dev->seeks : 0.0);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_array_unit_test
+// Description  : Mirrors a small disk, writes every sector and reads them
+//                back one at a time, the way validation does. Each mirror
+//                must serve at least half its even share of the reads, and
+//                every sector must read back.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_array_unit_test(void) {
+#ifdef FS3_LOCAL_CONTROLLER
+	char sectors[FS3_ARRAY_TEST_SECTORS][FS3_SECTOR_SIZE], back[FS3_SECTOR_SIZE];
+	FS3ArrayOp ops[FS3_ARRAY_TEST_SECTORS], op;
+	uint32_t t, i, d;
+	int ret = 0;
+	if(fs3_array_mirror() != 0 || fs3_array_mount(FS3_ARRAY_TEST_TRACKS, FS3_ARRAY_TEST_SECTORS) != 0){
+		ret = -1;
+	}
+	for(t = 0; t < FS3_ARRAY_TEST_TRACKS && ret == 0; t++){
+		for(i = 0; i < FS3_ARRAY_TEST_SECTORS; i++){
+			memset(sectors[i], (int)(t * FS3_ARRAY_TEST_SECTORS + i), FS3_SECTOR_SIZE);
+			ops[i] = (FS3ArrayOp){ .op = FS3_OP_WRSECT, .track = t, .sect = i, .buf = sectors[i] };
+		}
+		ret = fs3_array_submit(ops, FS3_ARRAY_TEST_SECTORS);
+	}
+	for(t = 0; t < FS3_ARRAY_TEST_TRACKS && ret == 0; t++){
+		for(i = 0; i < FS3_ARRAY_TEST_SECTORS && ret == 0; i++){
+			op = (FS3ArrayOp){ .op = FS3_OP_RDSECT, .track = t, .sect = i, .buf = back };
+			memset(sectors[0], (int)(t * FS3_ARRAY_TEST_SECTORS + i), FS3_SECTOR_SIZE);
+			if(fs3_array_io(&op) != 0 || memcmp(back, sectors[0], FS3_SECTOR_SIZE) != 0){
+				logMessage(LOG_ERROR_LEVEL, "FS3 device array unit test: track %u sector %u read back wrong.", t, i);
+				ret = -1;
+			}
+		}
+	}
+	for(d = 0; d < arrayDeviceCount && ret == 0; d++){
+		if(arrayDevices[d].reads * arrayDeviceCount * 2 < FS3_ARRAY_TEST_TRACKS * FS3_ARRAY_TEST_SECTORS){
+			logMessage(LOG_ERROR_LEVEL, "FS3 device array unit test: mirror %u served %lu of %u reads.", d,
+				arrayDevices[d].reads, FS3_ARRAY_TEST_TRACKS * FS3_ARRAY_TEST_SECTORS);
+			ret = -1;
+		}
+	}
+	if(arrayRunning && fs3_array_unmount() != 0){
+		ret = -1;
+	}
+	// Back to a plain disk
+	fs3_array_configure(1, FS3_ARRAY_DEFAULT_UNIT);
+	fs3_local_set_units(1, 0, 0);
+	return(ret);
+#else
+	logMessage(LOG_INFO_LEVEL, "FS3 device array unit test skipped, mirrors need the local controller.");
+	return(0);
+#endif
+}
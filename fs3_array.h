@@ -0,0 +1,77 @@
+#ifndef FS3_ARRAY_INCLUDED
+#define FS3_ARRAY_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_array.h
+//  Description    : This is the interface for the FS3 device array. The disk
+//                   the driver sees is striped across several controller
+//                   units (RAID-0) in units of a few sectors, or mirrored on
+//                   two units (RAID-1), and batches of sector commands are
+//                   issued to the units side by side from one worker thread
+//                   per unit. Units other than the first need the local
+//                   controller ("make FS3_CONTROLLER=local").
+//
+
+// Include
+#include <stdint.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_ARRAY_MAX_DEVICES 16 // Units in an array
+#define FS3_ARRAY_DEFAULT_UNIT 16 // Sectors per stripe unit
+#define FS3_ARRAY_BATCH 64 // Sector commands per unit the driver gathers before issuing them
+#define FS3_ARRAY_MIRRORS 2 // Copies of the disk in a mirror
+#define FS3_ARRAY_QUEUE_WEIGHT 4 // Tracks of seek a queued command is worth when picking a mirror
+
+// Array layouts
+#define FS3_ARRAY_STRIPED 0
+#define FS3_ARRAY_MIRRORED 1
+
+// One sector command of a batch
+typedef struct {
+	uint8_t op;        // FS3_OP_RDSECT or FS3_OP_WRSECT
+	uint32_t track;    // Track and sector of the disk the driver sees
+	uint16_t sect;
+	void *buf;         // The sector read or written
+	int16_t ret;       // 0 once the command succeeded, -1 if it failed
+	uint32_t device;   // Where the array sends it
+	uint32_t devTrack;
+	uint16_t devSect;
+} FS3ArrayOp;
+
+//
+// Array Functions
+
+int fs3_array_configure(uint32_t devices, uint32_t stripeUnit);
+	// Stripe the disk over "devices" units, taken at the next mount (1, the default, is a plain disk)
+
+int fs3_array_mirror(void);
+	// Keep a copy of the disk on each of two units, taken at the next mount. Writes go to
+	// both, reads to the nearest, and a copy that missed a sector is resynced from the other.
+
+uint32_t fs3_array_devices(void);
+	// Units of the array, 1 when there is no array
+
+uint32_t fs3_array_batch(void);
+	// Sector commands worth gathering into one batch, enough to keep every unit busy
+
+int fs3_array_mount(uint32_t tracks, uint32_t trackSize);
+	// Mount every unit, each with enough tracks for its share of the disk (a mirror the whole disk), and start the workers
+
+int fs3_array_unmount(void);
+	// Stop the workers and unmount every unit
+
+int16_t fs3_array_io(FS3ArrayOp *op);
+	// Issue one command on the calling thread
+
+int16_t fs3_array_submit(FS3ArrayOp *ops, uint32_t count);
+	// Issue a batch, every unit works through its share in track order at the
+	// same time. A sector must not be written twice in a batch. -1 if any command failed.
+
+int fs3_array_log_metrics(void);
+	// Log the commands and batches of every unit
+int fs3_array_unit_test(void);
+	// Check that a mirror spreads single reads over both units (needs the local controller)
+
+#endif
@@ -11,10 +11,14 @@
 // Includes
 #include <cmpsc311_log.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 // Project Includes
 #include <fs3_cache.h>
 #include <fs3_driver.h>
+#include <fs3_metrics.h>
+#include <fs3_mrc.h>
+#include <fs3_shm_cache.h>
 
 //
 // Support Macros/Data
@@ -23,6 +27,19 @@ int32_t cachelineMax;
 cacheEntry *cache;
 uint64_t lastCount;
 
+// Hot set kept across restarts
+char *warmPath = NULL;
+cacheKey *warmKeys = NULL;
+uint32_t warmCount;
+uint32_t warmNext;
+uint64_t warmBase; // Recency of the coldest prefetched line, below every access of this run
+
+// Lines live in a shared-memory segment instead, the lines handed out are
+// copies local to this process
+char *sharedName = NULL;
+char sharedLine[FS3_SECTOR_SIZE];
+char sharedPeekLine[FS3_SECTOR_SIZE];
+
 // METRICS VALS
 int64_t inserts;
 int64_t getCount;
@@ -32,6 +49,139 @@ int64_t misses;
 //
 // Implementation
 
+// Puts a line in the cache with the given recency, a prefetched line never
+// pushes out one used more recently than it
+static int insertLine(FS3TrackIndex trk, FS3SectorIndex sct, void *buf, uint64_t count, uint8_t warm) {
+    // Load the new cache entry
+    cacheEntry entry;
+    uint16_t i, indexOfLRU = 0;
+    entry.track = trk;
+    entry.sector = sct;
+    entry.count = count;
+    entry.warm = warm;
+    memcpy(&(entry.sectorContent), (char *)buf, FS3_SECTOR_SIZE);
+    // If cache is full, kick out the least recently used entry
+    if(cachelineCount == cachelineMax){
+        // finds the least recently used entry (lru)
+        uint64_t lru = UINT_FAST64_MAX;
+        for(i = 0; i < cachelineMax; i++){
+            if(cache[i].count < lru){
+                lru = cache[i].count;
+                indexOfLRU = i;
+            }
+        }
+        if(cachelineMax == 0 || (warm && lru > count)){
+            return(-1);
+        }
+        cache[indexOfLRU] = entry;
+        fs3_metrics_eviction(FS3_EVICT_CAPACITY, 1);
+    // Otherwise, just fill the next open cache entry
+    }else{
+        cache[cachelineCount] = entry;
+        cachelineCount++;
+    }
+    return(0);
+}
+
+// Most recently used first
+static int compareRecency(const void *a, const void *b) {
+    uint64_t ca = cache[*(const int32_t *)a].count, cb = cache[*(const int32_t *)b].count;
+    return((ca < cb) - (ca > cb));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : loadHotSet
+// Description  : Read the hot set saved by the last run, the hottest keys
+//                that fit in the cache are kept. Every access of this run
+//                counts as more recent than the whole set.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if there is no usable hot set
+
+static int loadHotSet(void) {
+    cacheWarmHeader header;
+    FILE *in;
+    warmCount = warmNext = 0;
+    if((in = fopen(warmPath, "rb")) == NULL){
+        logMessage(FS3DriverLLevel, "No cache hot set in [%s], starting cold.", warmPath);
+        return(-1);
+    }
+    if(fread(&header, sizeof(header), 1, in) != 1 || strncmp(header.magic, FS3_CACHE_WARM_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != FS3_CACHE_WARM_VERSION || header.tracks != fs3Tracks || header.trackSize != fs3TrackSize){
+        logMessage(LOG_WARNING_LEVEL, "Cache hot set [%s] does not match this disk, starting cold.", warmPath);
+        fclose(in);
+        return(-1);
+    }
+    header.count = (header.count < (uint32_t)cachelineMax) ? header.count : (uint32_t)cachelineMax;
+    if(header.count > 0 && ((warmKeys = malloc(sizeof(cacheKey) * header.count)) == NULL ||
+            fread(warmKeys, sizeof(cacheKey), header.count, in) != header.count)){
+        logMessage(LOG_WARNING_LEVEL, "Cache hot set [%s] is truncated, starting cold.", warmPath);
+        free(warmKeys);
+        warmKeys = NULL;
+        fclose(in);
+        return(-1);
+    }
+    fclose(in);
+    warmCount = header.count;
+    warmBase = lastCount;
+    lastCount += warmCount;
+    logMessage(FS3DriverLLevel, "Cache hot set of %u sectors loaded from [%s].", warmCount, warmPath);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : saveHotSet
+// Description  : Write the keys of the cached lines, most recently used
+//                first, next to the hot set file and rename it over it, so a
+//                failed save keeps the last one
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int saveHotSet(void) {
+    char tmpPath[FILENAME_MAX];
+    cacheWarmHeader header;
+    cacheKey key;
+    int32_t *order, i;
+    FILE *out;
+    int ret = 0;
+    if((order = malloc(sizeof(int32_t) * (cachelineCount + 1))) == NULL){
+        return(-1);
+    }
+    for(i = 0; i < cachelineCount; i++){
+        order[i] = i;
+    }
+    qsort(order, cachelineCount, sizeof(int32_t), compareRecency);
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", warmPath);
+    if((out = fopen(tmpPath, "wb")) == NULL){
+        free(order);
+        return(-1);
+    }
+    memset(&header, 0x0, sizeof(header));
+    strncpy(header.magic, FS3_CACHE_WARM_MAGIC, sizeof(header.magic));
+    header.version = FS3_CACHE_WARM_VERSION;
+    header.count = cachelineCount;
+    header.tracks = fs3Tracks;
+    header.trackSize = fs3TrackSize;
+    ret |= (fwrite(&header, sizeof(header), 1, out) != 1);
+    for(i = 0; i < cachelineCount && ret == 0; i++){
+        memset(&key, 0x0, sizeof(key));
+        key.track = cache[order[i]].track;
+        key.sector = cache[order[i]].sector;
+        ret |= (fwrite(&key, sizeof(key), 1, out) != 1);
+    }
+    ret |= (fclose(out) != 0);
+    free(order);
+    if(ret != 0 || rename(tmpPath, warmPath) != 0){
+        remove(tmpPath);
+        return(-1);
+    }
+    logMessage(FS3DriverLLevel, "Cache hot set of %d sectors saved to [%s].", cachelineCount, warmPath);
+    return(0);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_init_cache
@@ -41,7 +191,6 @@ int64_t misses;
 // Outputs      : 0 if successful, -1 if failure
 
 int fs3_init_cache(uint16_t cachelines) {
-    cache = malloc(sizeof(cacheEntry) * cachelines);
     cachelineCount = 0;
     lastCount = 0;
     cachelineMax = cachelines;
@@ -50,6 +199,23 @@ int fs3_init_cache(uint16_t cachelines) {
     getCount = 0;
     hits = 0;
     misses = 0;
+    // A shared cache keeps the size it was created with
+    if(sharedName != NULL){
+        cache = NULL;
+        if(fs3_shm_cache_open(sharedName, cachelines, fs3Tracks, fs3TrackSize) != 0){
+            return(-1);
+        }
+        cachelineMax = fs3_shm_cache_lines();
+        if(warmPath != NULL){
+            logMessage(LOG_WARNING_LEVEL, "Cache hot set is not used with a shared cache.");
+        }
+        return(0);
+    }
+    cache = malloc(sizeof(cacheEntry) * cachelines);
+    // The hot set of the last run is prefetched a batch per request by the first requests
+    if(warmPath != NULL){
+        loadHotSet();
+    }
     // Return
     return(0);
 }
@@ -63,11 +229,113 @@ int fs3_init_cache(uint16_t cachelines) {
 // Outputs      : 0 if successful, -1 if failure
 
 int fs3_close_cache(void)  {
+    if(sharedName != NULL){
+        return(fs3_shm_cache_close());
+    }
+    if(warmPath != NULL && saveHotSet() != 0){
+        logMessage(LOG_WARNING_LEVEL, "Failure saving the cache hot set to [%s].", warmPath);
+    }
+    free(warmKeys);
+    warmKeys = NULL;
+    warmCount = warmNext = 0;
     // Only malloced the cache
+    fs3_metrics_eviction(FS3_EVICT_CLOSE, cachelineCount);
     free(cache);
+    cachelineCount = 0;
+    return(0);
+}
+
+int fs3_set_cache_warmup(const char *path) {
+    free(warmPath);
+    warmPath = NULL;
+    if(path != NULL && (warmPath = strdup(path)) == NULL){
+        return(-1);
+    }
     return(0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_cache_shared
+// Description  : Keep the cache in the shared-memory segment "name" from the
+//                next init, so every process driving the disk shares its
+//                lines and its counters (NULL, the default, turns it off)
+//
+// Inputs       : name - the POSIX shared-memory name of the cache
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_set_cache_shared(const char *name) {
+    free(sharedName);
+    sharedName = NULL;
+    if(name != NULL && (sharedName = strdup(name)) == NULL){
+        return(-1);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_warm_cache
+// Description  : Prefetch the next batch of the saved hot set, hottest keys
+//                first. The batch goes to the disk in track order (side by
+//                side on an array), and keys whose sector is free or already
+//                cached again are skipped. Each line gets the recency it had
+//                in the last run. The batch is read synchronously, the sectors
+//                count against the request it is run in.
+//
+// Inputs       : none
+// Outputs      : the number of lines prefetched
+
+int fs3_warm_cache(void) {
+    char bufs[FS3_CACHE_WARM_BATCH][FS3_SECTOR_SIZE];
+    FS3ArrayOp ops[FS3_CACHE_WARM_BATCH], op;
+    uint32_t ranks[FS3_CACHE_WARM_BATCH], rank, n = 0, i, j;
+    uint64_t idx;
+    cacheKey key;
+    int fetched = 0;
+    if(warmNext == warmCount){
+        return(0);
+    }
+    while(warmNext < warmCount && n < FS3_CACHE_WARM_BATCH){
+        key = warmKeys[warmNext];
+        rank = warmNext++;
+        idx = (uint64_t)key.track * fs3TrackSize + key.sector;
+        if(key.track >= fs3Tracks || key.sector >= fs3TrackSize || idx >= assignedSectors ||
+                SECTOR_OWNER(idx) == FS3_FREE_SECTOR || fs3_peek_cache(key.track, key.sector) != NULL){
+            continue;
+        }
+        // Kept in track order as the batch is gathered
+        op = (FS3ArrayOp){ .op = FS3_OP_RDSECT, .track = key.track, .sect = key.sector };
+        for(i = n; i > 0 && (ops[i - 1].track > op.track || (ops[i - 1].track == op.track && ops[i - 1].sect > op.sect)); i--){
+            ops[i] = ops[i - 1];
+            ranks[i] = ranks[i - 1];
+        }
+        ops[i] = op;
+        ranks[i] = rank;
+        n++;
+    }
+    for(i = 0; i < n; i++){
+        ops[i].buf = bufs[i];
+        fs3_metrics_sector_touched();
+    }
+    if(n > 0){
+        fs3_bus_submit(ops, n);
+    }
+    for(j = 0; j < n; j++){
+        if(ops[j].ret == 0 && insertLine(ops[j].track, ops[j].sect, ops[j].buf, warmBase + (warmCount - 1 - ranks[j]), 1) == 0){
+            fs3_metrics_warmup(0);
+            fetched++;
+        }
+    }
+    if(warmNext == warmCount){
+        logMessage(FS3DriverLLevel, "Cache warm-up done, %d lines cached.", cachelineCount);
+        free(warmKeys);
+        warmKeys = NULL;
+        warmCount = warmNext = 0;
+    }
+    return(fetched);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_put_cache
@@ -80,30 +348,11 @@ int fs3_close_cache(void)  {
 int fs3_put_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
     // Add an insert
     inserts++;
-    // Load the new cache entry
-    cacheEntry entry;
-    uint16_t i, indexOfLRU = 0;
-    entry.track = trk;
-    entry.sector = sct;
-    entry.count = lastCount;
-    lastCount++;
-    memcpy(&(entry.sectorContent), (char *)buf, FS3_SECTOR_SIZE);
-    // If cache is full, kick out the least recently used entry
-    if(cachelineCount == cachelineMax){
-        // finds the least recently used entry (lru)
-        uint64_t lru = UINT_FAST64_MAX;
-        for(i = 1; i < cachelineMax; i++){
-            if(cache[i].count < lru){
-                lru = cache[i].count;
-                indexOfLRU = i;
-            }
-        }
-        cache[indexOfLRU] = entry;
-    // Otherwise, just fill the next open cache entry
-    }else{
-        cache[cachelineCount] = entry;
-        cachelineCount++;
+    if(sharedName != NULL){
+        return(fs3_shm_cache_put(trk, sct, buf));
     }
+    insertLine(trk, sct, buf, lastCount, 0);
+    lastCount++;
     return(0);
 }
 
@@ -120,12 +369,29 @@ void * fs3_get_cache(FS3TrackIndex trk, FS3SectorIndex sct)  {
     // Add a get call
     getCount++;
     uint16_t cacheFound = 0, i = 0;
+    // Feed the miss-ratio-curve estimator when it is tracking
+    fs3_mrc_access(trk, sct);
+    if(sharedName != NULL){
+        if(fs3_shm_cache_get(trk, sct, sharedLine, 1)){
+            hits++;
+            fs3_metrics_track_access(trk, 1);
+            return((void *)sharedLine);
+        }
+        misses++;
+        fs3_metrics_track_access(trk, 0);
+        return NULL;
+    }
     // Loop through cache entries and see if the track and sector correspond to one
     while(i < cachelineCount && !cacheFound){
         if(cache[i].sector == sct && cache[i].track == trk){
             // If a cache entry is found return the sector content and add a hit
             cacheFound = 1;
             hits++;
+            if(cache[i].warm){
+                fs3_metrics_warmup(1);
+                cache[i].warm = 0;
+            }
+            fs3_metrics_track_access(trk, 1);
             cache[i].count = lastCount;
             lastCount++;
             return((void *)&(cache[i].sectorContent));
@@ -134,9 +400,116 @@ void * fs3_get_cache(FS3TrackIndex trk, FS3SectorIndex sct)  {
     }
     // Add a miss if nothing is found
     misses++;
+    fs3_metrics_track_access(trk, 0);
     return NULL;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_peek_cache
+// Description  : Find an element without counting a get or refreshing it,
+//                used to plan batched commands before the sectors are used
+//
+// Inputs       : trk - the track number of the sector to find
+//                sct - the sector number of the sector to find
+// Outputs      : returns NULL if not found, pointer to buffer if found
+
+void * fs3_peek_cache(FS3TrackIndex trk, FS3SectorIndex sct) {
+    int32_t i;
+    if(sharedName != NULL){
+        return(fs3_shm_cache_get(trk, sct, sharedPeekLine, 0) ? (void *)sharedPeekLine : NULL);
+    }
+    for(i = 0; i < cachelineCount; i++){
+        if(cache[i].sector == sct && cache[i].track == trk){
+            return((void *)&(cache[i].sectorContent));
+        }
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_invalidate_cache
+// Description  : Drop an element from the cache, used when its sector is
+//                freed or moved so a stale copy is never served
+//
+// Inputs       : trk - the track number of the sector to drop
+//                sct - the sector number of the sector to drop
+// Outputs      : 1 if a line was dropped, 0 if the sector was not cached
+
+int fs3_invalidate_cache(FS3TrackIndex trk, FS3SectorIndex sct) {
+    int32_t i;
+    if(sharedName != NULL){
+        if(fs3_shm_cache_invalidate(trk, sct)){
+            fs3_metrics_eviction(FS3_EVICT_INVALIDATE, 1);
+            return(1);
+        }
+        return(0);
+    }
+    for(i = 0; i < cachelineCount; i++){
+        if(cache[i].sector == sct && cache[i].track == trk){
+            // Fill the hole with the last line
+            cache[i] = cache[cachelineCount - 1];
+            cachelineCount--;
+            fs3_metrics_eviction(FS3_EVICT_INVALIDATE, 1);
+            return(1);
+        }
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_move_cache
+// Description  : Re-key an element whose sector was moved on disk, so the
+//                line stays warm at its new location
+//
+// Inputs       : trk - the track number the sector moved from
+//                sct - the sector number the sector moved from
+//                newTrk - the track number the sector moved to
+//                newSct - the sector number the sector moved to
+// Outputs      : 1 if a line was moved, 0 if the sector was not cached
+
+int fs3_move_cache(FS3TrackIndex trk, FS3SectorIndex sct, FS3TrackIndex newTrk, FS3SectorIndex newSct) {
+    int32_t i;
+    if(sharedName != NULL){
+        return(fs3_shm_cache_move(trk, sct, newTrk, newSct));
+    }
+    for(i = 0; i < cachelineCount; i++){
+        if(cache[i].sector == sct && cache[i].track == trk){
+            cache[i].track = newTrk;
+            cache[i].sector = newSct;
+            return(1);
+        }
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_update_cache
+// Description  : Replace the contents of an element after its sector was
+//                rewritten, without counting an access or refreshing it
+//
+// Inputs       : trk - the track number of the sector
+//                sct - the sector number of the sector
+//                buf - the new contents of the sector
+// Outputs      : 1 if the line was updated, 0 if the sector was not cached
+
+int fs3_update_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    int32_t i;
+    if(sharedName != NULL){
+        return(fs3_shm_cache_update(trk, sct, buf));
+    }
+    for(i = 0; i < cachelineCount; i++){
+        if(cache[i].sector == sct && cache[i].track == trk){
+            memcpy(&(cache[i].sectorContent), (char *)buf, FS3_SECTOR_SIZE);
+            return(1);
+        }
+    }
+    return(0);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_log_cache_metrics
@@ -150,6 +523,9 @@ int fs3_log_cache_metrics(void) {
     logMessage(LOG_OUTPUT_LEVEL, "Cache gets       [    %d]\n", getCount);
     logMessage(LOG_OUTPUT_LEVEL, "Cache hits       [    %d]\n", hits);
     logMessage(LOG_OUTPUT_LEVEL, "Cache misses     [    %d]\n", misses);
-    logMessage(LOG_OUTPUT_LEVEL, "Cache hit ratio  [%%%.2f]", ((double)hits/getCount) * 100);
+    logMessage(LOG_OUTPUT_LEVEL, "Cache hit ratio  [%%%.2f]", (getCount == 0) ? 0.0 : ((double)hits/getCount) * 100);
+    if(sharedName != NULL){
+        fs3_shm_cache_log_metrics();
+    }
     return(0);
 }
@@ -17,6 +17,9 @@
 #include <time.h>
 // Defines
 #define FS3_DEFAULT_CACHE_SIZE 0x8; // 8 cache entries, by default
+#define FS3_CACHE_WARM_MAGIC "FS3WARM"
+#define FS3_CACHE_WARM_VERSION 1
+#define FS3_CACHE_WARM_BATCH 16 // Sectors of the saved hot set prefetched per request
 
 //
 // Cache Functions
@@ -27,14 +30,45 @@ typedef struct cacheEntr{
     uint32_t track;
     char sectorContent[FS3_SECTOR_SIZE + 1];
     uint64_t count;
+    uint8_t warm; // Prefetched from the saved hot set and not used since
 
 } cacheEntry;
 
+// A saved hot set is this header followed by the keys, most recently used first
+typedef struct cacheWarmHdr{
+
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t tracks;
+    uint32_t trackSize;
+
+} cacheWarmHeader;
+
+typedef struct cacheKy{
+
+    uint32_t track;
+    uint16_t sector;
+    uint16_t unused;
+
+} cacheKey;
+
 int fs3_init_cache(uint16_t cachelines);
     // Initialize the cache with a fixed number of cache lines
 
 int fs3_close_cache(void);
-    // Close the cache, freeing any buffers held in it
+    // Close the cache, freeing any buffers held in it (and saving its hot set)
+
+int fs3_set_cache_warmup(const char *path);
+    // Save the hot set of the cache to path when it is closed, and prefetch it
+    // from there after the next init (NULL, the default, turns it off)
+
+int fs3_set_cache_shared(const char *name);
+    // Keep the cache in the POSIX shared-memory segment name from the next init,
+    // shared by every process that names it (NULL, the default, turns it off)
+
+int fs3_warm_cache(void);
+    // Prefetch the next batch of the saved hot set, returns the lines fetched
 
 int fs3_put_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
     // Put an element in the cache
@@ -42,6 +76,18 @@ int fs3_put_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
 void * fs3_get_cache(FS3TrackIndex trk, FS3SectorIndex sct);
     // Get an element from the cache (returns NULL if not found)
 
+void * fs3_peek_cache(FS3TrackIndex trk, FS3SectorIndex sct);
+    // Find an element without counting an access or refreshing it (returns NULL if not found)
+
+int fs3_invalidate_cache(FS3TrackIndex trk, FS3SectorIndex sct);
+    // Drop an element from the cache (returns 1 if it was cached)
+
+int fs3_move_cache(FS3TrackIndex trk, FS3SectorIndex sct, FS3TrackIndex newTrk, FS3SectorIndex newSct);
+    // Re-key an element whose sector moved on disk (returns 1 if it was cached)
+
+int fs3_update_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
+    // Replace the contents of an element without counting an access (returns 1 if it was cached)
+
 int fs3_log_cache_metrics(void);
     // Log the metrics for the cache 
 
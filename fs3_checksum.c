@@ -0,0 +1,247 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_checksum.c
+//  Description    : This is the implementation of end-to-end sector checksums
+//                   for the FS3 filesystem. CRC32C is computed with the SSE4.2
+//                   crc32 instruction, eight bytes at a time, when the CPU has
+//                   it and with slicing-by-8 tables otherwise. Cache hits are
+//                   never checked, only sectors read over the bus. The CRCs
+//                   are kept per track, for the tracks written so far.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cmpsc311_log.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Project Includes
+#include <fs3_checksum.h>
+
+//
+// Support Macros/Data
+
+typedef struct {
+	uint32_t *crc;  // CRC32C of what each sector holds
+	uint8_t *known; // 1 once a sector's CRC has been taken
+} CrcTrack;
+
+int checksumEnabled = 0;
+CrcTrack **crcTracks = NULL; // NULL until a sector of the track is written
+uint32_t crcTrackCount;
+uint32_t crcTrackSize;
+uint32_t crcTable[8][256];
+uint32_t (*crcUpdate)(uint32_t crc, const unsigned char *buf, size_t len) = NULL;
+const char *crcImplementation = "table";
+
+// Metrics
+uint64_t checksumRecorded;
+uint64_t checksumVerified;
+uint64_t checksumMismatches;
+uint64_t checksumTime; // Time spent computing CRCs (ns)
+
+//
+// Implementation
+
+static uint64_t nowNs(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+// Slicing-by-8, eight table lookups per eight bytes
+static uint32_t crcUpdateTable(uint32_t crc, const unsigned char *buf, size_t len) {
+	uint64_t word;
+	while(len >= sizeof(uint64_t)){
+		memcpy(&word, buf, sizeof(uint64_t));
+		word ^= crc;
+		crc = crcTable[7][word & 0xff] ^ crcTable[6][(word >> 8) & 0xff] ^
+			crcTable[5][(word >> 16) & 0xff] ^ crcTable[4][(word >> 24) & 0xff] ^
+			crcTable[3][(word >> 32) & 0xff] ^ crcTable[2][(word >> 40) & 0xff] ^
+			crcTable[1][(word >> 48) & 0xff] ^ crcTable[0][word >> 56];
+		buf += sizeof(uint64_t);
+		len -= sizeof(uint64_t);
+	}
+	while(len-- > 0){
+		crc = crcTable[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	}
+	return(crc);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crcUpdateSse42(uint32_t crc, const unsigned char *buf, size_t len) {
+	uint64_t word, crc64 = crc;
+	while(len >= sizeof(uint64_t)){
+		memcpy(&word, buf, sizeof(uint64_t));
+		crc64 = _mm_crc32_u64(crc64, word);
+		buf += sizeof(uint64_t);
+		len -= sizeof(uint64_t);
+	}
+	crc = (uint32_t)crc64;
+	while(len-- > 0){
+		crc = _mm_crc32_u8(crc, *buf++);
+	}
+	return(crc);
+}
+#endif
+
+// Builds the tables and picks the fastest implementation the CPU supports
+static void crcSetup(void) {
+	uint32_t crc;
+	int i, j;
+	for(i = 0; i < 256; i++){
+		crc = i;
+		for(j = 0; j < 8; j++){
+			crc = (crc & 1) ? (crc >> 1) ^ FS3_CRC32C_POLY : crc >> 1;
+		}
+		crcTable[0][i] = crc;
+	}
+	for(i = 0; i < 256; i++){
+		for(j = 1; j < 8; j++){
+			crcTable[j][i] = crcTable[0][crcTable[j - 1][i] & 0xff] ^ (crcTable[j - 1][i] >> 8);
+		}
+	}
+	crcUpdate = crcUpdateTable;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2")){
+		crcUpdate = crcUpdateSse42;
+		crcImplementation = "sse4.2";
+	}
+#endif
+}
+
+// The CRCs of a track, made on first use (NULL if they cannot be)
+static CrcTrack *crcTrack(FS3TrackIndex trk, int create) {
+	char *mem;
+	if(crcTracks == NULL || trk >= crcTrackCount){
+		return(NULL);
+	}
+	if(crcTracks[trk] == NULL && create){
+		if((mem = calloc(1, sizeof(CrcTrack) + (sizeof(uint32_t) + sizeof(uint8_t)) * crcTrackSize)) == NULL){
+			return(NULL);
+		}
+		crcTracks[trk] = (CrcTrack *)mem;
+		crcTracks[trk]->crc = (uint32_t *)(mem + sizeof(CrcTrack));
+		crcTracks[trk]->known = (uint8_t *)(crcTracks[trk]->crc + crcTrackSize);
+	}
+	return(crcTracks[trk]);
+}
+
+void fs3_checksum_init(int enabled, uint32_t tracks, uint32_t trackSize) {
+	if(crcUpdate == NULL){
+		crcSetup();
+	}
+	fs3_checksum_close();
+	checksumEnabled = enabled;
+	if(enabled){
+		crcTracks = calloc(tracks, sizeof(CrcTrack *));
+		crcTrackCount = (crcTracks != NULL) ? tracks : 0;
+		crcTrackSize = trackSize;
+		if(crcTracks == NULL){
+			logMessage(LOG_ERROR_LEVEL, "Failure allocating the checksum tables.");
+			checksumEnabled = 0;
+		}
+	}
+	checksumRecorded = 0;
+	checksumVerified = 0;
+	checksumMismatches = 0;
+	checksumTime = 0;
+}
+
+int fs3_checksum_enabled(void) {
+	return(checksumEnabled);
+}
+
+uint32_t fs3_crc32c(const void *buf, size_t len) {
+	if(crcUpdate == NULL){
+		crcSetup();
+	}
+	return(~crcUpdate(~0u, buf, len));
+}
+
+void fs3_checksum_record(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf) {
+	CrcTrack *track;
+	uint64_t start;
+	if(!checksumEnabled || (track = crcTrack(trk, 1)) == NULL){
+		return;
+	}
+	start = nowNs();
+	track->crc[sct] = fs3_crc32c(buf, FS3_SECTOR_SIZE);
+	track->known[sct] = 1;
+	checksumTime += nowNs() - start;
+	checksumRecorded++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_checksum_verify
+// Description  : Check a sector that came from the controller against the
+//                CRC taken when it was written. Sectors that were never
+//                written through the driver have nothing to check against.
+//
+// Inputs       : trk - the track of the sector
+//                sct - the sector
+//                buf - its contents as read
+// Outputs      : 0 if it matches (or is unknown), -1 if it is corrupt
+
+int fs3_checksum_verify(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf) {
+	CrcTrack *track;
+	uint64_t start;
+	uint32_t crc;
+	if(!checksumEnabled || (track = crcTrack(trk, 0)) == NULL || !track->known[sct]){
+		return(0);
+	}
+	start = nowNs();
+	crc = fs3_crc32c(buf, FS3_SECTOR_SIZE);
+	checksumTime += nowNs() - start;
+	checksumVerified++;
+	if(crc != track->crc[sct]){
+		checksumMismatches++;
+		logMessage(LOG_ERROR_LEVEL, "Checksum mismatch on track %u sector %u, expected %08x got %08x.",
+			trk, sct, track->crc[sct], crc);
+		return(-1);
+	}
+	return(0);
+}
+
+int fs3_checksum_get(FS3TrackIndex trk, FS3SectorIndex sct, uint32_t *crc) {
+	CrcTrack *track = crcTrack(trk, 0);
+	if(track == NULL || !track->known[sct]){
+		return(0);
+	}
+	*crc = track->crc[sct];
+	return(1);
+}
+
+void fs3_checksum_set(FS3TrackIndex trk, FS3SectorIndex sct, uint32_t crc) {
+	CrcTrack *track = crcTrack(trk, 1);
+	if(track != NULL){
+		track->crc[sct] = crc;
+		track->known[sct] = 1;
+	}
+}
+
+void fs3_checksum_close(void) {
+	uint32_t i;
+	for(i = 0; crcTracks != NULL && i < crcTrackCount; i++){
+		free(crcTracks[i]);
+	}
+	free(crcTracks);
+	crcTracks = NULL;
+	crcTrackCount = 0;
+}
+
+int fs3_checksum_log_metrics(void) {
+	logMessage(LOG_OUTPUT_LEVEL, "** FS3 Sector Checksums (crc32c, %s) **", crcImplementation);
+	logMessage(LOG_OUTPUT_LEVEL, "Sectors checksummed  [%10lu]", checksumRecorded);
+	logMessage(LOG_OUTPUT_LEVEL, "Sectors verified     [%10lu]", checksumVerified);
+	logMessage(LOG_OUTPUT_LEVEL, "Checksum mismatches  [%10lu]", checksumMismatches);
+	logMessage(LOG_OUTPUT_LEVEL, "Checksum time        [%10.3f ms], [%8.1f ns/sector]", checksumTime / 1e6,
+		(checksumRecorded + checksumVerified > 0) ? (double)checksumTime / (checksumRecorded + checksumVerified) : 0.0);
+	return(0);
+}
@@ -0,0 +1,52 @@
+#ifndef FS3_CHECKSUM_INCLUDED
+#define FS3_CHECKSUM_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_checksum.h
+//  Description    : This is the interface for end-to-end sector checksums. A
+//                   CRC32C of every sector is taken as it goes to the
+//                   controller and checked when it comes back, so a sector
+//                   the controller corrupted is caught at the bus rather than
+//                   handed to a file.
+//
+
+// Include
+#include <stdint.h>
+#include <stddef.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_CRC32C_POLY 0x82F63B78 // Castagnoli polynomial, reflected
+
+//
+// Checksum Functions
+
+void fs3_checksum_init(int enabled, uint32_t tracks, uint32_t trackSize);
+	// Forget every sector's CRC, sectors are only checked while enabled
+
+int fs3_checksum_enabled(void);
+	// Non-zero when sectors are checksummed
+
+uint32_t fs3_crc32c(const void *buf, size_t len);
+	// CRC32C of a buffer, with the SSE4.2 instruction where the CPU has it
+
+void fs3_checksum_record(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf);
+	// Take the CRC of a sector the controller has just stored
+
+int fs3_checksum_verify(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf);
+	// Check a sector that came from the controller, -1 if it does not match
+
+int fs3_checksum_get(FS3TrackIndex trk, FS3SectorIndex sct, uint32_t *crc);
+	// The CRC held for a sector, returns 1 if there is one (for the snapshot)
+
+void fs3_checksum_set(FS3TrackIndex trk, FS3SectorIndex sct, uint32_t crc);
+	// Restore the CRC of a sector (for the snapshot)
+
+void fs3_checksum_close(void);
+	// Free the CRC tables
+
+int fs3_checksum_log_metrics(void);
+	// Log the sectors checked, the mismatches found and the time it took
+
+#endif
@@ -0,0 +1,153 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_compress.c
+//  Description    : This is the implementation of per-sector compression for
+//                   the FS3 filesystem. The encoding is PackBits-style run
+//                   length coding: a control byte below 128 is followed by
+//                   that many plus one literal bytes, a control byte of 128 or
+//                   more is followed by one byte repeated (control - 125)
+//                   times. Plain text never grows by more than one byte in
+//                   128, and the runs of the workloads shrink to almost nothing.
+//
+
+// Includes
+#include <string.h>
+#include <time.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_compress.h>
+
+//
+// Support Macros/Data
+#define RLE_MAX_LITERAL 128
+#define RLE_MIN_RUN 3
+#define RLE_MAX_RUN (255 - 128 + RLE_MIN_RUN)
+
+uint64_t compressBlocks;    // Blocks that fit
+uint64_t compressRejected;  // Blocks that did not
+uint64_t compressBytesIn;   // Bytes of the blocks that fit
+uint64_t compressBytesOut;  // Their encoded size
+uint64_t compressTime;      // Time spent encoding (ns)
+uint64_t decompressBlocks;
+uint64_t decompressTime;    // Time spent decoding (ns)
+
+//
+// Functions
+
+static uint64_t nowNs(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+void fs3_compress_init(void) {
+	compressBlocks = 0;
+	compressRejected = 0;
+	compressBytesIn = 0;
+	compressBytesOut = 0;
+	compressTime = 0;
+	decompressBlocks = 0;
+	decompressTime = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_compress_block
+// Description  : Run-length encode a block, giving up as soon as the output
+//                would not fit
+//
+// Inputs       : in - the block to encode
+//                inLen - its length
+//                out - the buffer for the encoded block
+//                outMax - the most bytes the encoding may take
+// Outputs      : the encoded length, 0 if it needs more than outMax bytes
+
+uint32_t fs3_compress_block(const char *in, uint32_t inLen, char *out, uint32_t outMax) {
+	uint64_t start = nowNs();
+	uint32_t i = 0, o = 0, n;
+	int8_t fits = 1;
+	while(i < inLen && fits){
+		for(n = 1; i + n < inLen && n < RLE_MAX_RUN && in[i + n] == in[i]; n++);
+		if(n >= RLE_MIN_RUN){
+			if((fits = (o + 2 <= outMax))){
+				out[o++] = (char)(n - RLE_MIN_RUN + 128);
+				out[o++] = in[i];
+				i += n;
+			}
+			continue;
+		}
+		// Literals run up to the next repeat worth encoding
+		for(n = 1; i + n < inLen && n < RLE_MAX_LITERAL &&
+				!(i + n + 2 < inLen && in[i + n] == in[i + n + 1] && in[i + n] == in[i + n + 2]); n++);
+		if((fits = (o + 1 + n <= outMax))){
+			out[o++] = (char)(n - 1);
+			memcpy(&out[o], &in[i], n);
+			o += n;
+			i += n;
+		}
+	}
+	compressTime += nowNs() - start;
+	if(!fits){
+		compressRejected++;
+		return(0);
+	}
+	compressBlocks++;
+	compressBytesIn += inLen;
+	compressBytesOut += o;
+	return(o);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_decompress_block
+// Description  : Decode a run-length encoded block
+//
+// Inputs       : in - the encoded block
+//                inLen - the most bytes it can take (the size of its slot)
+//                out - the buffer for the decoded block
+//                outLen - the length of the decoded block
+// Outputs      : 0 if successful, -1 if the block is corrupt
+
+int fs3_decompress_block(const char *in, uint32_t inLen, char *out, uint32_t outLen) {
+	uint64_t start = nowNs();
+	uint32_t i = 0, o = 0, n;
+	uint8_t control;
+	while(o < outLen && i < inLen){
+		control = (uint8_t)in[i++];
+		if(control >= 128){
+			n = control - 128 + RLE_MIN_RUN;
+			if(i >= inLen || o + n > outLen){
+				break;
+			}
+			memset(&out[o], in[i++], n);
+		}else{
+			n = control + 1;
+			if(i + n > inLen || o + n > outLen){
+				break;
+			}
+			memcpy(&out[o], &in[i], n);
+			i += n;
+		}
+		o += n;
+	}
+	decompressTime += nowNs() - start;
+	decompressBlocks++;
+	if(o != outLen){
+		logMessage(LOG_ERROR_LEVEL, "Corrupt compressed block, decoded %u of %u bytes.", o, outLen);
+		return(-1);
+	}
+	return(0);
+}
+
+int fs3_compress_log_metrics(void) {
+	logMessage(LOG_OUTPUT_LEVEL, "** FS3 Sector Compression **");
+	logMessage(LOG_OUTPUT_LEVEL, "Blocks compressed    [%10lu], not compressible [%10lu]", compressBlocks, compressRejected);
+	logMessage(LOG_OUTPUT_LEVEL, "Bytes in / out       [%10lu] / [%10lu], ratio [%8.2f]", compressBytesIn, compressBytesOut,
+		(compressBytesOut > 0) ? (double)compressBytesIn / compressBytesOut : 0.0);
+	logMessage(LOG_OUTPUT_LEVEL, "Encode time          [%10.3f ms], [%8.1f ns/block]", compressTime / 1e6,
+		(compressBlocks + compressRejected > 0) ? (double)compressTime / (compressBlocks + compressRejected) : 0.0);
+	logMessage(LOG_OUTPUT_LEVEL, "Decode time          [%10.3f ms], [%8.1f ns/block]", decompressTime / 1e6,
+		(decompressBlocks > 0) ? (double)decompressTime / decompressBlocks : 0.0);
+	return(0);
+}
@@ -0,0 +1,31 @@
+#ifndef FS3_COMPRESS_INCLUDED
+#define FS3_COMPRESS_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_compress.h
+//  Description    : This is the interface for per-sector compression. Sectors
+//                   are run-length encoded so a sector of repetitive data can
+//                   sit in a small slot of a shared sector, several to one
+//                   physical sector.
+//
+
+// Include
+#include <stdint.h>
+
+//
+// Compression Functions
+
+void fs3_compress_init(void);
+	// Reset the compression counters
+
+uint32_t fs3_compress_block(const char *in, uint32_t inLen, char *out, uint32_t outMax);
+	// Encode a block into out, the encoded length or 0 if it needs more than outMax bytes
+
+int fs3_decompress_block(const char *in, uint32_t inLen, char *out, uint32_t outLen);
+	// Decode exactly outLen bytes from a block of at most inLen bytes, -1 if it is corrupt
+
+int fs3_compress_log_metrics(void);
+	// Log the compression ratio and the time spent encoding and decoding
+
+#endif
@@ -0,0 +1,233 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_dedup.c
+//  Description    : This is the implementation of content-addressed sector
+//                   deduplication for the FS3 filesystem. The index is an
+//                   open addressing table keyed by the sector hash, with a
+//                   reverse entry per physical sector so a sector can be
+//                   dropped from it when it is rewritten, freed or moved.
+//                   Both grow with the sectors indexed, the table doubling
+//                   whenever it is half full.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_dedup.h>
+
+//
+// Support Macros/Data
+#define DEDUP_EMPTY UINT32_MAX
+#define DEDUP_MASK (dedupIndexSize - 1)
+
+typedef struct {
+	uint64_t hash;
+	uint32_t sector; // DEDUP_EMPTY when the slot is unused
+} DedupSlot;
+
+int dedupEnabled = 0;
+DedupSlot *dedupIndex = NULL;
+uint64_t dedupIndexSize;          // Slots in the index, a power of two
+uint64_t *dedupSectorHash = NULL; // Hash each sector is indexed under
+uint8_t *dedupIndexed = NULL;     // 1 while the sector is in the index
+uint64_t dedupSectorsCovered;     // Sectors the two arrays above cover
+uint64_t dedupDiskSectors;        // Sectors of the disk
+uint64_t dedupEntries;
+uint64_t dedupHits;
+
+//
+// Implementation
+
+// Makes an empty index of "size" slots
+static DedupSlot *newIndex(uint64_t size) {
+	DedupSlot *index = malloc(sizeof(DedupSlot) * size);
+	uint64_t i;
+	for(i = 0; index != NULL && i < size; i++){
+		index[i].sector = DEDUP_EMPTY;
+	}
+	return(index);
+}
+
+// Doubles the index, every entry is placed again
+static int growIndex(void) {
+	DedupSlot *old = dedupIndex, *index;
+	uint64_t i, slot, oldSize = dedupIndexSize;
+	if((index = newIndex(oldSize * 2)) == NULL){
+		return(-1);
+	}
+	dedupIndex = index;
+	dedupIndexSize = oldSize * 2;
+	for(i = 0; i < oldSize; i++){
+		if(old[i].sector == DEDUP_EMPTY){
+			continue;
+		}
+		for(slot = old[i].hash & DEDUP_MASK; dedupIndex[slot].sector != DEDUP_EMPTY; slot = (slot + 1) & DEDUP_MASK);
+		dedupIndex[slot] = old[i];
+	}
+	free(old);
+	return(0);
+}
+
+// Extends the per-sector arrays to cover "sector"
+static int coverSector(uint64_t sector) {
+	uint64_t covered = (dedupSectorsCovered > 0) ? dedupSectorsCovered : FS3_DEDUP_INITIAL_SIZE;
+	uint64_t *hashes;
+	uint8_t *indexed;
+	while(covered <= sector){
+		covered *= 2;
+	}
+	covered = (covered < dedupDiskSectors) ? covered : dedupDiskSectors;
+	if((hashes = realloc(dedupSectorHash, sizeof(uint64_t) * covered)) == NULL){
+		return(-1);
+	}
+	dedupSectorHash = hashes;
+	if((indexed = realloc(dedupIndexed, covered)) == NULL){
+		return(-1);
+	}
+	dedupIndexed = indexed;
+	memset(&dedupIndexed[dedupSectorsCovered], 0x0, covered - dedupSectorsCovered);
+	dedupSectorsCovered = covered;
+	return(0);
+}
+
+int fs3_dedup_init(int enabled, uint64_t sectors) {
+	fs3_dedup_close();
+	dedupEnabled = enabled;
+	dedupEntries = 0;
+	dedupHits = 0;
+	dedupDiskSectors = sectors;
+	if(!enabled){
+		return(0);
+	}
+	if((dedupIndex = newIndex(FS3_DEDUP_INITIAL_SIZE)) == NULL){
+		logMessage(LOG_ERROR_LEVEL, "Failure allocating the dedup index.");
+		return(-1);
+	}
+	dedupIndexSize = FS3_DEDUP_INITIAL_SIZE;
+	return(0);
+}
+
+int fs3_dedup_enabled(void) {
+	return(dedupEnabled && dedupIndex != NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_dedup_hash
+// Description  : Hash a full sector image, eight bytes at a time with a
+//                multiply and rotate per word and a final avalanche
+//
+// Inputs       : buf - the sector image (FS3_SECTOR_SIZE bytes)
+// Outputs      : the 64 bit hash
+
+uint64_t fs3_dedup_hash(const void *buf) {
+	uint64_t h = FS3_DEDUP_SEED, w;
+	int i;
+	for(i = 0; i < FS3_SECTOR_SIZE; i += sizeof(uint64_t)){
+		memcpy(&w, (const char *)buf + i, sizeof(uint64_t));
+		h ^= w * 0x9e3779b97f4a7c15ULL;
+		h = ((h << 31) | (h >> 33)) * 0xc2b2ae3d27d4eb4fULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return(h);
+}
+
+int64_t fs3_dedup_lookup(uint64_t hash) {
+	uint64_t slot;
+	if(!fs3_dedup_enabled()){
+		return(-1);
+	}
+	for(slot = hash & DEDUP_MASK; dedupIndex[slot].sector != DEDUP_EMPTY; slot = (slot + 1) & DEDUP_MASK){
+		if(dedupIndex[slot].hash == hash){
+			return(dedupIndex[slot].sector);
+		}
+	}
+	return(-1);
+}
+
+void fs3_dedup_insert(uint64_t hash, uint64_t sector) {
+	uint64_t slot;
+	if(!fs3_dedup_enabled() || sector >= dedupDiskSectors){
+		return;
+	}
+	fs3_dedup_remove(sector);
+	// A sector the index cannot grow to hold is simply not deduplicated
+	if((sector >= dedupSectorsCovered && coverSector(sector) != 0) ||
+			(2 * (dedupEntries + 1) > dedupIndexSize && growIndex() != 0)){
+		logMessage(LOG_WARNING_LEVEL, "Dedup index cannot grow, sector %lu not indexed.", sector);
+		return;
+	}
+	for(slot = hash & DEDUP_MASK; dedupIndex[slot].sector != DEDUP_EMPTY; slot = (slot + 1) & DEDUP_MASK);
+	dedupIndex[slot].hash = hash;
+	dedupIndex[slot].sector = sector;
+	dedupSectorHash[sector] = hash;
+	dedupIndexed[sector] = 1;
+	dedupEntries++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_dedup_remove
+// Description  : Forget the contents of a sector. The entries after it in
+//                its probe run are shifted back, so lookups never need
+//                tombstones.
+//
+// Inputs       : sector - the physical sector (track * size + sector)
+// Outputs      : none
+
+void fs3_dedup_remove(uint64_t sector) {
+	uint64_t slot, next, home;
+	if(!fs3_dedup_enabled() || sector >= dedupSectorsCovered || !dedupIndexed[sector]){
+		return;
+	}
+	for(slot = dedupSectorHash[sector] & DEDUP_MASK; dedupIndex[slot].sector != sector; slot = (slot + 1) & DEDUP_MASK);
+	for(next = (slot + 1) & DEDUP_MASK; dedupIndex[next].sector != DEDUP_EMPTY; next = (next + 1) & DEDUP_MASK){
+		// An entry can fill the hole only if the hole is on its probe path
+		home = dedupIndex[next].hash & DEDUP_MASK;
+		if(((next - home) & DEDUP_MASK) >= ((next - slot) & DEDUP_MASK)){
+			dedupIndex[slot] = dedupIndex[next];
+			slot = next;
+		}
+	}
+	dedupIndex[slot].sector = DEDUP_EMPTY;
+	dedupIndexed[sector] = 0;
+	dedupEntries--;
+}
+
+void fs3_dedup_move(uint64_t from, uint64_t to) {
+	uint64_t hash;
+	if(!fs3_dedup_enabled() || from >= dedupSectorsCovered || !dedupIndexed[from]){
+		return;
+	}
+	hash = dedupSectorHash[from];
+	fs3_dedup_remove(from);
+	fs3_dedup_insert(hash, to);
+}
+
+void fs3_dedup_hit(void) {
+	dedupHits++;
+}
+
+int fs3_dedup_close(void) {
+	free(dedupIndex);
+	free(dedupSectorHash);
+	free(dedupIndexed);
+	dedupIndex = NULL;
+	dedupSectorHash = NULL;
+	dedupIndexed = NULL;
+	dedupSectorsCovered = 0;
+	return(0);
+}
+
+int fs3_dedup_log_metrics(void) {
+	logMessage(LOG_OUTPUT_LEVEL, "** FS3 Sector Deduplication **");
+	logMessage(LOG_OUTPUT_LEVEL, "Writes deduplicated  [%10lu]", dedupHits);
+	logMessage(LOG_OUTPUT_LEVEL, "Unique sectors held  [%10lu]", dedupEntries);
+	logMessage(LOG_OUTPUT_LEVEL, "Index slots          [%10lu]", dedupIndexSize);
+	return(0);
+}
@@ -0,0 +1,55 @@
+#ifndef FS3_DEDUP_INCLUDED
+#define FS3_DEDUP_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_dedup.h
+//  Description    : This is the interface for content-addressed sector
+//                   deduplication. Full sector images are hashed and indexed
+//                   by the physical sector holding them, so the driver can
+//                   point a file at an existing copy instead of writing a
+//                   new one.
+//
+
+// Include
+#include <stdint.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_DEDUP_INITIAL_SIZE 1024 // Index slots (and sectors covered) at mount, a power of two
+#define FS3_DEDUP_SEED 0x4653335f44454455ULL // Hash seed ("FS3_DEDU")
+
+//
+// Dedup Functions
+
+int fs3_dedup_init(int enabled, uint64_t sectors);
+	// Reset the index for a disk of "sectors" sectors, dedup is only done while enabled
+
+int fs3_dedup_enabled(void);
+	// Non-zero when writes are deduplicated
+
+uint64_t fs3_dedup_hash(const void *buf);
+	// Hash a full sector image
+
+int64_t fs3_dedup_lookup(uint64_t hash);
+	// The sector indexed under hash, -1 if there is none
+
+void fs3_dedup_insert(uint64_t hash, uint64_t sector);
+	// Index the contents of a sector (replaces whatever it held before)
+
+void fs3_dedup_remove(uint64_t sector);
+	// Forget the contents of a sector that is being rewritten or freed
+
+void fs3_dedup_move(uint64_t from, uint64_t to);
+	// Follow a sector that was moved on disk
+
+void fs3_dedup_hit(void);
+	// Count a write that was satisfied by an existing copy
+
+int fs3_dedup_close(void);
+	// Free the index
+
+int fs3_dedup_log_metrics(void);
+	// Log the writes saved and the size of the index
+
+#endif
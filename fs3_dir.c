@@ -0,0 +1,391 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_dir.c
+//  Description    : This is the implementation of FS3 directories. Each
+//                   directory holds its children in the order they were
+//                   added, for listing, and an open addressing index over
+//                   them keyed by the hash of the child name. A path is
+//                   resolved through the path table without walking its
+//                   components, which are only walked when a directory is
+//                   created. Removed directories are reused by later ones.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_dir.h>
+#include <fs3_names.h>
+#include <fs3_driver.h>
+#include <fs3_journal.h>
+
+//
+// Support Macros/Data
+#define CHILD_MASK(dir) ((dir)->indexSize - 1)
+
+typedef struct {
+	const char *name; // Points into the pooled path of the child
+	uint64_t hash;
+	int8_t isDir;
+} DirEntry;
+
+typedef struct {
+	const char *path;  // Pooled path, NULL once the directory is removed
+	int64_t parent;    // The next removed directory, once this one is removed
+	DirEntry *entries; // Children in the order they were added
+	uint32_t entryCount;
+	uint32_t entryCapacity;
+	uint32_t *index;   // Position + 1 of each child in entries, 0 when the slot is unused
+	uint32_t indexSize;
+	int32_t openCount; // Handles listing the directory
+} Dir;
+
+typedef struct {
+	int64_t dir;   // -1 when the handle is unused
+	uint32_t next; // Position of the next child to list
+} OpenDir;
+
+Dir *dirs = NULL;
+uint32_t dirCount;
+uint32_t dirCapacity;
+int64_t freeDir = -1; // Last removed directory, -1 if none
+OpenDir openDirs[FS3_MAX_OPEN_DIRS];
+
+//
+// Implementation
+
+// The index slot holding a child, or the empty slot it would go in
+static uint32_t *findChild(Dir *dir, const char *name, uint64_t hash) {
+	uint32_t slot, pos;
+	for(slot = hash & CHILD_MASK(dir); (pos = dir->index[slot]) != 0; slot = (slot + 1) & CHILD_MASK(dir)){
+		if(dir->entries[pos - 1].hash == hash && strcmp(dir->entries[pos - 1].name, name) == 0){
+			break;
+		}
+	}
+	return(&dir->index[slot]);
+}
+
+// Doubles the child index of a directory, every child is placed again
+static int growChildIndex(Dir *dir) {
+	uint32_t *index, i, slot;
+	if((index = calloc(dir->indexSize * 2, sizeof(uint32_t))) == NULL){
+		return(-1);
+	}
+	free(dir->index);
+	dir->index = index;
+	dir->indexSize *= 2;
+	for(i = 0; i < dir->entryCount; i++){
+		for(slot = dir->entries[i].hash & CHILD_MASK(dir); dir->index[slot] != 0; slot = (slot + 1) & CHILD_MASK(dir));
+		dir->index[slot] = i + 1;
+	}
+	return(0);
+}
+
+// Adds a child to a directory, -1 if the name is taken
+static int addChild(int64_t d, const char *name, int8_t isDir) {
+	Dir *dir = &dirs[d];
+	uint64_t hash = fs3_names_hash(name);
+	uint32_t capacity;
+	DirEntry *entries;
+	if(*findChild(dir, name, hash) != 0){
+		return(-1);
+	}
+	if(dir->entryCount == dir->entryCapacity){
+		capacity = (dir->entryCapacity > 0) ? dir->entryCapacity * 2 : FS3_DIR_INITIAL_SIZE;
+		if((entries = realloc(dir->entries, sizeof(DirEntry) * capacity)) == NULL){
+			return(-1);
+		}
+		dir->entries = entries;
+		dir->entryCapacity = capacity;
+	}
+	if(2 * (dir->entryCount + 1) > dir->indexSize && growChildIndex(dir) != 0){
+		return(-1);
+	}
+	dir->entries[dir->entryCount].name = name;
+	dir->entries[dir->entryCount].hash = hash;
+	dir->entries[dir->entryCount].isDir = isDir;
+	*findChild(dir, name, hash) = ++dir->entryCount;
+	return(0);
+}
+
+// Takes a child out of a directory. The children after it in its probe run
+// are shifted back, and the last child is moved into its place in the list.
+static int removeChild(int64_t d, const char *name) {
+	Dir *dir = &dirs[d];
+	uint32_t *found = findChild(dir, name, fs3_names_hash(name));
+	uint32_t slot, next, home, pos = *found;
+	DirEntry *last;
+	if(pos == 0){
+		return(-1);
+	}
+	slot = found - dir->index;
+	for(next = (slot + 1) & CHILD_MASK(dir); dir->index[next] != 0; next = (next + 1) & CHILD_MASK(dir)){
+		home = dir->entries[dir->index[next] - 1].hash & CHILD_MASK(dir);
+		if(((next - home) & CHILD_MASK(dir)) >= ((next - slot) & CHILD_MASK(dir))){
+			dir->index[slot] = dir->index[next];
+			slot = next;
+		}
+	}
+	dir->index[slot] = 0;
+	if(pos != dir->entryCount){
+		last = &dir->entries[dir->entryCount - 1];
+		*findChild(dir, last->name, last->hash) = pos;
+		dir->entries[pos - 1] = *last;
+	}
+	dir->entryCount--;
+	return(0);
+}
+
+// Takes a directory id, a removed one if there is one
+static int64_t newDir(const char *path, int64_t parent) {
+	Dir *grown, *dir;
+	uint32_t capacity;
+	int64_t d = freeDir;
+	if(d != -1){
+		freeDir = dirs[d].parent;
+	}else{
+		if(dirCount == dirCapacity){
+			capacity = (dirCapacity > 0) ? dirCapacity * 2 : FS3_DIR_INITIAL_SIZE;
+			if((grown = realloc(dirs, sizeof(Dir) * capacity)) == NULL){
+				return(-1);
+			}
+			dirs = grown;
+			dirCapacity = capacity;
+		}
+		d = dirCount++;
+	}
+	dir = &dirs[d];
+	memset(dir, 0x0, sizeof(Dir));
+	if((dir->index = calloc(FS3_DIR_INITIAL_SIZE, sizeof(uint32_t))) == NULL){
+		dir->parent = freeDir;
+		freeDir = d;
+		return(-1);
+	}
+	dir->indexSize = FS3_DIR_INITIAL_SIZE;
+	dir->path = path;
+	dir->parent = parent;
+	return(d);
+}
+
+// Frees a directory and puts its id on the free list
+static void releaseDir(int64_t d) {
+	free(dirs[d].entries);
+	free(dirs[d].index);
+	dirs[d].entries = NULL;
+	dirs[d].index = NULL;
+	dirs[d].path = NULL;
+	dirs[d].parent = freeDir;
+	freeDir = d;
+}
+
+// Splits a path into the path of its directory (copied to buf) and the
+// offset of its last component, -1 if the path is too long or the last
+// component is empty
+static int32_t splitPath(const char *path, char *buf) {
+	const char *slash = strrchr(path, '/');
+	size_t len = strlen(path);
+	int32_t off = (slash != NULL) ? (int32_t)(slash - path) + 1 : 0;
+	if(len >= FS3_MAX_PATH_LENGTH || path[off] == '\0'){
+		return(-1);
+	}
+	memcpy(buf, path, (off > 0) ? off - 1 : 0);
+	buf[(off > 0) ? off - 1 : 0] = '\0';
+	return(off);
+}
+
+int fs3_dir_init(void) {
+	fs3_dir_close();
+	if(newDir(fs3_names_intern(""), -1) != FS3_DIR_ROOT || fs3_names_bind_dir("", FS3_DIR_ROOT) != 0){
+		logMessage(LOG_ERROR_LEVEL, "Failure allocating the root directory.");
+		return(-1);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_dir_make
+// Description  : Find the directory at a path through the path table, and
+//                only when it is not there create it, walking up to the
+//                first parent that exists
+//
+// Inputs       : path - the directory path, "" for the root
+// Outputs      : the directory, -1 if a file is in the way or on failure
+
+int64_t fs3_dir_make(const char *path) {
+	char parentPath[FS3_MAX_PATH_LENGTH];
+	const char *pooled;
+	int64_t d = fs3_names_lookup_dir(path), parent;
+	int32_t off;
+	if(d != -1){
+		return(d);
+	}
+	if((off = splitPath(path, parentPath)) == -1 || fs3_names_lookup(path) != -1){
+		logMessage(LOG_ERROR_LEVEL, "Cannot create directory [%s].", path);
+		return(-1);
+	}
+	if((parent = fs3_dir_make(parentPath)) == -1 || (pooled = fs3_names_intern(path)) == NULL){
+		return(-1);
+	}
+	if((d = newDir(pooled, parent)) == -1){
+		return(-1);
+	}
+	if(addChild(parent, &pooled[off], 1) != 0 || fs3_names_bind_dir(pooled, d) != 0){
+		releaseDir(d);
+		return(-1);
+	}
+	fs3_journal_dir(pooled, 1);
+	return(d);
+}
+
+int fs3_dir_add(const char *path) {
+	char parentPath[FS3_MAX_PATH_LENGTH];
+	int64_t parent;
+	int32_t off;
+	if((off = splitPath(path, parentPath)) == -1 || (parent = fs3_dir_make(parentPath)) == -1){
+		return(-1);
+	}
+	return(addChild(parent, &path[off], 0));
+}
+
+int fs3_dir_remove(const char *path) {
+	char parentPath[FS3_MAX_PATH_LENGTH];
+	int64_t parent;
+	int32_t off;
+	if((off = splitPath(path, parentPath)) == -1 || (parent = fs3_names_lookup_dir(parentPath)) == -1){
+		return(-1);
+	}
+	return(removeChild(parent, &path[off]));
+}
+
+uint32_t fs3_dir_count(void) {
+	return(dirCount);
+}
+
+const char *fs3_dir_path(uint32_t dir) {
+	return((dir < dirCount) ? dirs[dir].path : NULL);
+}
+
+int fs3_dir_close(void) {
+	uint32_t i;
+	for(i = 0; i < FS3_MAX_OPEN_DIRS; i++){
+		openDirs[i].dir = -1;
+	}
+	for(i = 0; i < dirCount; i++){
+		free(dirs[i].entries);
+		free(dirs[i].index);
+	}
+	free(dirs);
+	dirs = NULL;
+	dirCount = 0;
+	dirCapacity = 0;
+	freeDir = -1;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_mkdir
+// Description  : FS3 interface, create a directory
+//
+// Inputs       : path - the directory path, its parent must exist
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t fs3_mkdir(const char *path) {
+	char parentPath[FS3_MAX_PATH_LENGTH];
+	if(dirs == NULL || splitPath(path, parentPath) == -1 || fs3_names_lookup_dir(parentPath) == -1 ||
+			fs3_names_lookup_dir(path) != -1){
+		logMessage(LOG_ERROR_LEVEL, "Cannot create directory [%s].", path);
+		return(-1);
+	}
+	if(fs3_dir_make(path) == -1){
+		return(-1);
+	}
+	fs3_journal_tick();
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_rmdir
+// Description  : FS3 interface, remove a directory
+//
+// Inputs       : path - the directory path, it must be empty and not open
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t fs3_rmdir(const char *path) {
+	char parentPath[FS3_MAX_PATH_LENGTH];
+	int64_t d = (dirs != NULL) ? fs3_names_lookup_dir(path) : -1;
+	if(d == -1 || d == FS3_DIR_ROOT || dirs[d].entryCount > 0 || dirs[d].openCount > 0){
+		logMessage(LOG_ERROR_LEVEL, "Cannot remove directory [%s].", path);
+		return(-1);
+	}
+	removeChild(dirs[d].parent, &path[splitPath(path, parentPath)]);
+	fs3_names_bind_dir(path, -1);
+	releaseDir(d);
+	fs3_journal_dir(path, 0);
+	fs3_journal_tick();
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_opendir
+// Description  : FS3 interface, open a directory for listing
+//
+// Inputs       : path - the directory path, "" for the root
+// Outputs      : directory handle if successful, -1 if failure
+
+int32_t fs3_opendir(const char *path) {
+	int64_t d = (dirs != NULL) ? fs3_names_lookup_dir(path) : -1;
+	int32_t dh;
+	if(d == -1){
+		return(-1);
+	}
+	for(dh = 0; dh < FS3_MAX_OPEN_DIRS && openDirs[dh].dir != -1; dh++);
+	if(dh == FS3_MAX_OPEN_DIRS){
+		logMessage(LOG_ERROR_LEVEL, "Cannot open directory [%s], too many open.", path);
+		return(-1);
+	}
+	openDirs[dh].dir = d;
+	openDirs[dh].next = 0;
+	dirs[d].openCount++;
+	return(dh);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_readdir
+// Description  : FS3 interface, list the next child of a directory. Children
+//                removed while the directory is listed may move a later
+//                child ahead of the cursor, so it is not listed.
+//
+// Inputs       : dh - the directory handle
+//                entry - filled with the child
+// Outputs      : 1 if a child was listed, 0 at the end, -1 if failure
+
+int16_t fs3_readdir(int32_t dh, FS3DirEntry *entry) {
+	Dir *dir;
+	if(dh < 0 || dh >= FS3_MAX_OPEN_DIRS || openDirs[dh].dir == -1){
+		return(-1);
+	}
+	dir = &dirs[openDirs[dh].dir];
+	if(openDirs[dh].next >= dir->entryCount){
+		return(0);
+	}
+	entry->name = dir->entries[openDirs[dh].next].name;
+	entry->isDir = dir->entries[openDirs[dh].next].isDir;
+	openDirs[dh].next++;
+	return(1);
+}
+
+int16_t fs3_closedir(int32_t dh) {
+	if(dh < 0 || dh >= FS3_MAX_OPEN_DIRS || openDirs[dh].dir == -1){
+		return(-1);
+	}
+	dirs[openDirs[dh].dir].openCount--;
+	openDirs[dh].dir = -1;
+	return(0);
+}
@@ -0,0 +1,70 @@
+#ifndef FS3_DIR_INCLUDED
+#define FS3_DIR_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_dir.h
+//  Description    : This is the interface for FS3 directories. Every directory
+//                   keeps a hash index of its own children, and directories
+//                   are found through the path table, so opening or listing a
+//                   directory costs time in its own entries only. Creating a
+//                   file creates the directories above it that are missing.
+//
+
+// Include
+#include <stdint.h>
+
+// Defines
+#define FS3_DIR_ROOT 0 // The root directory, its path is ""
+#define FS3_DIR_INITIAL_SIZE 8 // Child index slots of a new directory, a power of two
+#define FS3_MAX_OPEN_DIRS 64 // Directories open for listing at once
+
+// One child of a directory, as returned by fs3_readdir
+typedef struct {
+	const char *name; // Last component of the child path, valid until unmount
+	int8_t isDir;
+} FS3DirEntry;
+
+//
+// Directory Functions
+
+int fs3_dir_init(void);
+	// Reset the directories to an empty root, after the path table
+
+int64_t fs3_dir_make(const char *path);
+	// Find the directory at a path, creating it and any missing parents, -1 on failure
+
+int fs3_dir_add(const char *path);
+	// Enter a file in its directory, creating the missing parents
+
+int fs3_dir_remove(const char *path);
+	// Take a file out of its directory
+
+uint32_t fs3_dir_count(void);
+	// Directory ids handed out, the root included
+
+const char *fs3_dir_path(uint32_t dir);
+	// The path of a directory, NULL if it was removed
+
+int fs3_dir_close(void);
+	// Free every directory
+
+//
+// Interface Functions
+
+int16_t fs3_mkdir(const char *path);
+	// Create a directory, its parent must exist
+
+int16_t fs3_rmdir(const char *path);
+	// Remove an empty directory that is not open
+
+int32_t fs3_opendir(const char *path);
+	// Open a directory for listing, returns a directory handle
+
+int16_t fs3_readdir(int32_t dh, FS3DirEntry *entry);
+	// Fill entry with the next child, 1 if there was one, 0 at the end, -1 on failure
+
+int16_t fs3_closedir(int32_t dh);
+	// Close a directory handle
+
+#endif
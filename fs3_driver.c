@@ -10,24 +10,59 @@
 
 // 
 // Includes
+#include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/uio.h>
 
 // Project File Includes
 #include <fs3_driver.h>
+#include <fs3_metrics.h>
+#include <fs3_latency.h>
+#include <fs3_snapshot.h>
+#include <fs3_dedup.h>
+#include <fs3_compress.h>
+#include <fs3_checksum.h>
+#include <fs3_names.h>
+#include <fs3_dir.h>
+#include <fs3_journal.h>
 #include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
 
 //
 // Defines
 #define SECTOR_INDEX_NUMBER(x) ((int)(x/POS_ENDOF_FILE))
+#define FS3_UNIT_FILE_MAX (8 * POS_ENDOF_FILE) // Largest file written by the unit tests
+#define FS3_UNIT_CLONES 300 // More clones than a shared sector can count
+#define FS3_UNIT_FILLERS 40 // Files written over the sectors the clones gave back
+#define FS3_UNIT_CACHE 16
+#define FS3_UNIT_JOURNAL 64 // Metadata area of the crash test
 
 //
 // Global Vars
 
 // Counters
-int32_t lastAssignedHandle;
 int32_t createdFilesSize;
 uint64_t assignedSectors;
+uint64_t freeSectors;
+uint32_t currentTrack;
+uint32_t inlineThreshold = FS3_INLINE_MAX;
+uint32_t packThreshold = 0;
+uint32_t compressThreshold = 0;
+int8_t dedupWrites = 0;
+int8_t checksumSectors = 0;
+
+// Disk geometry, the one asked for is taken at the next mount
+uint32_t fs3Tracks, fs3TrackSize;
+uint64_t fs3DiskSectors;
+uint64_t fs3DiskOffset;
+uint32_t geometryTracks = FS3_MAX_TRACKS;
+uint32_t geometryTrackSize = FS3_TRACK_SIZE;
+
+// Tail packing state, slots are handed out from the end of one shared sector at a time
+uint64_t packSector;
+uint16_t packUsed;
+int8_t packWritten;
 
 // CmdBlk Vars
 const int OPCODE_POS = 60;
@@ -37,8 +72,14 @@ const int RETURN = 11;
 
 //
 // Data Structures
-File *createdFiles;
-uint32_t fileAt[FS3_MAX_TRACKS][FS3_TRACK_SIZE];
+File **fileSlabs;       // Hot halves of the file records, FS3_FILE_SLAB_SIZE per slab
+FileCold **coldSlabs;   // Cold halves, in step with fileSlabs
+uint32_t fileSlabCount;
+uint32_t *freeSlots;    // Slots of unlinked files, reused before the table grows
+uint32_t freeSlotCount;
+uint32_t freeSlotCapacity;
+FS3TrackMeta **trackMeta;
+uint32_t metaTracks; // Tracks with a sector map, always the first ones
 
 // IMPLEMENTATION
 
@@ -64,11 +105,11 @@ int16_t deconstruct_fs3_cmdblk(FS3CmdBlk cmdblk, uint8_t *op, uint16_t *sec, uin
 
 //
 // Data Structure Functions
-int16_t setFileInfo(File *file, char *path, int32_t length){
+int16_t setFileInfo(File *file, const char *path, int32_t length){
 	file->length = length;
-	strcpy(file->path, path);
-	file->readCount = 0;
-	file->sectorCount = 1;
+	file->cold->path = path;
+	file->sectorCount = 0;
+	file->isInline = (inlineThreshold > 0);
 	return(0);
 }
 int16_t setOpenInfo(File *file, int8_t isOpen, int32_t handle, uint64_t pos){
@@ -79,49 +120,308 @@ int16_t setOpenInfo(File *file, int8_t isOpen, int32_t handle, uint64_t pos){
 }
 
 int16_t init(){
-	int16_t i, j;
 	// Initial variable declaration
-	lastAssignedHandle = FS3_STARTING_HANDLE - 1;
 	createdFilesSize = 0;
 	assignedSectors = 0;
-	// Mallocing arrays for the structures
-	createdFiles = ((malloc(sizeof(File) * FS3_FILE_ARR_STEPSIZE)));
-	// Makes sure all elements of fileAt are initially zero;
-	for(i = 0; i < FS3_MAX_TRACKS; i++){
-		for(j = 0; j < FS3_TRACK_SIZE; j++){
-			fileAt[i][j] = -1;
-		}
+	freeSectors = 0;
+	currentTrack = FS3_UNKNOWN_TRACK;
+	fs3Tracks = geometryTracks;
+	fs3TrackSize = geometryTrackSize;
+	fs3DiskSectors = (uint64_t)fs3Tracks * fs3TrackSize;
+	// The metadata journal keeps the first sectors of the disk to itself, next to
+	// where the allocator puts the data, and the driver's disk starts after them
+	fs3DiskOffset = fs3_journal_init(fs3DiskSectors);
+	fs3DiskSectors -= fs3DiskOffset;
+	packSector = UINT64_MAX;
+	packUsed = FS3_SECTOR_SIZE;
+	fs3_metrics_init();
+	fs3_latency_init();
+	fs3_compress_init();
+	// The file slabs and the sector maps of a track are only made once they are used
+	fileSlabs = NULL;
+	coldSlabs = NULL;
+	fileSlabCount = 0;
+	freeSlots = NULL;
+	freeSlotCount = 0;
+	freeSlotCapacity = 0;
+	trackMeta = calloc(fs3Tracks, sizeof(FS3TrackMeta *));
+	metaTracks = 0;
+	if(trackMeta == NULL || fs3_names_init() != 0 || fs3_dir_init() != 0){
+		logMessage(LOG_ERROR_LEVEL, "Failure allocating the path table and sector maps.");
+		return(-1);
 	}
+	fs3_dedup_init(dedupWrites, fs3DiskSectors);
+	fs3_checksum_init(checksumSectors, fs3Tracks, fs3TrackSize);
 	return(0);
 }
 
-int8_t isFileOpen(int32_t handle){
-	int8_t ret = -1;
-	if(createdFiles[handle - FS3_STARTING_HANDLE].isOpen){
-		ret = 0;
+int16_t growFileTable(uint32_t slots){
+	uint32_t i, count = (slots + FS3_FILE_SLAB_SIZE - 1) / FS3_FILE_SLAB_SIZE;
+	File **hot;
+	FileCold **cold;
+	if(count <= fileSlabCount){
+		return 0;
 	}
-	return ret;
+	// Only the slab pointers move, the records stay where they are
+	if((hot = realloc(fileSlabs, sizeof(File *) * count)) == NULL){
+		return -1;
+	}
+	fileSlabs = hot;
+	if((cold = realloc(coldSlabs, sizeof(FileCold *) * count)) == NULL){
+		return -1;
+	}
+	coldSlabs = cold;
+	for(; fileSlabCount < count; fileSlabCount++){
+		fileSlabs[fileSlabCount] = calloc(FS3_FILE_SLAB_SIZE, sizeof(File));
+		coldSlabs[fileSlabCount] = calloc(FS3_FILE_SLAB_SIZE, sizeof(FileCold));
+		if(fileSlabs[fileSlabCount] == NULL || coldSlabs[fileSlabCount] == NULL){
+			free(fileSlabs[fileSlabCount]);
+			free(coldSlabs[fileSlabCount]);
+			logMessage(LOG_ERROR_LEVEL, "Failure allocating file slab %u.", fileSlabCount);
+			return -1;
+		}
+		for(i = 0; i < FS3_FILE_SLAB_SIZE; i++){
+			fileSlabs[fileSlabCount][i].cold = &coldSlabs[fileSlabCount][i];
+		}
+	}
+	return 0;
 }
 
-int8_t findLoc(uint64_t pos, uint32_t fd, int32_t *track, int32_t *sector){
-	int i, j;
-	int ignoreSectors = pos / POS_ENDOF_FILE;
-	for(i = 0; i < FS3_MAX_TRACKS; i++){
-		for(j = 0; j < FS3_TRACK_SIZE; j++){
-			if(fileAt[i][j] == fd){
-				if(ignoreSectors == 0){
-					*track = i;
-					*sector = j;
-					break;
-				}else if(ignoreSectors > 0){
-					ignoreSectors--;
-				}
+// Puts the slot of an unlinked file on the free list
+static int16_t pushFreeSlot(uint32_t slot){
+	uint32_t capacity = (freeSlotCapacity > 0) ? freeSlotCapacity * 2 : FS3_FILE_SLAB_SIZE;
+	uint32_t *slots;
+	if(freeSlotCount == freeSlotCapacity){
+		if((slots = realloc(freeSlots, sizeof(uint32_t) * capacity)) == NULL){
+			return -1;
+		}
+		freeSlots = slots;
+		freeSlotCapacity = capacity;
+	}
+	freeSlots[freeSlotCount++] = slot;
+	return 0;
+}
+
+int32_t createFile(char *path){
+	const char *name;
+	int32_t handle;
+	uint32_t slot;
+	File *file;
+	FileCold *cold;
+	// The file goes in its directory first, which fails if a directory has the name
+	if(strlen(path) >= FS3_MAX_PATH_LENGTH || (name = fs3_names_intern(path)) == NULL || fs3_dir_add(name) != 0){
+		logMessage(LOG_ERROR_LEVEL, "Cannot create [%s], bad path.", path);
+		return -1;
+	}
+	// A reused slot gets the next generation, so old handles to it go stale
+	if(freeSlotCount > 0){
+		slot = freeSlots[--freeSlotCount];
+		handle = FS3_MAKE_HANDLE(slot, FS3_HANDLE_GENERATION(FILE_AT(slot)->handle) + 1);
+	}else if(createdFilesSize >= FS3_MAX_TOTAL_FILES || growFileTable(createdFilesSize + 1) != 0){
+		logMessage(LOG_ERROR_LEVEL, "Cannot create [%s], the file table is full.", path);
+		fs3_dir_remove(name);
+		return -1;
+	}else{
+		slot = createdFilesSize++;
+		handle = FS3_MAKE_HANDLE(slot, 0);
+	}
+	file = FILE_AT(slot);
+	cold = file->cold;
+	memset(file, 0x0, sizeof(File));
+	memset(cold, 0x0, sizeof(FileCold));
+	file->cold = cold;
+	setFileInfo(file, name, 0);
+	setOpenInfo(file, 0, handle, 0);
+	fs3_names_bind(name, slot);
+	fs3_journal_touch(slot, 0);
+	return handle;
+}
+
+File *fileFromHandle(int32_t handle){
+	File *file;
+	if(handle < FS3_STARTING_HANDLE || FS3_HANDLE_SLOT(handle) >= (uint32_t)createdFilesSize){
+		return NULL;
+	}
+	file = FILE_AT(FS3_HANDLE_SLOT(handle));
+	return (file->handle == handle && !file->isDeleted) ? file : NULL;
+}
+
+int16_t rebuildFileIndex(void){
+	int32_t i;
+	freeSlotCount = 0;
+	for(i = 0; i < createdFilesSize; i++){
+		if(FILE_AT(i)->isDeleted){
+			if(pushFreeSlot(i) != 0){
+				return -1;
 			}
+		}else if(fs3_names_bind(FILE_AT(i)->cold->path, i) != 0 || fs3_dir_add(FILE_AT(i)->cold->path) != 0){
+			return -1;
 		}
 	}
 	return 0;
 }
 
+int8_t findLoc(uint64_t pos, uint32_t fd, int32_t *track, int32_t *sector){
+	File *file = FILE_AT(FS3_HANDLE_SLOT(fd));
+	uint32_t idx = pos / POS_ENDOF_FILE;
+	if(idx >= (uint32_t)file->sectorCount){
+		return -1;
+	}
+	*track = FS3_BLOCK_SECTOR(file->sectorList[idx]) / fs3TrackSize;
+	*sector = FS3_BLOCK_SECTOR(file->sectorList[idx]) % fs3TrackSize;
+	return 0;
+}
+
+//
+// Bus Functions
+int16_t fs3_bus_command(uint8_t op, uint16_t sec, uint32_t track, void *buf){
+	uint8_t returnedOp, returnedRet;
+	uint16_t returnedSec;
+	uint32_t returnedTrack;
+	// Packs the command, sends it to hardware and unpacks the response
+	FS3CmdBlk command = construct_fs3_cmdblk(op, sec, track, 0);
+	fs3_metrics_bus_op(op);
+	command = fs3_syscall(command, buf);
+	fs3_latency_charge(op, track);
+	return deconstruct_fs3_cmdblk(command, &returnedOp, &returnedSec, &returnedTrack, &returnedRet);
+}
+int16_t fs3_bus_seek(uint32_t track){
+	int16_t ret = 0;
+	// The controller keeps the head where the last seek left it, so only move it when needed
+	if(track == currentTrack){
+		fs3_metrics_seek(1);
+	}else{
+		fs3_metrics_seek(0);
+		ret = fs3_bus_command(FS3_OP_TSEEK, 0, track, NULL);
+		currentTrack = (ret == 0) ? track : FS3_UNKNOWN_TRACK;
+	}
+	return ret;
+}
+// Moves a sector of the driver's disk past the metadata area in front of it
+static void physicalSector(uint32_t *track, uint16_t *sect){
+	uint64_t idx = (uint64_t)*track * fs3TrackSize + *sect + fs3DiskOffset;
+	*track = idx / fs3TrackSize;
+	*sect = idx % fs3TrackSize;
+}
+// Sends one sector command to the unit of the array that holds the sector,
+// or to the disk
+static int16_t sectorCommand(uint8_t op, uint32_t track, uint16_t sect, void *buf){
+	FS3ArrayOp command = { .op = op, .track = track, .sect = sect, .buf = buf };
+	int16_t ret;
+	physicalSector(&command.track, &command.sect);
+	if(fs3_array_devices() > 1){
+		return fs3_array_io(&command);
+	}
+	if((ret = fs3_bus_seek(command.track)) == 0){
+		ret = fs3_bus_command(op, command.sect, 0, buf);
+	}
+	return ret;
+}
+int16_t fs3_bus_read(uint32_t track, uint16_t sect, void *buf){
+	int16_t ret = 0;
+	// Sectors still held by a warm-start image are served from it
+	if(fs3_snapshot_fetch(track, sect, buf) != 0){
+		ret = sectorCommand(FS3_OP_RDSECT, track, sect, buf);
+	}
+	// A sector that does not match what was written is as good as a failed read
+	if(ret == 0 && fs3_checksum_verify(track, sect, buf) != 0){
+		ret = -1;
+	}
+	return ret;
+}
+int16_t fs3_bus_write(uint32_t track, uint16_t sect, void *buf){
+	int16_t ret = sectorCommand(FS3_OP_WRSECT, track, sect, buf);
+	if(ret == 0){
+		fs3_snapshot_release(track, sect);
+		fs3_checksum_record(track, sect, buf);
+	}
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_bus_submit
+// Description  : Issues a batch of sector reads and writes. On an array the
+//                units work through the batch side by side, on a plain disk
+//                the commands go one after the other.
+//
+// Inputs       : ops - the commands, each gets its ret filled in
+//                count - the number of commands
+// Outputs      : 0 if every command succeeded, -1 otherwise
+
+int16_t fs3_bus_submit(FS3ArrayOp *ops, uint32_t count){
+	FS3ArrayOp *issue;
+	uint32_t *from, i, n = 0;
+	int16_t ret = 0;
+	if(fs3_array_devices() <= 1){
+		for(i = 0; i < count; i++){
+			ops[i].ret = (ops[i].op == FS3_OP_RDSECT) ? fs3_bus_read(ops[i].track, ops[i].sect, ops[i].buf) :
+				fs3_bus_write(ops[i].track, ops[i].sect, ops[i].buf);
+			ret |= ops[i].ret;
+		}
+		return ret;
+	}
+	if((issue = malloc(sizeof(FS3ArrayOp) * count)) == NULL || (from = malloc(sizeof(uint32_t) * count)) == NULL){
+		free(issue);
+		return -1;
+	}
+	// Sectors still held by a warm-start image do not go to the units
+	for(i = 0; i < count; i++){
+		ops[i].ret = 0;
+		if(ops[i].op != FS3_OP_RDSECT || fs3_snapshot_fetch(ops[i].track, ops[i].sect, ops[i].buf) != 0){
+			from[n] = i;
+			issue[n] = ops[i];
+			physicalSector(&issue[n].track, &issue[n].sect);
+			n++;
+		}
+	}
+	if(n > 0){
+		fs3_array_submit(issue, n);
+	}
+	for(i = 0; i < n; i++){
+		ops[from[i]].ret = issue[i].ret;
+	}
+	for(i = 0; i < count; i++){
+		if(ops[i].ret == 0 && ops[i].op == FS3_OP_RDSECT && fs3_checksum_verify(ops[i].track, ops[i].sect, ops[i].buf) != 0){
+			ops[i].ret = -1;
+		}else if(ops[i].ret == 0 && ops[i].op == FS3_OP_WRSECT){
+			fs3_snapshot_release(ops[i].track, ops[i].sect);
+			fs3_checksum_record(ops[i].track, ops[i].sect, ops[i].buf);
+		}
+		ret |= ops[i].ret;
+	}
+	free(issue);
+	free(from);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_bus_submit_raw
+// Description  : Issues a batch of sector commands on the whole disk, the
+//                metadata area in front of the driver's disk included. No
+//                warm-start image or checksums are involved, the journal
+//                keeps its own.
+//
+// Inputs       : ops - the commands, tracks and sectors of the whole disk
+//                count - the number of commands
+// Outputs      : 0 if every command succeeded, -1 otherwise
+
+int16_t fs3_bus_submit_raw(FS3ArrayOp *ops, uint32_t count){
+	int16_t ret = 0;
+	uint32_t i;
+	if(fs3_array_devices() > 1){
+		return fs3_array_submit(ops, count);
+	}
+	for(i = 0; i < count; i++){
+		if((ops[i].ret = fs3_bus_seek(ops[i].track)) == 0){
+			ops[i].ret = fs3_bus_command(ops[i].op, ops[i].sect, 0, ops[i].buf);
+		}
+		ret |= ops[i].ret;
+	}
+	return ret;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_mount_disk
@@ -131,14 +431,64 @@ int8_t findLoc(uint64_t pos, uint32_t fd, int32_t *track, int32_t *sector){
 // Outputs      : 0 if successful, -1 if failure
 
 int32_t fs3_mount_disk(void) {
+	return mountDisk(1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mountDisk
+// Description  : Mounts the disk, with the file table read back from the
+//                metadata journal when there is one and recover is set
+//
+// Inputs       : recover - 0 to start from an empty file table
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t mountDisk(int8_t recover) {
 	// Initializes data structures
-	init();
-	// Packs mount command 
-	FS3CmdBlk command = construct_fs3_cmdblk(FS3_OP_MOUNT, 0, 0, 0);
-	// Sends it to hardware
-	fs3_syscall(command, NULL);
-	return 0;
+	if(init() != 0){
+		return -1;
+	}
+	// Sends mount command to hardware, or to every unit of the array
+	if(fs3_array_devices() > 1){
+		if(fs3_array_mount(fs3Tracks, fs3TrackSize) != 0){
+			return -1;
+		}
+	}else if(fs3_bus_command(FS3_OP_MOUNT, 0, 0, NULL) != 0){
+		return -1;
+	}
+	return (fs3_journal_mount(recover) == 0) ? 0 : -1;
+}
 
+// Frees the file table, the sector maps and the per-sector state of the disk
+static void freeTables(void){
+	int32_t i;
+	// Free malloc-ed data structure
+	for(i = 0; i < createdFilesSize; i++){
+		free(FILE_AT(i)->sectorList);
+		free(FILE_AT(i)->cold->appendData);
+	}
+	for(i = 0; i < (int32_t)fileSlabCount; i++){
+		free(fileSlabs[i]);
+		free(coldSlabs[i]);
+	}
+	free(fileSlabs);
+	free(coldSlabs);
+	free(freeSlots);
+	fileSlabs = NULL;
+	coldSlabs = NULL;
+	fileSlabCount = 0;
+	createdFilesSize = 0;
+	fs3_dir_close();
+	fs3_names_close();
+	for(i = 0; i < (int32_t)metaTracks; i++){
+		free(trackMeta[i]);
+	}
+	free(trackMeta);
+	trackMeta = NULL;
+	metaTracks = 0;
+	fs3_snapshot_close();
+	fs3_dedup_close();
+	fs3_checksum_close();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -150,12 +500,21 @@ int32_t fs3_mount_disk(void) {
 // Outputs      : 0 if successful, -1 if failure
 
 int32_t fs3_unmount_disk(void){
-	// Free malloc-ed data structure
-	free(createdFiles);
-	// Packs unmount command 
-	FS3CmdBlk command = construct_fs3_cmdblk(FS3_OP_UMOUNT, 0, 0, 0);
-	// Sends it to hardware
-	fs3_syscall(command, NULL);
+	if(fs3_flush_appends() != 0){
+		logMessage(LOG_WARNING_LEVEL, "Appends of some files were lost at unmount.");
+	}
+	// The checkpoint written here leaves nothing to replay at the next mount
+	if(fs3_journal_unmount() != 0){
+		logMessage(LOG_WARNING_LEVEL, "Journal checkpoint failed at unmount.");
+	}
+	freeTables();
+	// Sends unmount command to hardware
+	if(fs3_array_devices() > 1){
+		return (fs3_array_unmount() == 0) ? 0 : -1;
+	}
+	if(fs3_bus_command(FS3_OP_UMOUNT, 0, 0, NULL) != 0){
+		return -1;
+	}
 	return 0;
 }
 
@@ -164,45 +523,33 @@ int32_t fs3_unmount_disk(void){
 // Inputs       : path - filename of the file to open
 // Outputs      : file handle if successful, -1 if failure
 
-int16_t fs3_open(char *path) {
-	int32_t i = 0, handle = 0;
-	int8_t fileNotFound = 1;
-	// Check if path is included in created files
-	while(fileNotFound && i < createdFilesSize){
-		// If the file does exist checks to see if there is an associated open file
-		if(strcmp(createdFiles[i].path, path) == 0){
-			fileNotFound = 0;
-			handle = i + FS3_STARTING_HANDLE;
-			// If there is no open file creates one;
-			if(!createdFiles[i].isOpen){
-				// Adds the new open file to the open file linked list
-				File *file = &createdFiles[i];
-				setOpenInfo(file, 1, handle, 0);
-			} else{
-				logMessage(DEFAULT_LOG_LEVEL, "File is already open.");
-			}
+int32_t fs3_open(char *path) {
+	int64_t slot = fs3_names_lookup(path);
+	int32_t handle;
+	File *file;
+	// Check if path belongs to a created file
+	if(slot != -1){
+		file = FILE_AT(slot);
+		handle = file->handle;
+		// If there is no open file creates one;
+		if(!file->isOpen){
+			setOpenInfo(file, 1, handle, 0);
+		} else{
+			logMessage(DEFAULT_LOG_LEVEL, "File is already open.");
+		}
+	}else{
+		// If the file still has not been created, create it;
+		uint64_t loc;
+		if((handle = createFile(path)) == -1){
+			return -1;
 		}
-		i++;
-	}
-	// If the file still has not been created, create it;
-	if(fileNotFound){
-		// Set handle
-		handle = lastAssignedHandle + 1;
-		lastAssignedHandle++;
-		// Set Loc
-		fileAt[assignedSectors / FS3_SECTOR_SIZE][assignedSectors % FS3_SECTOR_SIZE] = handle;
-		assignedSectors++;
-		// Init new file
-		File file;
-		if((createdFilesSize + 1) % FS3_FILE_ARR_STEPSIZE == 0){
-			createdFiles = realloc(createdFiles, (createdFilesSize + 1 + FS3_FILE_ARR_STEPSIZE) * (sizeof(File)));
-			assert(createdFiles != NULL);
-		}
-		memcpy(&createdFiles[handle - FS3_STARTING_HANDLE], &file, sizeof(File));
-		// Add in file and open info
-		setFileInfo(&createdFiles[handle - FS3_STARTING_HANDLE], path, 0);
-		setOpenInfo(&createdFiles[handle - FS3_STARTING_HANDLE], 1, handle, 0);
-		createdFilesSize++;
+		file = FILE_AT(FS3_HANDLE_SLOT(handle));
+		file->isOpen = 1;
+		// Set Loc, inline files get their first sector when they outgrow the record
+		if(!file->isInline && packThreshold == 0){
+			resolveSectors(handle, 0, 1, &loc, 1);
+		}
+		fs3_journal_tick();
 	}
 	return handle;
 }
@@ -215,200 +562,1695 @@ int16_t fs3_open(char *path) {
 // Inputs       : fd - the file handle
 // Outputs      : 0 if successful, -1 if failure
 
-int16_t fs3_close(int16_t fd) {
+int16_t fs3_close(int32_t fd) {
 	int8_t ret = -1;
-	if(fd <= lastAssignedHandle){
-		File *file = &createdFiles[fd - FS3_STARTING_HANDLE];
-		if(file->isOpen){
+	File *file = fileFromHandle(fd);
+	if(file != NULL){
+		// The file stays open while its appends cannot be written
+		if(file->isOpen && flushAppend(file) == 0){
+			free(file->cold->appendData);
+			file->cold->appendData = NULL;
 			file->isOpen = 0;
 			ret = 0;
 		}
+		fs3_journal_tick();
 	}
 	return ret;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : fs3_read
-// Description  : Reads "count" bytes from the file handle "fh" into the 
-//                buffer "buf"
-//
-// Inputs       : fd - filename of the file to read from
-//                buf - pointer to buffer to read into
-//                count - number of bytes to read
-// Outputs      : bytes read if successful, -1 if failure
+int16_t growSectorMap(uint64_t sectors){
+	uint32_t words = (fs3TrackSize + 63) / 64;
+	FS3TrackMeta *meta;
+	char *mem;
+	while((uint64_t)metaTracks * fs3TrackSize < sectors){
+		// One block per track, the bitmap first so it stays aligned
+		mem = calloc(1, sizeof(FS3TrackMeta) + sizeof(uint64_t) * words + (sizeof(uint16_t) * 2 + sizeof(uint8_t)) * fs3TrackSize);
+		if(mem == NULL){
+			logMessage(LOG_ERROR_LEVEL, "Failure allocating the sector map of track %u.", metaTracks);
+			return -1;
+		}
+		meta = (FS3TrackMeta *)mem;
+		meta->freeMap = (uint64_t *)(mem + sizeof(FS3TrackMeta));
+		meta->owner = (uint16_t *)(meta->freeMap + words);
+		meta->refs = meta->owner + fs3TrackSize;
+		meta->packRefs = (uint8_t *)(meta->refs + fs3TrackSize);
+		memset(meta->owner, 0xFF, sizeof(uint16_t) * fs3TrackSize);
+		trackMeta[metaTracks++] = meta;
+	}
+	return 0;
+}
 
-int32_t fs3_read(int16_t fd, void *buf, int32_t count) {
-	int32_t sect, track, bytesRead = -1;
-	uint8_t returnedOp, returnedRet, errorCheck = 0;
-	uint16_t returnedSec;
-	uint32_t returnedTrack;
-	uint64_t pos;
-	// Empties buffer
-	char *sectBuf[FS3_SECTOR_SIZE];
-	void *sectContent = (void *)sectBuf;
-	// If the file is open reads
-	if(fd <= lastAssignedHandle){
-		// Creates pointer to corresponding file
-		File *file = &createdFiles[fd - FS3_STARTING_HANDLE];
-		// Checks if file is open then proceeds with read if true
-		if(file->isOpen){
-			pos = file->pos;
-			findLoc(pos, fd, &track, &sect);
-			// Checks if read will go into another sector;
-			if(((count +  pos) / POS_ENDOF_FILE) != ((pos) / POS_ENDOF_FILE)){
-				bytesRead = POS_ENDOF_FILE - (pos % POS_ENDOF_FILE);
-			}
-			// Checks if read will go over the file length
-			if((bytesRead + pos) > file->length){
-				bytesRead = file->length - pos;
-			}
-			// Checks if read is limited to just the current sector.
-			if(bytesRead == -1){
-				bytesRead = count;
-			}
-			// Checks if pos isn't at the end of file, if not, follows through with read
-			if(bytesRead > 0){
-				void *cacheBuf = fs3_get_cache(track, sect);
-				if(cacheBuf == NULL){
-					FS3CmdBlk seekCommand = construct_fs3_cmdblk(FS3_OP_TSEEK, 0, track, 0);
-					FS3CmdBlk readCommand = construct_fs3_cmdblk(FS3_OP_RDSECT, sect, 0, 0);
-					// Seeks to the correct track
-					seekCommand = fs3_syscall(seekCommand, NULL);
-					errorCheck += deconstruct_fs3_cmdblk(seekCommand, &returnedOp, &returnedSec, &returnedTrack, &returnedRet);
-					// Reads
-					readCommand = fs3_syscall(readCommand, sectContent);
-					errorCheck += deconstruct_fs3_cmdblk(readCommand, &returnedOp, &returnedSec, &returnedTrack, &returnedRet);
-					// Copies the requested bytes into the user buffer
-					fs3_put_cache(track, sect, sectContent);
-					memcpy(buf, &((char *)sectContent)[pos % POS_ENDOF_FILE], bytesRead);
-					// Updates position of open file
-					file->pos += bytesRead;
-				}else{
-					memcpy(buf, &((char *)cacheBuf)[pos % POS_ENDOF_FILE], bytesRead);
-					file->pos += bytesRead;
+// Records the owner of a sector, keeping the free map of its track in step.
+// A sector is in the free map while it is free and below assignedSectors.
+static void setOwner(uint64_t idx, uint16_t owner){
+	FS3TrackMeta *meta = TRACK_META(idx);
+	uint32_t sct = idx % fs3TrackSize;
+	uint64_t bit = (uint64_t)1 << (sct % 64);
+	int8_t isFree = (owner == FS3_FREE_SECTOR && idx < assignedSectors);
+	meta->owner[sct] = owner;
+	if(isFree && !(meta->freeMap[sct / 64] & bit)){
+		meta->freeMap[sct / 64] |= bit;
+		meta->freeCount++;
+	}else if(!isFree && (meta->freeMap[sct / 64] & bit)){
+		meta->freeMap[sct / 64] &= ~bit;
+		meta->freeCount--;
+	}
+}
+
+// Finds a free sector from "from" onwards, wrapping around to the start of
+// the disk. Tracks without free sectors are skipped on their count.
+static int64_t findFreeSector(uint64_t from){
+	uint64_t tracks = (assignedSectors + fs3TrackSize - 1) / fs3TrackSize;
+	uint64_t trk = from / fs3TrackSize, mask = ~(uint64_t)0 << (from % fs3TrackSize % 64), bits, n;
+	uint32_t words = (fs3TrackSize + 63) / 64, w = (from % fs3TrackSize) / 64;
+	// The first track is looked at twice, the second time for what lies before "from"
+	for(n = 0; n <= tracks; n++){
+		if(trackMeta[trk]->freeCount > 0){
+			for(; w < words; w++, mask = ~(uint64_t)0){
+				if((bits = trackMeta[trk]->freeMap[w] & mask) != 0){
+					return (int64_t)(trk * fs3TrackSize + w * 64 + __builtin_ctzll(bits));
 				}
-			} else{
-				bytesRead = -1;
 			}
 		}
-		if(errorCheck != 0){
-			logMessage(FS3DriverLLevel, "Something went wrong!");
+		w = 0;
+		mask = ~(uint64_t)0;
+		trk = (trk + 1 < tracks) ? trk + 1 : 0;
+	}
+	return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocSector
+// Description  : Hands out a sector. Free sectors are reused before the disk
+//                grows, looking from "from" onwards first so a file that
+//                extends stays close to its last sector.
+//
+// Inputs       : from - where to start looking for a free sector
+//                owner - the owner id (or FS3_PACK_OWNER) to record in the map
+// Outputs      : the disk index of the sector if successful, -1 if the disk is full
+
+int64_t allocSector(uint64_t from, uint16_t owner){
+	int64_t idx = -1;
+	if(freeSectors > 0){
+		idx = findFreeSector((from < assignedSectors) ? from : 0);
+	}
+	if(idx != -1){
+		freeSectors--;
+	}else if(assignedSectors >= fs3DiskSectors || growSectorMap(assignedSectors + 1) != 0){
+		return -1;
+	}else{
+		idx = assignedSectors++;
+	}
+	setOwner(idx, owner);
+	SECTOR_REFS(idx) = (owner == FS3_PACK_OWNER) ? 0 : 1;
+	return idx;
+}
+
+// Gives a sector back to the pool, shrinking the disk when it was the last one
+static void releaseSector(uint64_t idx){
+	setOwner(idx, FS3_FREE_SECTOR);
+	SECTOR_REFS(idx) = 0;
+	fs3_invalidate_cache(idx / fs3TrackSize, idx % fs3TrackSize);
+	fs3_dedup_remove(idx);
+	freeSectors++;
+	while(assignedSectors > 0 && SECTOR_OWNER(assignedSectors - 1) == FS3_FREE_SECTOR){
+		assignedSectors--;
+		freeSectors--;
+		// Past the end of the disk it leaves the free map
+		setOwner(assignedSectors, FS3_FREE_SECTOR);
+	}
+}
+
+// Drops a file's hold on a data sector, it goes back once no clone uses it
+static void dropSector(uint64_t idx){
+	if(--SECTOR_REFS(idx) == 0){
+		releaseSector(idx);
+	}
+}
+
+// Drops a hold on a packed slot (a tail or a compressed sector), the shared
+// sector goes back once nobody uses it
+static void releaseTail(uint64_t idx){
+	if(--PACK_REFS(idx) > 0){
+		return;
+	}
+	if(idx == packSector){
+		packUsed = 0;
+	}else{
+		releaseSector(idx);
+	}
+}
+
+// Drops a file's hold on one entry of its sector list
+static void dropEntry(uint32_t entry){
+	if(entry & FS3_BLOCK_COMPRESSED){
+		releaseTail(FS3_BLOCK_SECTOR(entry));
+	}else{
+		dropSector(entry);
+	}
+}
+
+// Makes room in a file's sector list for at least "count" sectors
+static int16_t growSectorList(File *file, int32_t count){
+	int32_t capacity = (file->sectorCapacity > 0) ? file->sectorCapacity : FS3_OPENFILE_ARR_STEPSIZE;
+	uint32_t *list;
+	while(capacity < count){
+		capacity *= 2;
+	}
+	if(capacity == file->sectorCapacity){
+		return 0;
+	}
+	if((list = realloc(file->sectorList, sizeof(uint32_t) * capacity)) == NULL){
+		return -1;
+	}
+	file->sectorList = list;
+	file->sectorCapacity = capacity;
+	return 0;
+}
+
+int16_t freeFileSectors(int32_t fd, uint32_t keep){
+	File *file = FILE_AT(FS3_HANDLE_SLOT(fd));
+	while((uint32_t)file->sectorCount > keep){
+		dropEntry(file->sectorList[--file->sectorCount]);
+	}
+	return 0;
+}
+
+int16_t rebuildAllocState(void){
+	uint64_t idx;
+	uint32_t t;
+	int32_t i, j;
+	uint32_t entry;
+	freeSectors = 0;
+	for(t = 0; t < metaTracks; t++){
+		memset(trackMeta[t]->freeMap, 0x0, sizeof(uint64_t) * ((fs3TrackSize + 63) / 64));
+		memset(trackMeta[t]->refs, 0x0, sizeof(uint16_t) * fs3TrackSize);
+		memset(trackMeta[t]->packRefs, 0x0, sizeof(uint8_t) * fs3TrackSize);
+		trackMeta[t]->freeCount = 0;
+	}
+	for(idx = 0; idx < assignedSectors; idx++){
+		if(SECTOR_OWNER(idx) == FS3_FREE_SECTOR){
+			setOwner(idx, FS3_FREE_SECTOR);
+			freeSectors++;
 		}
-		// If there are still bytes to read, go through read again on the next sector
-		if((count - bytesRead) != 0){
-			if((file->pos + 1) != file->length){
-				file->readCount++;
-				bytesRead += fs3_read(fd, &((char*)buf)[bytesRead], (count - bytesRead));
+	}
+	for(i = 0; i < createdFilesSize; i++){
+		for(j = 0; j < FILE_AT(i)->sectorCount; j++){
+			entry = FILE_AT(i)->sectorList[j];
+			if(entry & FS3_BLOCK_COMPRESSED){
+				PACK_REFS(FS3_BLOCK_SECTOR(entry))++;
+			}else{
+				SECTOR_REFS(entry)++;
 			}
 		}
-		file->readCount = 0;
+		if(FILE_AT(i)->isPacked){
+			PACK_REFS(FILE_AT(i)->cold->tailSector)++;
+		}
+	}
+	return 0;
+}
+
+// Gives the slot of a file without data back, its path is unbound
+static void releaseSlot(uint32_t slot){
+	File *file = FILE_AT(slot);
+	fs3_names_bind(file->cold->path, -1);
+	fs3_dir_remove(file->cold->path);
+	file->cold->path = NULL;
+	file->isDeleted = 1;
+	fs3_journal_touch(slot, FS3_JOURNAL_NO_ENTRIES);
+	if(pushFreeSlot(slot) != 0){
+		logMessage(LOG_WARNING_LEVEL, "File slot %u cannot be reused.", slot);
 	}
-	return bytesRead;
 }
+
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_write
-// Description  : Writes "count" bytes to the file handle "fh" from the 
-//                buffer  "buf"
+// Function     : fs3_unlink
+// Description  : Removes a file. Its sectors go back to the pool and its
+//                slot to the file table, the next file given the slot gets
+//                a handle of a new generation.
 //
-// Inputs       : fd - filename of the file to write to
-//                buf - pointer to buffer to write from
-//                count - number of bytes to write
-// Outputs      : bytes written if successful, -1 if failure
+// Inputs       : path - filename of the file to remove
+// Outputs      : 0 if successful, -1 if failure
 
-int32_t fs3_write(int16_t fd, void *buf, int32_t count) {
-	int32_t sect = -1, track = -1, bytesWritten = -1;
-	uint8_t returnedOp, returnedRet, errorCheck = 0, notEnoughSpace = 0;
-	uint16_t returnedSec;
-	uint32_t returnedTrack;
-	uint64_t pos, writeLocPos;
-	// Empties buffer
-	char *sectBuf[POS_ENDOF_FILE];
-	void *sectContent = (void *)sectBuf;
-	if(fd <= lastAssignedHandle){
-		// Checks to see if the file is open
-		File *file = &createdFiles[fd - FS3_STARTING_HANDLE];
-		if(file->isOpen){
-			// Checks which sector the write will begin at
-			writeLocPos = ((file->pos) / POS_ENDOF_FILE);
-			// Sets starter vars
-			pos = file->pos;
-			findLoc(pos, fd, &track, &sect);
-			// Checks if there's enough space on the current sector and modifies the bytes written accordingly
-			writeLocPos = (((file->pos + count) / POS_ENDOF_FILE) - writeLocPos);
-			if(writeLocPos != 0){
-				bytesWritten = (POS_ENDOF_FILE - ((file->pos) % POS_ENDOF_FILE));
-				notEnoughSpace = 1;
-				if((file->sectorCount - 1) != ((file->pos + count) / POS_ENDOF_FILE)){
-					// If there's not enough space on the current sector and no next sector, creates one
-					fileAt[assignedSectors / FS3_SECTOR_SIZE][assignedSectors % FS3_SECTOR_SIZE] = fd;
-					assignedSectors++;
-				}
-			}else{
-				bytesWritten = count;
-			}
-			// Checks if bytes written will go over the length of the file and file values accordingly
-			if((bytesWritten + pos) > file->length){
-				file->length = bytesWritten + pos;
-			}
-			file->pos += bytesWritten;
-			// Writes
-			FS3CmdBlk seekCommand = construct_fs3_cmdblk(FS3_OP_TSEEK, 0, track, 0);
-			FS3CmdBlk readCommand = construct_fs3_cmdblk(FS3_OP_RDSECT, sect, 0, 0);
-			// Seeks to proper track
-			seekCommand = fs3_syscall(seekCommand, NULL);
-			errorCheck += deconstruct_fs3_cmdblk(seekCommand, &returnedOp, &returnedSec, &returnedTrack, &returnedRet);
-			// Reads sector info
-			readCommand = fs3_syscall(readCommand, sectContent);
-			errorCheck += deconstruct_fs3_cmdblk(readCommand, &returnedOp, &returnedSec, &returnedTrack, &returnedRet);
-			// Writes over the correct portion of the sector
-			memcpy(&((char*)sectContent)[pos % POS_ENDOF_FILE], (char*)buf, bytesWritten);
-			void *cacheBuf = fs3_get_cache(track, sect);
-			if(cacheBuf == NULL){
-				fs3_put_cache(track, sect, sectContent);
-			} else{
-				memcpy((char *)cacheBuf, (char *)sectContent, POS_ENDOF_FILE);
-			}
-			// Updates disk with proper sector contents
-			FS3CmdBlk writeCommand = construct_fs3_cmdblk(FS3_OP_WRSECT, sect, 0, 0);
-			fs3_syscall(writeCommand, sectContent);
-			errorCheck += deconstruct_fs3_cmdblk(writeCommand, &returnedOp, &returnedSec, &returnedTrack, &returnedRet);
+int16_t fs3_unlink(char *path){
+	int64_t slot = fs3_names_lookup(path);
+	File *file;
+	if(slot == -1){
+		return -1;
+	}
+	file = FILE_AT(slot);
+	if(file->isOpen){
+		logMessage(LOG_ERROR_LEVEL, "Cannot unlink open file [%s].", path);
+		return -1;
+	}
+	if(file->isPacked){
+		releaseTail(file->cold->tailSector);
+		file->isPacked = 0;
+	}
+	freeFileSectors(file->handle, 0);
+	free(file->sectorList);
+	file->sectorList = NULL;
+	file->sectorCapacity = 0;
+	file->isInline = 0;
+	file->length = 0;
+	releaseSlot(slot);
+	fs3_journal_tick();
+	logMessage(FS3DriverLLevel, "Unlinked file [%s], %lu sectors free.", path, freeSectors);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_truncate
+// Description  : Shrinks an open file. The sectors past the new end go back
+//                to the pool, a packed tail keeps its slot while the file
+//                still ends inside it.
+//
+// Inputs       : fd - the file handle
+//                length - the new length of the file
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t fs3_truncate(int32_t fd, int32_t length){
+	File *file = fileFromHandle(fd);
+	if(file == NULL || !file->isOpen || flushAppend(file) != 0 || length < 0 || length > file->length){
+		return -1;
+	}
+	if(!file->isInline){
+		if(file->isPacked && (length / POS_ENDOF_FILE != file->length / POS_ENDOF_FILE || length % POS_ENDOF_FILE == 0)){
+			releaseTail(file->cold->tailSector);
+			file->isPacked = 0;
 		}
-		if(errorCheck != 0){
-			logMessage(FS3DriverLLevel, "Something went wrong!");
+		freeFileSectors(fd, file->isPacked ? length / POS_ENDOF_FILE : (length + POS_ENDOF_FILE - 1) / POS_ENDOF_FILE);
+	}
+	file->length = length;
+	if(file->pos > (uint64_t)length){
+		file->pos = length;
+	}
+	fs3_journal_touch(FS3_HANDLE_SLOT(fd), FS3_JOURNAL_NO_ENTRIES);
+	fs3_journal_tick();
+	return 0;
+}
+
+// Drops the references referenceSectors took on the first "count" entries
+// of a file, and on its packed tail if "tail" is set
+static void unreferenceSectors(File *file, int32_t count, int8_t tail){
+	uint32_t entry;
+	int32_t j;
+	for(j = 0; j < count; j++){
+		entry = file->sectorList[j];
+		if(entry & FS3_BLOCK_COMPRESSED){
+			PACK_REFS(FS3_BLOCK_SECTOR(entry))--;
+		}else{
+			SECTOR_REFS(entry)--;
 		}
-		// If there is not enough space to write on the sector, go to the next sector and finish writing there
-		if(notEnoughSpace){
-			void *writtenUntil = &((char*)buf)[bytesWritten];
-			//memcpy(buf, writtenUntil, (count - bytesWritten));
-			bytesWritten += fs3_write(fd, writtenUntil, (count - bytesWritten));
+	}
+	if(tail){
+		PACK_REFS(file->cold->tailSector)--;
+	}
+}
+
+// Takes one more reference on every sector a file holds, for a clone of it.
+// A shared sector can hold many slots of one file and dedup can list a
+// sector twice, so a count may step several times: if one wraps, every
+// count is put back and -1 returned.
+static int16_t referenceSectors(File *file){
+	uint32_t entry;
+	int32_t taken;
+	int8_t wrapped = 0;
+	for(taken = 0; taken < file->sectorCount && !wrapped; taken++){
+		entry = file->sectorList[taken];
+		if(entry & FS3_BLOCK_COMPRESSED){
+			wrapped = (++PACK_REFS(FS3_BLOCK_SECTOR(entry)) == 0);
+		}else{
+			wrapped = (++SECTOR_REFS(entry) == 0);
 		}
 	}
-	return bytesWritten;
+	if(!wrapped && file->isPacked && ++PACK_REFS(file->cold->tailSector) == 0){
+		unreferenceSectors(file, taken, 1);
+		return -1;
+	}
+	if(wrapped){
+		unreferenceSectors(file, taken, 0);
+		return -1;
+	}
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_seek
-// Description  : Seek to specific point in the file
+// Function     : fs3_clone
+// Description  : Creates dst as a copy of src without copying any data. The
+//                two files hold the same sectors (and packed tail slot), and
+//                the first write to a shared sector gives the writer its own
+//                copy of it.
 //
-// Inputs       : fd - filename of the file to write to
-//                loc - offfset of file in relation to beginning of file
+// Inputs       : src - filename of the file to copy
+//                dst - filename of the new file, which must not exist
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t fs3_seek(int16_t fd, uint32_t loc) {
-	int32_t ret = -1;
-	// If file is open and the position is less than the length then it updates position.
-	if(fd <= lastAssignedHandle){
-		File *file = &createdFiles[fd - FS3_STARTING_HANDLE];
-		if(file->isOpen){
-			if(file->length > loc){
-				file->pos = loc;
-				ret = 0;
+int16_t fs3_clone(char *src, char *dst){
+	int64_t srcIdx = fs3_names_lookup(src);
+	int32_t j, handle;
+	File *from, *to;
+	if(fs3_names_lookup(dst) != -1){
+		logMessage(LOG_ERROR_LEVEL, "Cannot clone [%s] over existing file [%s].", src, dst);
+		return -1;
+	}
+	if(srcIdx == -1 || flushAppend(FILE_AT(srcIdx)) != 0){
+		return -1;
+	}
+	// The new file's references are all taken up front, so none can wrap
+	if(referenceSectors(FILE_AT(srcIdx)) != 0){
+		logMessage(LOG_ERROR_LEVEL, "Too many clones of [%s].", src);
+		return -1;
+	}
+	if((handle = createFile(dst)) == -1){
+		unreferenceSectors(FILE_AT(srcIdx), FILE_AT(srcIdx)->sectorCount, FILE_AT(srcIdx)->isPacked);
+		return -1;
+	}
+	from = FILE_AT(srcIdx);
+	to = FILE_AT(FS3_HANDLE_SLOT(handle));
+	if(growSectorList(to, from->sectorCount) != 0){
+		unreferenceSectors(from, from->sectorCount, from->isPacked);
+		releaseSlot(FS3_HANDLE_SLOT(handle));
+		return -1;
+	}
+	// The new file takes the contents by reference
+	to->length = from->length;
+	to->isInline = from->isInline;
+	memcpy(to->cold->inlineData, from->cold->inlineData, FS3_INLINE_MAX);
+	memcpy(to->sectorList, from->sectorList, sizeof(uint32_t) * from->sectorCount);
+	to->sectorCount = from->sectorCount;
+	for(j = 0; j < to->sectorCount; j++){
+		if(to->sectorList[j] & FS3_BLOCK_COMPRESSED){
+			to->sectorList[j] = from->sectorList[j] = to->sectorList[j] | FS3_BLOCK_SHARED;
+		}
+	}
+	if(from->isPacked){
+		to->isPacked = 1;
+		to->cold->tailSector = from->cold->tailSector;
+		to->cold->tailOffset = from->cold->tailOffset;
+		to->cold->tailCapacity = from->cold->tailCapacity;
+		to->cold->tailShared = from->cold->tailShared = 1;
+	}
+	fs3_journal_touch(srcIdx, 0);
+	fs3_journal_touch(FS3_HANDLE_SLOT(handle), 0);
+	fs3_journal_tick();
+	logMessage(FS3DriverLLevel, "Cloned file [%s] to [%s], %d sectors shared.", src, dst, to->sectorCount);
+	return 0;
+}
+
+// A use of a sector by a file, entry -1 is the packed tail of the file
+typedef struct {
+	uint32_t slot;
+	int32_t entry;
+} SectorRef;
+
+// Lists the uses of every assigned sector, those of sector idx are
+// refs[(*first)[idx]] up to refs[(*first)[idx + 1]]. Returns NULL on failure.
+static SectorRef *indexReferences(uint32_t **first){
+	SectorRef *refs;
+	uint32_t *start, sct;
+	int32_t i, j;
+	uint64_t idx;
+	if((start = calloc(assignedSectors + 2, sizeof(uint32_t))) == NULL){
+		return NULL;
+	}
+	// Counted two places up, so filling in leaves the start of each sector one place up
+	for(i = 0; i < createdFilesSize; i++){
+		for(j = 0; j < FILE_AT(i)->sectorCount; j++){
+			if((sct = FS3_BLOCK_SECTOR(FILE_AT(i)->sectorList[j])) < assignedSectors){
+				start[sct + 2]++;
 			}
 		}
+		if(FILE_AT(i)->isPacked && FILE_AT(i)->cold->tailSector < assignedSectors){
+			start[FILE_AT(i)->cold->tailSector + 2]++;
+		}
 	}
-	// Possible implementation of created file search to return if file exists but is not open
-	return ret;
-}
\ No newline at end of file
+	for(idx = 2; idx < assignedSectors + 2; idx++){
+		start[idx] += start[idx - 1];
+	}
+	if((refs = malloc(sizeof(SectorRef) * (start[assignedSectors + 1] + 1))) == NULL){
+		free(start);
+		return NULL;
+	}
+	for(i = 0; i < createdFilesSize; i++){
+		for(j = 0; j < FILE_AT(i)->sectorCount; j++){
+			if((sct = FS3_BLOCK_SECTOR(FILE_AT(i)->sectorList[j])) < assignedSectors){
+				refs[start[sct + 1]++] = (SectorRef){ i, j };
+			}
+		}
+		if(FILE_AT(i)->isPacked && FILE_AT(i)->cold->tailSector < assignedSectors){
+			refs[start[FILE_AT(i)->cold->tailSector + 1]++] = (SectorRef){ i, -1 };
+		}
+	}
+	*first = start;
+	return refs;
+}
+
+// Points every use of sector idx at sector "to", and journals the files changed
+static void moveReferences(const SectorRef *refs, const uint32_t *first, uint64_t idx, uint64_t to){
+	File *file;
+	uint32_t r;
+	for(r = first[idx]; r < first[idx + 1]; r++){
+		file = FILE_AT(refs[r].slot);
+		if(refs[r].entry < 0){
+			file->cold->tailSector = to;
+			fs3_journal_touch(refs[r].slot, FS3_JOURNAL_NO_ENTRIES);
+		}else{
+			file->sectorList[refs[r].entry] = (file->sectorList[refs[r].entry] & ~FS3_BLOCK_SECTOR_MASK) | to;
+			fs3_journal_touch(refs[r].slot, refs[r].entry);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_compact
+// Description  : Slides every assigned sector down over the free ones, so the
+//                disk is one contiguous run and the free pool is empty. The
+//                order of the sectors is kept, and a sector only ever moves
+//                into a slot that is free on the disk as well: the journal is
+//                committed first, and again before a slot left by a move since
+//                the last commit is written over, so a crash or a failed move
+//                leaves files pointing at sectors that still hold their data.
+//
+// Inputs       : none
+// Outputs      : the number of sectors moved if successful, -1 if failure
+
+int32_t fs3_compact(void){
+	char sectContent[FS3_SECTOR_SIZE];
+	uint64_t idx, to = 0, vacated = UINT64_MAX;
+	uint32_t owner, *first;
+	SectorRef *refs;
+	int32_t moved = 0, ret = 0;
+	// Sectors freed since the last group are still in use on the disk until it is committed
+	if(fs3_journal_commit() != 0){
+		logMessage(LOG_ERROR_LEVEL, "Compaction failed committing the journal.");
+		return -1;
+	}
+	if((refs = indexReferences(&first)) == NULL){
+		return -1;
+	}
+	for(idx = 0; idx < assignedSectors; idx++){
+		owner = SECTOR_OWNER(idx);
+		if(owner == FS3_FREE_SECTOR){
+			continue;
+		}
+		if(idx != to){
+			if(to >= vacated){
+				if(fs3_journal_commit() != 0){
+					logMessage(LOG_ERROR_LEVEL, "Compaction failed committing the journal at sector %lu.", idx);
+					ret = -1;
+					break;
+				}
+				vacated = UINT64_MAX;
+			}
+			if(fs3_bus_read(idx / fs3TrackSize, idx % fs3TrackSize, sectContent) != 0 ||
+					fs3_bus_write(to / fs3TrackSize, to % fs3TrackSize, sectContent) != 0){
+				logMessage(LOG_ERROR_LEVEL, "Compaction failed moving sector %lu.", idx);
+				ret = -1;
+				break;
+			}
+			fs3_move_cache(idx / fs3TrackSize, idx % fs3TrackSize, to / fs3TrackSize, to % fs3TrackSize);
+			fs3_dedup_move(idx, to);
+			moveReferences(refs, first, idx, to);
+			if(packSector == idx){
+				packSector = to;
+			}
+			setOwner(to, owner);
+			setOwner(idx, FS3_FREE_SECTOR);
+			vacated = CMPSC311_MINVAL(vacated, idx);
+			moved++;
+		}
+		to++;
+	}
+	free(refs);
+	free(first);
+	// The slots past the end are only given out again once the last moves are on the disk
+	if(ret == 0 && fs3_journal_commit() != 0){
+		logMessage(LOG_ERROR_LEVEL, "Compaction failed committing the journal.");
+		ret = -1;
+	}
+	if(ret == 0){
+		assignedSectors = to;
+	}
+	rebuildAllocState();
+	logMessage(FS3DriverLLevel, "Compaction moved %d sectors, %lu sectors assigned.", moved, assignedSectors);
+	return (ret == 0) ? moved : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_defrag
+// Description  : Moves every file whose sectors are scattered into one
+//                contiguous run. Each such file is copied to fresh sectors
+//                past the end of the disk and switched over to the copy
+//                once it is complete, then a compaction slides everything
+//                down over the sectors that were left behind. Cached lines
+//                follow their sectors. Files sharing sectors with a clone
+//                stay where they are, moving them would undo the sharing,
+//                and so do files holding compressed sectors, whose slots are
+//                already packed together.
+//
+// Inputs       : none
+// Outputs      : the number of sectors copied if successful, -1 if failure
+
+int32_t fs3_defrag(void){
+	char sectContent[FS3_SECTOR_SIZE];
+	uint64_t before = fs3_track_switches(), to, loc;
+	int32_t i, j, count, copied = 0;
+	int16_t errorCheck = 0;
+	uint32_t *list;
+	void *cacheBuf;
+	for(i = 0; i < createdFilesSize && errorCheck == 0; i++){
+		count = FILE_AT(i)->sectorCount;
+		list = FILE_AT(i)->sectorList;
+		// Files already in one run stay where they are
+		for(j = 1; j < count && list[j] == list[0] + j; j++);
+		if(FILE_AT(i)->isDeleted || j >= count){
+			continue;
+		}
+		for(j = 0; j < count && !(list[j] & FS3_BLOCK_COMPRESSED) && SECTOR_REFS(list[j]) == 1; j++);
+		if(j < count){
+			continue;
+		}
+		to = assignedSectors;
+		if(to + count > fs3DiskSectors || growSectorMap(to + count) != 0){
+			logMessage(LOG_WARNING_LEVEL, "No room to defragment file %d.", FILE_AT(i)->handle);
+			continue;
+		}
+		// The copy lives past the end of the disk until it is complete
+		for(j = 0; j < count && errorCheck == 0; j++){
+			if((cacheBuf = fs3_get_cache(list[j] / fs3TrackSize, list[j] % fs3TrackSize)) != NULL){
+				memcpy(sectContent, cacheBuf, FS3_SECTOR_SIZE);
+			}else{
+				errorCheck = fs3_bus_read(list[j] / fs3TrackSize, list[j] % fs3TrackSize, sectContent);
+			}
+			if(errorCheck == 0){
+				errorCheck = fs3_bus_write((to + j) / fs3TrackSize, (to + j) % fs3TrackSize, sectContent);
+			}
+		}
+		if(errorCheck != 0){
+			logMessage(LOG_ERROR_LEVEL, "Defragmentation failed copying file %d.", FILE_AT(i)->handle);
+			break;
+		}
+		assignedSectors += count;
+		for(j = 0; j < count; j++){
+			setOwner(to + j, FS3_OWNER_ID(i));
+			SECTOR_REFS(to + j) = 1;
+		}
+		for(j = 0; j < count; j++){
+			loc = list[j];
+			fs3_move_cache(loc / fs3TrackSize, loc % fs3TrackSize, (to + j) / fs3TrackSize, (to + j) % fs3TrackSize);
+			fs3_dedup_move(loc, to + j);
+			list[j] = to + j;
+			releaseSector(loc);
+		}
+		fs3_journal_touch(i, 0);
+		copied += count;
+	}
+	if(fs3_compact() == -1){
+		errorCheck = -1;
+	}
+	logMessage(FS3DriverLLevel, "Defragmentation copied %d sectors, track switches %lu -> %lu.", copied, before, fs3_track_switches());
+	return (errorCheck == 0) ? copied : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_track_switches
+// Description  : Counts the track changes a sequential read of every file
+//                needs, the seeks a scattered layout costs over the first
+//                seek of each file
+//
+// Inputs       : none
+// Outputs      : the number of track changes
+
+uint64_t fs3_track_switches(void){
+	uint32_t lastTrack, track;
+	uint64_t switches = 0;
+	int32_t i, j;
+	for(i = 0; i < createdFilesSize; i++){
+		lastTrack = FS3_UNKNOWN_TRACK;
+		for(j = 0; j < FILE_AT(i)->sectorCount; j++){
+			track = FS3_BLOCK_SECTOR(FILE_AT(i)->sectorList[j]) / fs3TrackSize;
+			if(lastTrack != FS3_UNKNOWN_TRACK && lastTrack != track){
+				switches++;
+			}
+			lastTrack = track;
+		}
+		// Packed tails are read last
+		track = FILE_AT(i)->cold->tailSector / fs3TrackSize;
+		if(FILE_AT(i)->isPacked && lastTrack != FS3_UNKNOWN_TRACK && lastTrack != track){
+			switches++;
+		}
+	}
+	return switches;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : resolveSectors
+// Description  : Finds the disk location of "count" consecutive sectors of a
+//                file from its sector list, allocating the ones past the end
+//                of the file when asked to.
+//
+// Inputs       : fd - the file handle
+//                first - the first sector of the file wanted
+//                count - the number of sectors wanted
+//                locs - filled with the disk index (track * size + sector) of each
+//                allocate - create missing sectors at the end of the file
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t resolveSectors(int32_t fd, uint32_t first, uint32_t count, uint64_t *locs, int8_t allocate){
+	File *file = FILE_AT(FS3_HANDLE_SLOT(fd));
+	int64_t loc;
+	uint32_t i;
+	if(first > (uint32_t)file->sectorCount || (!allocate && first + count > (uint32_t)file->sectorCount)){
+		return -1;
+	}
+	// Extends the file with free sectors near its last one, or at the end of the disk
+	if(first + count > (uint32_t)file->sectorCount){
+		if(growSectorList(file, first + count) != 0){
+			return -1;
+		}
+		while((uint32_t)file->sectorCount < first + count){
+			loc = allocSector((file->sectorCount > 0) ? FS3_BLOCK_SECTOR(file->sectorList[file->sectorCount - 1]) + 1 : 0, FS3_OWNER_ID(FS3_HANDLE_SLOT(fd)));
+			if(loc == -1){
+				logMessage(LOG_ERROR_LEVEL, "Disk full, cannot extend file %d.", fd);
+				return -1;
+			}
+			file->sectorList[file->sectorCount++] = loc;
+		}
+	}
+	for(i = 0; i < count; i++){
+		locs[i] = file->sectorList[first + i];
+	}
+	return 0;
+}
+
+// Copies len bytes between a sector and the iovecs, advancing the iovec cursor
+static void iovCopy(const struct iovec *iov, int *iovIdx, size_t *iovOff, char *sect, uint32_t len, int8_t toSector){
+	size_t n;
+	while(len > 0){
+		if(*iovOff == iov[*iovIdx].iov_len){
+			(*iovIdx)++;
+			*iovOff = 0;
+			continue;
+		}
+		n = iov[*iovIdx].iov_len - *iovOff;
+		n = (n < len) ? n : len;
+		if(toSector){
+			memcpy(sect, &((char *)iov[*iovIdx].iov_base)[*iovOff], n);
+		}else{
+			memcpy(&((char *)iov[*iovIdx].iov_base)[*iovOff], sect, n);
+		}
+		sect += n;
+		len -= n;
+		*iovOff += n;
+	}
+}
+
+// Reserves a slot for a packed tail, starting a new shared sector when the current one is full
+static int16_t allocTailSlot(uint32_t len, uint64_t *sector, uint16_t *slot, uint16_t *capacity){
+	uint16_t size = ((len + FS3_PACK_GRAIN - 1) / FS3_PACK_GRAIN) * FS3_PACK_GRAIN;
+	int64_t loc;
+	if(packUsed + size > FS3_SECTOR_SIZE){
+		if((loc = allocSector(0, FS3_PACK_OWNER)) == -1){
+			logMessage(LOG_ERROR_LEVEL, "Disk full, cannot pack file tail.");
+			return -1;
+		}
+		packSector = loc;
+		packUsed = 0;
+		packWritten = 0;
+	}
+	PACK_REFS(packSector)++;
+	*sector = packSector;
+	*slot = packUsed;
+	*capacity = size;
+	packUsed += size;
+	return 0;
+}
+
+// Copies the packed tail of a file into buf, through the cache
+static int16_t fetchTail(File *file, char *buf){
+	uint32_t track = file->cold->tailSector / fs3TrackSize, sect = file->cold->tailSector % fs3TrackSize;
+	char pack[FS3_SECTOR_SIZE];
+	void *cacheBuf = fs3_get_cache(track, sect);
+	if(cacheBuf == NULL){
+		if(fs3_bus_read(track, sect, pack) != 0){
+			return -1;
+		}
+		fs3_put_cache(track, sect, pack);
+		cacheBuf = pack;
+	}
+	memset(buf, 0x0, POS_ENDOF_FILE);
+	memcpy(buf, &((char *)cacheBuf)[file->cold->tailOffset], file->length % POS_ENDOF_FILE);
+	return 0;
+}
+
+// Rewrites a shared sector around one of its slots, through the cache
+static int16_t writeSlot(uint64_t sector, uint16_t slot, const char *data, uint32_t len){
+	uint32_t track = sector / fs3TrackSize, sect = sector % fs3TrackSize;
+	char pack[FS3_SECTOR_SIZE];
+	void *cacheBuf = fs3_get_cache(track, sect);
+	int16_t errorCheck = 0;
+	if(cacheBuf != NULL){
+		memcpy(pack, cacheBuf, FS3_SECTOR_SIZE);
+	}else if(sector == packSector && !packWritten){
+		memset(pack, 0x0, FS3_SECTOR_SIZE);
+	}else{
+		errorCheck = fs3_bus_read(track, sect, pack);
+	}
+	if(errorCheck == 0){
+		memcpy(&pack[slot], data, len);
+		errorCheck = fs3_bus_write(track, sect, pack);
+	}
+	if(errorCheck != 0){
+		return -1;
+	}
+	fs3_metrics_writeback();
+	if(sector == packSector){
+		packWritten = 1;
+	}
+	if(cacheBuf == NULL || fs3_update_cache(track, sect, pack) == 0){
+		fs3_put_cache(track, sect, pack);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rwTail
+// Description  : Reads or writes the last sector of a file as a packed tail.
+//                A write keeps the tail in its slot while it fits and moves
+//                it to a new slot when it outgrows it.
+//
+// Inputs       : fd - the file handle
+//                logical - the sector of the file being moved
+//                iov, iovIdx, iovOff - the buffers and the cursor into them
+//                sectStart - where in the sector the run starts
+//                len - the bytes of the run in this sector
+//                isWrite - 1 to write the buffers to the file, 0 to read into them
+// Outputs      : 0 if successful, -1 if failure
+
+static int16_t rwTail(int32_t fd, uint32_t logical, const struct iovec *iov, int *iovIdx, size_t *iovOff, uint32_t sectStart, uint32_t len, int8_t isWrite){
+	File *file = FILE_AT(FS3_HANDLE_SLOT(fd));
+	char tail[POS_ENDOF_FILE];
+	uint32_t tailLen = 0;
+	uint64_t sector;
+	uint16_t slot, capacity;
+	int8_t inPlace = 0;
+	// The bytes already in the tail, if this is the sector that was packed
+	if(file->isPacked && logical == (uint32_t)(file->length / POS_ENDOF_FILE)){
+		tailLen = file->length % POS_ENDOF_FILE;
+		if(fetchTail(file, tail) != 0){
+			return -1;
+		}
+		inPlace = 1;
+	}else{
+		memset(tail, 0x0, POS_ENDOF_FILE);
+	}
+	fs3_metrics_file_access(fd, 1);
+	fs3_metrics_sector_touched();
+	if(!isWrite){
+		iovCopy(iov, iovIdx, iovOff, &tail[sectStart], len, 0);
+		return 0;
+	}
+	iovCopy(iov, iovIdx, iovOff, &tail[sectStart], len, 1);
+	tailLen = CMPSC311_MAXVAL(tailLen, sectStart + len);
+	// Stays in its slot while it fits, unless a clone may still be reading it
+	if(inPlace && tailLen <= file->cold->tailCapacity && !file->cold->tailShared){
+		sector = file->cold->tailSector;
+		slot = file->cold->tailOffset;
+		capacity = file->cold->tailCapacity;
+	}else if(allocTailSlot(tailLen, &sector, &slot, &capacity) != 0){
+		return -1;
+	}else{
+		inPlace = 0;
+	}
+	// A new slot that was never filled is dropped, the tail stays where it was
+	if(writeSlot(sector, slot, tail, tailLen) != 0){
+		if(!inPlace){
+			releaseTail(sector);
+		}
+		return -1;
+	}
+	// Leaves the old slot once the tail is safe in the new one
+	if(file->isPacked && !inPlace && logical == (uint32_t)(file->length / POS_ENDOF_FILE)){
+		releaseTail(file->cold->tailSector);
+	}
+	file->isPacked = 1;
+	file->cold->tailShared = 0;
+	file->cold->tailSector = sector;
+	file->cold->tailOffset = slot;
+	file->cold->tailCapacity = capacity;
+	return 0;
+}
+
+// Unpacks a compressed sector into buf, line is its shared sector if cached
+static int16_t fetchBlock(uint32_t entry, void *line, char *buf){
+	uint32_t track = FS3_BLOCK_SECTOR(entry) / fs3TrackSize, sect = FS3_BLOCK_SECTOR(entry) % fs3TrackSize;
+	char pack[FS3_SECTOR_SIZE];
+	if(line == NULL){
+		if(fs3_bus_read(track, sect, pack) != 0){
+			return -1;
+		}
+		fs3_put_cache(track, sect, pack);
+		line = pack;
+	}
+	memset(buf, 0x0, FS3_SECTOR_SIZE);
+	return fs3_decompress_block(&((char *)line)[FS3_BLOCK_SLOT(entry)], FS3_BLOCK_CAPACITY(entry), buf, POS_ENDOF_FILE);
+}
+
+// Stores a compressed sector of a file, in its own slot while it fits and no
+// clone shares it, else in a new slot
+static int16_t writeBlock(File *file, uint32_t logical, const char *block, uint32_t len){
+	uint32_t entry = file->sectorList[logical];
+	uint64_t sector;
+	uint16_t slot, capacity;
+	if((entry & FS3_BLOCK_COMPRESSED) && !(entry & FS3_BLOCK_SHARED) && len <= FS3_BLOCK_CAPACITY(entry)){
+		return writeSlot(FS3_BLOCK_SECTOR(entry), FS3_BLOCK_SLOT(entry), block, len);
+	}
+	if(allocTailSlot(len, &sector, &slot, &capacity) != 0){
+		return -1;
+	}
+	if(writeSlot(sector, slot, block, len) != 0){
+		releaseTail(sector);
+		return -1;
+	}
+	dropEntry(entry);
+	file->sectorList[logical] = FS3_MAKE_BLOCK(sector, slot, capacity);
+	return 0;
+}
+
+// Finds a sector already holding "content", checked byte for byte so a hash
+// collision can never merge two different sectors. The candidate is not put
+// in the cache, that could evict the line the caller is working on.
+static int64_t findDuplicate(uint64_t hash, const char *content){
+	char candContent[FS3_SECTOR_SIZE];
+	int64_t cand = fs3_dedup_lookup(hash);
+	void *cacheBuf;
+	if(cand == -1 || SECTOR_REFS(cand) == UINT16_MAX){
+		return -1;
+	}
+	if((cacheBuf = fs3_get_cache(cand / fs3TrackSize, cand % fs3TrackSize)) == NULL){
+		if(fs3_bus_read(cand / fs3TrackSize, cand % fs3TrackSize, candContent) != 0){
+			return -1;
+		}
+		cacheBuf = candContent;
+	}
+	return (memcmp(cacheBuf, content, FS3_SECTOR_SIZE) == 0) ? cand : -1;
+}
+
+// Reads the uncached whole sectors of a run from "from" on in one batch, so
+// the units of an array fetch them side by side. slots[j] is the command that
+// read sector from + j, -1 for those that were left to the cache.
+static void readAhead(const uint64_t *locs, uint32_t from, uint32_t span, FS3ArrayOp *ops, int32_t *slots, char *buf){
+	uint32_t j, n = 0, track, sect;
+	for(j = 0; j < span; j++){
+		track = locs[from + j] / fs3TrackSize;
+		sect = locs[from + j] % fs3TrackSize;
+		slots[j] = -1;
+		if(!(locs[from + j] & FS3_BLOCK_COMPRESSED) && fs3_peek_cache(track, sect) == NULL){
+			ops[n] = (FS3ArrayOp){ .op = FS3_OP_RDSECT, .track = track, .sect = sect, .buf = &buf[n * FS3_SECTOR_SIZE] };
+			slots[j] = n++;
+		}
+	}
+	if(n > 0){
+		fs3_bus_submit(ops, n);
+	}
+}
+
+// A sector write of rwVector waiting to be issued with the rest of its batch
+typedef struct {
+	uint32_t idx;        // Sector of the run
+	uint64_t loc;        // Disk index written, a copy when the sector was shared
+	int8_t shared;
+	uint64_t hash;       // Contents hash for the dedup index
+	uint64_t doneBefore; // Bytes of the run before this sector
+} PendingWrite;
+
+// Issues the queued writes of a run and takes the ones that reached the disk
+// into the file and the cache. Returns the first one that failed, -1 if none.
+static int32_t flushWrites(File *file, uint32_t first, const uint64_t *locs, uint32_t oldTail, PendingWrite *pending, FS3ArrayOp *ops, uint32_t count){
+	int32_t failed = -1;
+	uint32_t j;
+	fs3_bus_submit(ops, count);
+	for(j = 0; j < count; j++){
+		fs3_metrics_writeback();
+		if(ops[j].ret != 0){
+			if(pending[j].shared){
+				releaseSector(pending[j].loc);
+			}
+			failed = (failed == -1) ? (int32_t)j : failed;
+			continue;
+		}
+		// The cache only takes the new contents once the controller has them
+		if(pending[j].shared){
+			dropEntry(locs[pending[j].idx]);
+			file->sectorList[first + pending[j].idx] = pending[j].loc;
+		}
+		if(fs3_dedup_enabled()){
+			fs3_dedup_insert(pending[j].hash, pending[j].loc);
+		}
+		if(fs3_update_cache(ops[j].track, ops[j].sect, ops[j].buf) == 0){
+			fs3_put_cache(ops[j].track, ops[j].sect, ops[j].buf);
+		}
+		if(file->isPacked && first + pending[j].idx == oldTail){
+			releaseTail(file->cold->tailSector);
+			file->isPacked = 0;
+		}
+	}
+	return failed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rwVector
+// Description  : Reads or writes a run of the file, gathered from or scattered
+//                into a list of buffers. The run is resolved into sectors once
+//                and each sector is read and written at most once, however many
+//                buffers fall in it. On a device array the sectors that go to
+//                the controller are issued in batches, so the units work on
+//                them side by side.
+//
+// Inputs       : fd - the file handle
+//                iov - the buffers
+//                iovcnt - the number of buffers
+//                offset - where in the file the run starts
+//                isWrite - 1 to write the buffers to the file, 0 to read into them
+// Outputs      : bytes moved if successful, -1 if failure
+
+int32_t rwVector(int32_t fd, const struct iovec *iov, int iovcnt, uint64_t offset, int8_t isWrite){
+	char sectContent[FS3_SECTOR_SIZE];
+	uint64_t total = 0, done = 0, newLength, *locs;
+	uint32_t first, count, realCount, oldTail, i, sectStart, len, blockLen;
+	int iovIdx = 0;
+	size_t iovOff = 0;
+	int16_t errorCheck = 0;
+	char block[FS3_COMPRESS_MAX];
+	int8_t shared, settled, compressed;
+	int64_t loc = 0;
+	uint64_t hash = 0;
+	File *file;
+	uint32_t batchLimit = (fs3_array_devices() > 1) ? fs3_array_batch() : 1, queued = 0, aheadFirst = 0, aheadSpan = 0;
+	int32_t *slots = NULL, failed;
+	FS3ArrayOp *ops = NULL;
+	PendingWrite *pending = NULL;
+	char *batchBuf = NULL;
+	// Checks the file is open and the run is valid
+	if((file = fileFromHandle(fd)) == NULL || iovcnt < 0 || (iovcnt > 0 && iov == NULL)){
+		return -1;
+	}
+	if(!file->isOpen){
+		return -1;
+	}
+	for(i = 0; i < (uint32_t)iovcnt; i++){
+		total += iov[i].iov_len;
+	}
+	if(total > INT32_MAX){
+		return -1;
+	}
+	if(isWrite){
+		// Writes can extend the file but not leave a hole in it
+		if(offset > (uint64_t)file->length){
+			return -1;
+		}
+	}else{
+		// Reads stop at the end of the file
+		total = (offset >= (uint64_t)file->length) ? 0 : CMPSC311_MINVAL(total, file->length - offset);
+	}
+	if(total == 0){
+		return 0;
+	}
+	if(isWrite){
+		fs3_journal_touch(FS3_HANDLE_SLOT(fd), file->isInline ? FS3_JOURNAL_NO_ENTRIES : offset / POS_ENDOF_FILE);
+	}
+	// Small files live in their File record and never reach the controller
+	if(file->isInline){
+		if(isWrite && (offset + total) > inlineThreshold){
+			return promoteInline(fd, iov, iovcnt, offset);
+		}
+		iovCopy(iov, &iovIdx, &iovOff, &file->cold->inlineData[offset], total, isWrite);
+		if(isWrite && (offset + total) > (uint64_t)file->length){
+			file->length = offset + total;
+		}
+		return (int32_t)total;
+	}
+	first = offset / POS_ENDOF_FILE;
+	count = ((offset + total - 1) / POS_ENDOF_FILE) - first + 1;
+	// The last sector of the run may be a packed tail rather than a sector of its own
+	realCount = count;
+	oldTail = file->length / POS_ENDOF_FILE;
+	newLength = CMPSC311_MAXVAL((uint64_t)file->length, offset + total);
+	if(!isWrite && file->isPacked && first + count - 1 == oldTail){
+		realCount--;
+	}else if(isWrite && packThreshold > 0 && first + count - 1 == newLength / POS_ENDOF_FILE &&
+			newLength % POS_ENDOF_FILE > 0 && newLength % POS_ENDOF_FILE <= packThreshold &&
+			first + count - 1 >= (uint32_t)file->sectorCount){
+		realCount--;
+	}
+	if((locs = malloc(sizeof(uint64_t) * count)) == NULL){
+		return -1;
+	}
+	if(resolveSectors(fd, first, realCount, locs, isWrite) == -1){
+		free(locs);
+		return -1;
+	}
+	// Room for one batch, writes are always queued and reads only batched on an array
+	if(isWrite || batchLimit > 1){
+		ops = malloc(sizeof(FS3ArrayOp) * batchLimit);
+		pending = malloc(sizeof(PendingWrite) * batchLimit);
+		slots = malloc(sizeof(int32_t) * batchLimit);
+		batchBuf = malloc((size_t)FS3_SECTOR_SIZE * batchLimit);
+		if(ops == NULL || pending == NULL || slots == NULL || batchBuf == NULL){
+			free(ops);
+			free(pending);
+			free(slots);
+			free(batchBuf);
+			free(locs);
+			return -1;
+		}
+	}
+	// Walks the run one sector at a time
+	for(i = 0; i < realCount && errorCheck == 0; i++){
+		uint32_t track = FS3_BLOCK_SECTOR(locs[i]) / fs3TrackSize, sect = FS3_BLOCK_SECTOR(locs[i]) % fs3TrackSize;
+		sectStart = (offset + done) % POS_ENDOF_FILE;
+		len = CMPSC311_MINVAL(POS_ENDOF_FILE - sectStart, total - done);
+		void *cacheBuf = fs3_get_cache(track, sect);
+		fs3_metrics_file_access(fd, cacheBuf != NULL);
+		fs3_metrics_sector_touched();
+		// A compressed sector is unpacked from its slot, the cached line is the whole shared sector
+		compressed = ((locs[i] & FS3_BLOCK_COMPRESSED) != 0);
+		if(!isWrite){
+			if(compressed){
+				errorCheck = fetchBlock(locs[i], cacheBuf, sectContent);
+				if(errorCheck != 0){
+					break;
+				}
+				cacheBuf = sectContent;
+			}else if(cacheBuf == NULL){
+				// A miss on an array fetches the rest of the batch with it
+				if(batchLimit > 1 && (i < aheadFirst || i >= aheadFirst + aheadSpan)){
+					aheadFirst = i;
+					aheadSpan = CMPSC311_MINVAL(batchLimit, realCount - i);
+					readAhead(locs, aheadFirst, aheadSpan, ops, slots, batchBuf);
+				}
+				if(batchLimit > 1 && slots[i - aheadFirst] != -1 && ops[slots[i - aheadFirst]].ret == 0){
+					memcpy(sectContent, ops[slots[i - aheadFirst]].buf, FS3_SECTOR_SIZE);
+				}else if((errorCheck = fs3_bus_read(track, sect, sectContent)) != 0){
+					break;
+				}
+				fs3_put_cache(track, sect, sectContent);
+				cacheBuf = sectContent;
+			}
+			iovCopy(iov, &iovIdx, &iovOff, &((char *)cacheBuf)[sectStart], len, 0);
+		}else{
+			// Only a partial update of a sector that held data needs its old contents,
+			// a tail that outgrew its slot brings them along
+			if(file->isPacked && first + i == oldTail){
+				errorCheck = fetchTail(file, sectContent);
+			}else if(compressed){
+				errorCheck = fetchBlock(locs[i], cacheBuf, sectContent);
+				cacheBuf = NULL;
+			}else if(cacheBuf != NULL){
+				memcpy(sectContent, cacheBuf, FS3_SECTOR_SIZE);
+			}else if(len < POS_ENDOF_FILE && ((uint64_t)(first + i) * POS_ENDOF_FILE) < (uint64_t)file->length){
+				errorCheck = fs3_bus_read(track, sect, sectContent);
+			}else{
+				memset(sectContent, 0x0, FS3_SECTOR_SIZE);
+			}
+			if(errorCheck == 0){
+				iovCopy(iov, &iovIdx, &iovOff, &sectContent[sectStart], len, 1);
+			}
+			// Sectors that compress well enough go to a slot of a shared sector
+			settled = 0;
+			if(errorCheck == 0 && compressThreshold > 0 &&
+					(blockLen = fs3_compress_block(sectContent, POS_ENDOF_FILE, block, compressThreshold)) > 0){
+				errorCheck = writeBlock(file, first + i, block, blockLen);
+				settled = 1;
+			}
+			// Contents already on disk are shared rather than written again
+			if(errorCheck == 0 && !settled && fs3_dedup_enabled()){
+				hash = fs3_dedup_hash(sectContent);
+				if((loc = findDuplicate(hash, sectContent)) != -1){
+					settled = 1;
+					fs3_dedup_hit();
+					if(loc != (int64_t)locs[i]){
+						SECTOR_REFS(loc)++;
+						dropEntry(locs[i]);
+						file->sectorList[first + i] = loc;
+					}
+				}
+			}
+			// The first write to a sector shared with a clone goes to a copy of it, and
+			// a compressed sector that no longer compresses gets a sector of its own
+			shared = (!settled && (compressed || SECTOR_REFS(locs[i]) > 1));
+			if(errorCheck == 0 && shared){
+				if((loc = allocSector(FS3_BLOCK_SECTOR(locs[i]) + 1, FS3_OWNER_ID(FS3_HANDLE_SLOT(fd)))) == -1){
+					logMessage(LOG_ERROR_LEVEL, "Disk full, cannot copy shared sector of file %d.", fd);
+					errorCheck = -1;
+				}else{
+					track = loc / fs3TrackSize;
+					sect = loc % fs3TrackSize;
+					cacheBuf = NULL;
+				}
+			}
+			if(errorCheck != 0){
+				break;
+			}
+			// The write waits for the rest of its batch, the file takes it once it is on disk
+			if(!settled){
+				fs3_dedup_remove((uint64_t)track * fs3TrackSize + sect);
+				pending[queued] = (PendingWrite){ .idx = i, .loc = (uint64_t)track * fs3TrackSize + sect,
+					.shared = shared, .hash = hash, .doneBefore = done };
+				ops[queued] = (FS3ArrayOp){ .op = FS3_OP_WRSECT, .track = track, .sect = sect,
+					.buf = memcpy(&batchBuf[queued * FS3_SECTOR_SIZE], sectContent, FS3_SECTOR_SIZE) };
+				queued++;
+			}else if(file->isPacked && first + i == oldTail){
+				releaseTail(file->cold->tailSector);
+				file->isPacked = 0;
+			}
+		}
+		done += len;
+		if(queued == batchLimit || (queued > 0 && i + 1 == realCount)){
+			failed = flushWrites(file, first, locs, oldTail, pending, ops, queued);
+			queued = 0;
+			if(failed != -1){
+				i = pending[failed].idx;
+				done = pending[failed].doneBefore;
+				errorCheck = -1;
+				break;
+			}
+		}
+	}
+	// Writes queued ahead of a sector that failed still go out
+	if(queued > 0 && (failed = flushWrites(file, first, locs, oldTail, pending, ops, queued)) != -1){
+		i = pending[failed].idx;
+		done = pending[failed].doneBefore;
+	}
+	if(errorCheck == 0 && realCount < count){
+		sectStart = (offset + done) % POS_ENDOF_FILE;
+		len = total - done;
+		if((errorCheck = rwTail(fd, first + i, iov, &iovIdx, &iovOff, sectStart, len, isWrite)) == 0){
+			done += len;
+		}
+	}
+	free(locs);
+	free(ops);
+	free(pending);
+	free(slots);
+	free(batchBuf);
+	// Whatever reached the disk is part of the file
+	if(isWrite && (offset + done) > (uint64_t)file->length){
+		file->length = offset + done;
+	}
+	if(errorCheck != 0){
+		logMessage(LOG_ERROR_LEVEL, "Controller failed %s sector %d of file %d.", isWrite ? "writing" : "reading", first + i, fd);
+		return -1;
+	}
+	return (int32_t)done;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : promoteInline
+// Description  : Moves an inline file to real sectors. The inline data up to
+//                the write offset is written in the same pass as the write
+//                that outgrew the record (which always runs past the old end
+//                of the file), so no sector is touched twice.
+//
+// Inputs       : fd - the file handle
+//                iov - the buffers being written
+//                iovcnt - the number of buffers
+//                offset - where in the file the write starts
+// Outputs      : bytes of the write moved if successful, -1 if failure
+
+int32_t promoteInline(int32_t fd, const struct iovec *iov, int iovcnt, uint64_t offset){
+	File *file = FILE_AT(FS3_HANDLE_SLOT(fd));
+	struct iovec *combined;
+	int32_t moved, length = file->length;
+	if((combined = malloc(sizeof(struct iovec) * (iovcnt + 1))) == NULL){
+		return -1;
+	}
+	combined[0].iov_base = file->cold->inlineData;
+	combined[0].iov_len = offset;
+	memcpy(&combined[1], iov, sizeof(struct iovec) * iovcnt);
+	file->isInline = 0;
+	moved = rwVector(fd, combined, iovcnt + 1, 0, 1);
+	free(combined);
+	if(moved == -1){
+		// The record still holds everything that was there before
+		file->isInline = 1;
+		file->length = length;
+		return -1;
+	}
+	logMessage(FS3DriverLLevel, "File %d promoted from inline to %d sectors.", fd, file->sectorCount);
+	return moved - (int32_t)offset;
+}
+
+int16_t fs3_set_inline_threshold(uint32_t bytes){
+	if(bytes > FS3_INLINE_MAX){
+		return -1;
+	}
+	inlineThreshold = bytes;
+	return 0;
+}
+
+int16_t fs3_set_tail_packing(uint32_t bytes){
+	if(bytes > FS3_PACK_MAX){
+		return -1;
+	}
+	packThreshold = bytes;
+	return 0;
+}
+
+int16_t fs3_set_compression(uint32_t bytes){
+	if(bytes > FS3_COMPRESS_MAX){
+		return -1;
+	}
+	compressThreshold = bytes;
+	return 0;
+}
+
+// Tracks and sectors are addressed with 16 bit indexes, and the whole disk
+// must fit the sector bits of a sector list entry
+int16_t fs3_set_geometry(uint32_t tracks, uint32_t trackSize){
+	if(tracks == 0 || trackSize == 0 || tracks > UINT16_MAX + 1 || trackSize > UINT16_MAX + 1 ||
+			(uint64_t)tracks * trackSize > (uint64_t)FS3_BLOCK_SECTOR_MASK + 1){
+		return -1;
+	}
+	geometryTracks = tracks;
+	geometryTrackSize = trackSize;
+	return 0;
+}
+
+int16_t fs3_set_checksums(int8_t enabled){
+	checksumSectors = (enabled != 0);
+	return 0;
+}
+
+int16_t fs3_set_dedup(int8_t enabled){
+	dedupWrites = (enabled != 0);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flushAppend
+// Description  : Writes the append buffer of a file to the end of the file.
+//                On a failure the bytes that did not reach the disk stay
+//                in the buffer.
+//
+// Inputs       : file - the file
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t flushAppend(File *file){
+	struct iovec iov;
+	int32_t length = file->length;
+	uint16_t written;
+	if(file->appendLen == 0){
+		return 0;
+	}
+	iov.iov_base = file->cold->appendData;
+	iov.iov_len = file->appendLen;
+	fs3_metrics_append(1);
+	if(rwVector(file->handle, &iov, 1, file->length, 1) == -1){
+		written = file->length - length;
+		memmove(file->cold->appendData, &file->cold->appendData[written], file->appendLen - written);
+		file->appendLen -= written;
+		logMessage(LOG_ERROR_LEVEL, "Cannot write %u appended bytes of file %d.", file->appendLen, file->handle);
+		return -1;
+	}
+	file->appendLen = 0;
+	return 0;
+}
+
+int16_t fs3_flush_appends(void){
+	int16_t ret = 0;
+	int32_t i;
+	for(i = 0; i < createdFilesSize; i++){
+		if(FILE_AT(i)->appendLen > 0 && flushAppend(FILE_AT(i)) != 0){
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+// Takes a small write at the end of the append buffer into it. The buffer is
+// written out whenever it reaches the end of a sector, and the rest of the
+// write starts the next one. Returns the bytes taken, 0 if the write must go
+// to the disk, -1 if failure. If the buffer cannot be written out the write
+// stops there and comes back short, the bytes taken stay in the buffer for
+// the next flush.
+static int32_t bufferAppend(File *file, const struct iovec *iov, uint64_t offset, uint64_t total){
+	uint32_t used = (file->length + file->appendLen) % POS_ENDOF_FILE, take;
+	uint64_t taken = 0;
+	int iovIdx = 0;
+	size_t iovOff = 0;
+	if(file->isInline || offset != (uint64_t)file->length + file->appendLen || total == 0 || total >= POS_ENDOF_FILE){
+		return 0;
+	}
+	if(file->cold->appendData == NULL && (file->cold->appendData = malloc(POS_ENDOF_FILE)) == NULL){
+		return 0;
+	}
+	// A full buffer left by a failed flush has to go out before it takes more
+	if(used == 0 && file->appendLen > 0 && flushAppend(file) != 0){
+		return -1;
+	}
+	fs3_metrics_append(0);
+	while(taken < total){
+		take = CMPSC311_MINVAL(total - taken, POS_ENDOF_FILE - used);
+		iovCopy(iov, &iovIdx, &iovOff, &file->cold->appendData[file->appendLen], take, 1);
+		file->appendLen += take;
+		taken += take;
+		if(used + take == POS_ENDOF_FILE){
+			if(flushAppend(file) != 0){
+				break;
+			}
+			used = 0;
+		}
+	}
+	return (int32_t)taken;
+}
+
+// Runs a vectored request with metrics, moving the file position when asked to.
+// Appends at the current position go through the append buffer of the file,
+// and reads past the disk part of the file are served from it.
+static int32_t rwRequest(int32_t fd, const struct iovec *iov, int iovcnt, int64_t offset, int8_t isWrite){
+	int32_t moved;
+	uint64_t start, total = 0, left, skip;
+	int iovIdx = 0, i;
+	size_t iovOff = 0;
+	int32_t taken = 0;
+	File *file = fileFromHandle(fd);
+	if(file == NULL){
+		return -1;
+	}
+	start = (offset < 0) ? file->pos : (uint64_t)offset;
+	for(i = 0; i < iovcnt && iov != NULL; i++){
+		total += iov[i].iov_len;
+	}
+	fs3_metrics_begin_request(isWrite ? FS3_REQ_WRITE : FS3_REQ_READ);
+	if(isWrite && file->isOpen && total <= INT32_MAX){
+		if(offset < 0){
+			taken = bufferAppend(file, iov, start, total);
+		}
+		// Any other write reaching the buffered bytes goes after them
+		if(taken == 0 && file->appendLen > 0 && start + total > (uint64_t)file->length && flushAppend(file) != 0){
+			taken = -1;
+		}
+	}
+	if(taken != 0){
+		moved = taken;
+	}else{
+		moved = rwVector(fd, iov, iovcnt, start, isWrite);
+	}
+	if(!isWrite && moved >= 0 && file->appendLen > 0 && start + moved >= (uint64_t)file->length &&
+			start + moved < (uint64_t)file->length + file->appendLen && (uint64_t)moved < total){
+		// The rest comes from the buffer, after the part already read from the disk
+		skip = moved;
+		while(skip > 0){
+			left = CMPSC311_MINVAL(skip, iov[iovIdx].iov_len - iovOff);
+			iovOff += left;
+			skip -= left;
+			if(iovOff == iov[iovIdx].iov_len){
+				iovIdx++;
+				iovOff = 0;
+			}
+		}
+		left = CMPSC311_MINVAL(total - moved, file->length + file->appendLen - (start + moved));
+		iovCopy(iov, &iovIdx, &iovOff, &file->cold->appendData[start + moved - file->length], left, 0);
+		moved += left;
+	}
+	if(moved > 0 && offset < 0){
+		file->pos += moved;
+	}
+	// The saved hot set of the cache comes in a batch at a time at the end of
+	// a request, which waits for it and is charged with its sectors
+	fs3_warm_cache();
+	fs3_metrics_end_request(moved);
+	fs3_journal_tick();
+	return moved;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_read
+// Description  : Reads "count" bytes from the file handle "fh" into the 
+//                buffer "buf"
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t fs3_read(int32_t fd, void *buf, int32_t count) {
+	struct iovec iov = { buf, (count < 0) ? 0 : count };
+	return rwRequest(fd, &iov, 1, -1, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_write
+// Description  : Writes "count" bytes to the file handle "fh" from the 
+//                buffer  "buf"
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t fs3_write(int32_t fd, void *buf, int32_t count) {
+	struct iovec iov = { buf, (count < 0) ? 0 : count };
+	return rwRequest(fd, &iov, 1, -1, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_readv
+// Description  : Reads from the current position into several buffers, in order
+//
+// Inputs       : fd - the file handle
+//                iov - the buffers to fill
+//                iovcnt - the number of buffers
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t fs3_readv(int32_t fd, const struct iovec *iov, int iovcnt) {
+	return rwRequest(fd, iov, iovcnt, -1, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_writev
+// Description  : Writes several buffers, in order, at the current position
+//
+// Inputs       : fd - the file handle
+//                iov - the buffers to write
+//                iovcnt - the number of buffers
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t fs3_writev(int32_t fd, const struct iovec *iov, int iovcnt) {
+	return rwRequest(fd, iov, iovcnt, -1, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_pread
+// Description  : Reads "count" bytes at "offset" without moving the file position
+//
+// Inputs       : fd - the file handle
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+//                offset - where in the file to read from
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t fs3_pread(int32_t fd, void *buf, int32_t count, uint32_t offset) {
+	struct iovec iov = { buf, (count < 0) ? 0 : count };
+	return rwRequest(fd, &iov, 1, offset, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_pwrite
+// Description  : Writes "count" bytes at "offset" without moving the file
+//                position, offset may be at most the file length
+//
+// Inputs       : fd - the file handle
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+//                offset - where in the file to write to
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t fs3_pwrite(int32_t fd, void *buf, int32_t count, uint32_t offset) {
+	struct iovec iov = { buf, (count < 0) ? 0 : count };
+	return rwRequest(fd, &iov, 1, offset, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_seek
+// Description  : Seek to specific point in the file
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_seek(int32_t fd, uint32_t loc) {
+	int32_t ret = -1;
+	// If file is open and the position is at most the length then it updates position.
+	File *file = fileFromHandle(fd);
+	if(file != NULL){
+		if(file->isOpen){
+			if(file->length + file->appendLen >= loc){
+				// Appends only go on at the end of the buffer, so moving off it writes the buffer out
+				if(loc == file->length + file->appendLen || flushAppend(file) == 0){
+					file->pos = loc;
+					ret = 0;
+				}
+			}
+		}
+		fs3_journal_tick();
+	}
+	// Possible implementation of created file search to return if file exists but is not open
+	return ret;
+}
+//
+// Unit tests
+
+// Writes a file, clones it until the clone is refused, drops the clones and
+// writes files that reuse the sectors they gave back. The source must still
+// read back as written.
+static int16_t testCloneLimit(char *src, const char *data, int32_t len){
+	char name[32], back[FS3_UNIT_FILE_MAX], fill[FS3_UNIT_FILE_MAX];
+	int32_t fd, i, clones = 0, ret = 0;
+	if((fd = fs3_open(src)) == -1 || fs3_write(fd, (void *)data, len) != len || fs3_close(fd) != 0){
+		return -1;
+	}
+	while(clones < FS3_UNIT_CLONES){
+		snprintf(name, sizeof(name), "clone/%d", clones);
+		if(fs3_clone(src, name) != 0){
+			break;
+		}
+		clones++;
+	}
+	if(clones == FS3_UNIT_CLONES){
+		logMessage(LOG_ERROR_LEVEL, "FS3 driver unit test: %d clones of [%s] all taken.", clones, src);
+		ret = -1;
+	}
+	for(i = 0; i < clones; i++){
+		snprintf(name, sizeof(name), "clone/%d", i);
+		fs3_unlink(name);
+	}
+	for(i = 0; i < FS3_UNIT_FILLERS; i++){
+		snprintf(name, sizeof(name), "filler/%d", i);
+		memset(fill, 'a' + i % 26, len);
+		if((fd = fs3_open(name)) == -1 || fs3_write(fd, fill, len) != len || fs3_close(fd) != 0){
+			ret = -1;
+		}
+	}
+	if((fd = fs3_open(src)) == -1 || fs3_read(fd, back, len) != len || memcmp(back, data, len) != 0){
+		logMessage(LOG_ERROR_LEVEL, "FS3 driver unit test: [%s] lost its contents after %d clones.", src, clones);
+		ret = -1;
+	}
+	fs3_close(fd);
+	fs3_unlink(src);
+	for(i = 0; i < FS3_UNIT_FILLERS; i++){
+		snprintf(name, sizeof(name), "filler/%d", i);
+		fs3_unlink(name);
+	}
+	return ret;
+}
+
+// Drops the tables the way a crash would, without the checkpoint of an
+// unmount, and reads them back from the journal of the disk still mounted
+static int16_t testCrash(void){
+	fs3_journal_drop();
+	freeTables();
+	return (init() == 0 && fs3_journal_mount(1) == 0) ? 0 : -1;
+}
+
+// Unlinks a file, crashes and makes a file in a slot an unlinked file left.
+// The replayed slots of unlinked files must come back without sector lists,
+// and every file must read back.
+static int16_t testReplayReuse(const char *data){
+	char back[FS3_UNIT_FILE_MAX];
+	int32_t fd, i, len = 4 * POS_ENDOF_FILE, ret = 0;
+	if((fd = fs3_open("unit/gone")) == -1 || fs3_write(fd, (void *)data, len) != len || fs3_close(fd) != 0 ||
+			(fd = fs3_open("unit/kept")) == -1 || fs3_write(fd, (void *)data, len) != len || fs3_close(fd) != 0 ||
+			fs3_unlink("unit/gone") != 0 || fs3_journal_commit() != 0 || testCrash() != 0){
+		return -1;
+	}
+	for(i = 0; i < createdFilesSize; i++){
+		if(FILE_AT(i)->isDeleted && FILE_AT(i)->sectorList != NULL){
+			logMessage(LOG_ERROR_LEVEL, "FS3 driver unit test: replayed slot %d kept its sector list.", i);
+			ret = -1;
+		}
+	}
+	if((fd = fs3_open("unit/reused")) == -1 || FS3_HANDLE_GENERATION(fd) == 0 ||
+			fs3_write(fd, (void *)data, len) != len || fs3_seek(fd, 0) != 0 ||
+			fs3_read(fd, back, len) != len || memcmp(back, data, len) != 0){
+		logMessage(LOG_ERROR_LEVEL, "FS3 driver unit test: file in a replayed slot failed.");
+		ret = -1;
+	}
+	fs3_close(fd);
+	if((fd = fs3_open("unit/kept")) == -1 || fs3_read(fd, back, len) != len || memcmp(back, data, len) != 0){
+		logMessage(LOG_ERROR_LEVEL, "FS3 driver unit test: [unit/kept] lost its contents in the crash.");
+		ret = -1;
+	}
+	fs3_close(fd);
+	fs3_unlink("unit/kept");
+	fs3_unlink("unit/reused");
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_driver_unit_test
+// Description  : Runs the unit tests of the driver on a freshly mounted disk
+//                with a metadata journal
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t fs3_driver_unit_test(void){
+	uint32_t savedInline = inlineThreshold, savedPack = packThreshold, savedCompress = compressThreshold;
+	char data[FS3_UNIT_FILE_MAX], runs[FS3_UNIT_FILE_MAX];
+	int16_t ret = 0;
+	int32_t i;
+	// The disk keeps a journal every change is committed to right away
+	if(fs3_journal_configure(FS3_UNIT_JOURNAL, 0) != 0 || fs3_mount_disk() != 0 || fs3_init_cache(FS3_UNIT_CACHE) != 0){
+		return -1;
+	}
+	for(i = 0; i < FS3_UNIT_FILE_MAX; i++){
+		data[i] = (char)(i * 7 + 3);
+		runs[i] = (char)('A' + i / POS_ENDOF_FILE);
+	}
+	// A packed tail shared by more clones than its sector can count
+	inlineThreshold = 0;
+	packThreshold = FS3_PACK_MAX;
+	if(testCloneLimit("unit/tail", data, 100) != 0){
+		ret = -1;
+	}
+	// Compressed sectors sharing one sector, each clone takes a count per slot
+	packThreshold = 0;
+	compressThreshold = FS3_COMPRESS_MAX;
+	if(testCloneLimit("unit/compressed", runs, FS3_UNIT_FILE_MAX) != 0){
+		ret = -1;
+	}
+	inlineThreshold = savedInline;
+	packThreshold = savedPack;
+	compressThreshold = savedCompress;
+	// A crash replayed from the journal
+	if(testReplayReuse(data) != 0){
+		ret = -1;
+	}
+	fs3_unmount_disk();
+	fs3_journal_configure(0, FS3_JOURNAL_DEFAULT_WINDOW_MS);
+	fs3_close_cache();
+	return ret;
+}
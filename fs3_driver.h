@@ -15,31 +15,120 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 #include "fs3_cache.h"
 #include "fs3_controller.h"
+#include "fs3_array.h"
 
 // Defines
-#define FS3_MAX_TOTAL_FILES 1024 // Maximum number of files ever
+#define FS3_HANDLE_SLOT_BITS 22 // Low bits of a handle (past FS3_STARTING_HANDLE) give the file slot
+#define FS3_HANDLE_GENERATIONS 256 // The bits above count the reuses of the slot
+#define FS3_MAX_TOTAL_FILES (1 << FS3_HANDLE_SLOT_BITS) // Maximum number of files at once
 #define FS3_MAX_PATH_LENGTH 128 // Maximum length of filename length
 #define FS3_STARTING_HANDLE 5 // Starting file handle
-#define FS3_FILE_ARR_STEPSIZE 64 // Step size for the created files arr
+#define FS3_FILE_SLAB_SIZE 1024 // File records are allocated this many at a time, and never move
 #define FS3_OPENFILE_ARR_STEPSIZE 8 // Step size for open files arr
 #define POS_ENDOF_FILE 1023 // 1 - FS3_SECTOR SIZE
+#define FS3_INLINE_MAX 256 // Largest file kept inline in its File record
+#define FS3_PACK_MAX 512 // Largest file tail packed into a shared sector
+#define FS3_PACK_GRAIN 64 // Packed tail slots are reserved in multiples of this
+#define FS3_PACK_OWNER ((uint16_t)-2) // Sector map owner of the shared tail sectors
+#define FS3_FREE_SECTOR ((uint16_t)-1) // Sector map owner of sectors nobody holds
+#define FS3_UNKNOWN_TRACK UINT32_MAX // Head position before the first seek
+#define FS3_COMPRESS_MAX 512 // Largest compressed sector kept in a slot of a shared sector
 
-// Struct storing important file information
+// A compressed sector lives in a slot of a shared sector, and its entry in the
+// sector list records the sector in the low bits, then the slot and its
+// capacity in grains
+#define FS3_BLOCK_COMPRESSED 0x80000000u
+#define FS3_BLOCK_SHARED 0x40000000u // The slot may also be used by a clone
+#define FS3_BLOCK_SECTOR_MASK 0x003FFFFFu // Also bounds the size of the disk
+#define FS3_BLOCK_SECTOR(e) ((e) & FS3_BLOCK_SECTOR_MASK)
+#define FS3_BLOCK_SLOT(e) ((((e) >> 22) & 0xF) * FS3_PACK_GRAIN)
+#define FS3_BLOCK_CAPACITY(e) ((((e) >> 26) & 0xF) * FS3_PACK_GRAIN)
+#define FS3_MAKE_BLOCK(sector, slot, capacity) (FS3_BLOCK_COMPRESSED | \
+	((uint32_t)((capacity) / FS3_PACK_GRAIN) << 26) | ((uint32_t)((slot) / FS3_PACK_GRAIN) << 22) | (uint32_t)(sector))
+
+// The sector maps are kept per track and only for the tracks handed out so
+// far, each with a bitmap of its free sectors below assignedSectors
+typedef struct {
+	uint64_t *freeMap;  // One bit per free sector
+	uint16_t *owner;    // Handle holding each sector (or FS3_PACK_OWNER, FS3_FREE_SECTOR)
+	uint16_t *refs;     // Files holding each data sector, more than one after a clone
+	uint8_t *packRefs;  // Packed tails held by each shared sector
+	uint32_t freeCount; // Bits set in freeMap
+} FS3TrackMeta;
+
+#define TRACK_META(idx) (trackMeta[(idx) / fs3TrackSize])
+#define SECTOR_OWNER(idx) (TRACK_META(idx)->owner[(idx) % fs3TrackSize])
+#define SECTOR_REFS(idx) (TRACK_META(idx)->refs[(idx) % fs3TrackSize])
+#define PACK_REFS(idx) (TRACK_META(idx)->packRefs[(idx) % fs3TrackSize])
+
+// Handles carry the slot of the file and a generation, so a handle kept past
+// an unlink does not reach the next file given the slot
+#define FS3_HANDLE_SLOT(h) (((uint32_t)(h) - FS3_STARTING_HANDLE) & (FS3_MAX_TOTAL_FILES - 1))
+#define FS3_HANDLE_GENERATION(h) (((uint32_t)(h) - FS3_STARTING_HANDLE) >> FS3_HANDLE_SLOT_BITS)
+#define FS3_MAKE_HANDLE(slot, generation) ((int32_t)(((uint32_t)((generation) % FS3_HANDLE_GENERATIONS) << \
+	FS3_HANDLE_SLOT_BITS | (uint32_t)(slot)) + FS3_STARTING_HANDLE))
+
+// Sector map owner of a file, files past the first 64K share the last id
+// (the map only needs to tell held sectors from free ones)
+#define FS3_OWNER_ID(slot) ((uint16_t)(((slot) < FS3_PACK_OWNER) ? (slot) : FS3_PACK_OWNER - 1))
+
+// The part of a file record only needed by name lookups, inline files and
+// packed tails
+typedef struct FleCold{
+	const char *path; // Interned in the path table, NULL once unlinked
+	// Small files keep their data here until they grow past the inline threshold
+	char inlineData[FS3_INLINE_MAX];
+	// With tail packing the partial last sector lives in a slot of a shared sector
+	uint16_t tailOffset;
+	uint16_t tailCapacity;
+	uint64_t tailSector;
+	int8_t tailShared; // The slot may also be used by a clone
+	// Appends not written yet, allocated at the first one
+	char *appendData;
+} FileCold;
+
+// Struct storing important file information, what every request touches
 typedef struct Fle{ 
 	// File data
-	char path[FS3_MAX_PATH_LENGTH];
 	int32_t length;
 		// pointers are hard so I malloced an array of locations and realloced to add more locations
 	int32_t sectorCount;
+	int32_t sectorCapacity;
+	uint16_t appendLen; // Bytes past length held in the append buffer
+	uint32_t *sectorList; // Disk index (or compressed block) of each sector of the file, in file order
 	// Open info
-	int8_t isOpen;
-	int32_t handle;
 	uint64_t pos;
-	int16_t readCount;
+	int32_t handle;
+	int8_t isOpen;
+	int8_t isInline;
+	int8_t isPacked;
+	// Unlinked files keep their slot, until a new file takes it
+	int8_t isDeleted;
+	FileCold *cold;
 } File;
 
+#define FILE_AT(slot) (&fileSlabs[(slot) / FS3_FILE_SLAB_SIZE][(slot) % FS3_FILE_SLAB_SIZE])
+
+//
+// Global Data (defined in fs3_driver.c)
+extern int32_t createdFilesSize;         // Number of file slots handed out
+extern uint64_t assignedSectors;         // Number of sectors handed out, in disk order
+extern File **fileSlabs;                 // File table, FILE_AT(slot) is the record of a slot
+extern uint32_t fs3Tracks;               // Tracks of the mounted disk
+extern uint32_t fs3TrackSize;            // Sectors per track of the mounted disk
+extern uint64_t fs3DiskSectors;          // Sectors of the mounted disk
+extern uint64_t fs3DiskOffset;           // Sectors in front of it kept by the metadata journal
+extern FS3TrackMeta **trackMeta;         // Sector maps of each track, NULL until the track is used
+extern uint32_t inlineThreshold;         // Files up to this size stay inline (0 disables)
+extern uint32_t packThreshold;           // File tails up to this size are packed (0 disables)
+extern uint32_t compressThreshold;       // Sectors that compress to this size are packed (0 disables)
+extern int8_t dedupWrites;               // Sectors with identical contents are stored once
+extern int8_t checksumSectors;           // Sectors are checked against a CRC32C when read
+extern uint64_t freeSectors;             // Sectors below assignedSectors given back to the pool
+
 
 //
 // CmdBlk Functions
@@ -50,18 +139,75 @@ int16_t deconstruct_fs3_cmdblk(FS3CmdBlk cmdblk, uint8_t *op, uint16_t *sec, uin
 
 //
 // Structure Functions
-int16_t setFileInfo(File *file, char *path, int32_t length);
-	// Takes in a pointer to a file and fills it with the given parameters
+int16_t setFileInfo(File *file, const char *path, int32_t length);
+	// Takes in a pointer to a file and fills it with the given parameters (path is interned)
 int16_t setOpenInfo(File *file, int8_t isOpen, int32_t handle, uint64_t pos);
 	// Takes in a pointer to a open file and fills it with the given parameters
 int16_t init();
 	// Sets up the structures for use	
+int32_t mountDisk(int8_t recover);
+	// Mounts the disk, reading the file table back from the metadata journal when recover is set
+int32_t createFile(char *path);
+	// Adds a new, empty and closed file to the file table, returns its handle
+File *fileFromHandle(int32_t handle);
+	// The record of a live file, NULL if the handle is stale or was never given out
+int16_t growFileTable(uint32_t slots);
+	// Makes sure the file table has records for the first "slots" slots
+int16_t rebuildFileIndex(void);
+	// Rebinds the paths, enters the files in their directories and collects the free slots
 int8_t findLoc(uint64_t pos, uint32_t fd, int32_t *track, int32_t *sector);
 
 // Outdated index removing function
 //int16_t arrRemoveAt(int32_t index, int32_t *arrLength, int32_t elementSize, void *arrStart);
-// Linked List Functions
-int8_t isFileOpen(int32_t handle);
+
+//
+// Bus Functions
+int16_t fs3_bus_command(uint8_t op, uint16_t sec, uint32_t track, void *buf);
+	// Sends a command block to the controller, returns the ret bit of the response
+int16_t fs3_bus_seek(uint32_t track);
+	// Seeks to the track, skipping the command when the head is already there
+int16_t fs3_bus_read(uint32_t track, uint16_t sect, void *buf);
+	// Seeks and reads a sector (from the warm-start image while it still holds it)
+int16_t fs3_bus_write(uint32_t track, uint16_t sect, void *buf);
+	// Seeks and writes a sector
+int16_t fs3_bus_submit(FS3ArrayOp *ops, uint32_t count);
+	// Issues a batch of reads and writes, side by side on the units of an array
+int16_t fs3_bus_submit_raw(FS3ArrayOp *ops, uint32_t count);
+	// Issues a batch on the whole disk, the metadata area in front of the driver's disk included
+
+//
+// Allocation Functions
+int64_t allocSector(uint64_t from, uint16_t owner);
+	// Takes a free sector, looking from "from" onwards first, growing the disk when there is none
+int16_t freeFileSectors(int32_t fd, uint32_t keep);
+	// Drops the file's hold on every sector past the first "keep", unshared ones go back to the pool
+int16_t rebuildAllocState(void);
+	// Recounts the free pool and the sector and tail slot users from the file table
+int16_t growSectorMap(uint64_t sectors);
+	// Makes sure the per-track maps cover the first "sectors" sectors of the disk
+
+//
+// I/O Functions
+int16_t resolveSectors(int32_t fd, uint32_t first, uint32_t count, uint64_t *locs, int8_t allocate);
+	// Finds (or allocates) the disk location of a run of a file's sectors in one pass
+int32_t rwVector(int32_t fd, const struct iovec *iov, int iovcnt, uint64_t offset, int8_t isWrite);
+	// Reads or writes a run of a file, touching each sector once
+int32_t promoteInline(int32_t fd, const struct iovec *iov, int iovcnt, uint64_t offset);
+	// Moves an inline file to real sectors together with the write that outgrew it
+int16_t flushAppend(File *file);
+	// Writes out the append buffer of a file, keeping what did not reach the disk
+int16_t fs3_set_inline_threshold(uint32_t bytes);
+	// Sets the largest file kept inline (at most FS3_INLINE_MAX, 0 disables)
+int16_t fs3_set_tail_packing(uint32_t bytes);
+	// Sets the largest file tail packed into a shared sector (at most FS3_PACK_MAX, 0 disables)
+int16_t fs3_set_compression(uint32_t bytes);
+	// Sets the largest compressed sector packed into a shared sector (at most FS3_COMPRESS_MAX, 0 disables)
+int16_t fs3_set_dedup(int8_t enabled);
+	// Turns content-addressed sector deduplication on or off, from the next mount
+int16_t fs3_set_checksums(int8_t enabled);
+	// Turns end-to-end sector checksums on or off, from the next mount
+int16_t fs3_set_geometry(uint32_t tracks, uint32_t trackSize);
+	// Sets the number of tracks and sectors per track of the disk, from the next mount
 
 //
 // Interface functions
@@ -72,19 +218,58 @@ int32_t fs3_mount_disk(void);
 int32_t fs3_unmount_disk(void);
 	// FS3 interface, unmount the disk, close all files
 
-int16_t fs3_open(char *path);
+int32_t fs3_open(char *path);
 	// This function opens a file and returns a file handle
 
-int16_t fs3_close(int16_t fd);
+int16_t fs3_close(int32_t fd);
 	// This function closes a file
 
-int32_t fs3_read(int16_t fd, void *buf, int32_t count);
+int16_t fs3_unlink(char *path);
+	// Removes a closed file, giving its sectors back to the pool
+
+int16_t fs3_truncate(int32_t fd, int32_t length);
+	// Shrinks an open file to "length" bytes, giving the sectors past it back to the pool
+
+int16_t fs3_clone(char *src, char *dst);
+	// Creates dst as a copy of src that shares its sectors until either is written
+
+int16_t fs3_flush_appends(void);
+	// Writes out the append buffers of every open file
+
+int32_t fs3_compact(void);
+	// Slides the assigned sectors down over the free ones, returns the number of sectors moved
+
+int32_t fs3_defrag(void);
+	// Moves every file into one contiguous run of sectors, returns the number of sectors moved
+
+uint64_t fs3_track_switches(void);
+	// Counts the track changes needed to read every file from start to end
+
+int32_t fs3_read(int32_t fd, void *buf, int32_t count);
 	// Reads "count" bytes from the file handle "fh" into the buffer  "buf"
 
-int32_t fs3_write(int16_t fd, void *buf, int32_t count);
+int32_t fs3_write(int32_t fd, void *buf, int32_t count);
 	// Writes "count" bytes to the file handle "fh" from the buffer  "buf"
 
-int32_t fs3_seek(int16_t fd, uint32_t loc);
+int32_t fs3_seek(int32_t fd, uint32_t loc);
 	// Seek to specific point in the file
 
+int32_t fs3_readv(int32_t fd, const struct iovec *iov, int iovcnt);
+	// Reads from the current position into several buffers, in order
+
+int32_t fs3_writev(int32_t fd, const struct iovec *iov, int iovcnt);
+	// Writes several buffers, in order, at the current position
+
+int32_t fs3_pread(int32_t fd, void *buf, int32_t count, uint32_t offset);
+	// Reads "count" bytes at "offset" without moving the file position
+
+int32_t fs3_pwrite(int32_t fd, void *buf, int32_t count, uint32_t offset);
+	// Writes "count" bytes at "offset" without moving the file position
+
+//
+// Unit tests
+
+int16_t fs3_driver_unit_test(void);
+	// Runs the unit tests of the driver on a freshly mounted disk
+
 #endif
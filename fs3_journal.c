@@ -0,0 +1,802 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_journal.c
+//  Description    : This is the implementation of the FS3 metadata journal.
+//                   A request only marks the file records it changed (and
+//                   from which entry their sector lists changed), so a run of
+//                   writes to one file costs one record in the next group. A
+//                   group goes to the ring as a run of sectors, the last one
+//                   flagged, and is only replayed when every sector of it made
+//                   it to the disk. A checkpoint is built in memory in one go
+//                   and written a few sectors with each group to the area not in
+//                   use, then the superblock is switched over to it. Data
+//                   sectors are written through as before, the journal only
+//                   keeps the file table in step with them, so a sector freed
+//                   and reused within one group may hold the new owner's data
+//                   after a crash.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Project Includes
+#include <fs3_journal.h>
+#include <fs3_driver.h>
+#include <fs3_latency.h>
+#include <fs3_checksum.h>
+#include <fs3_names.h>
+#include <fs3_dir.h>
+
+//
+// Support Macros/Data
+#define JOURNAL_BLOCK_MAGIC 0x4a335346u // Marks a sector of the ring
+#define JOURNAL_RECORD_FILE 1
+#define JOURNAL_RECORD_DIR 2
+#define JOURNAL_INLINE 0x01
+#define JOURNAL_PACKED 0x02
+#define JOURNAL_DELETED 0x04
+#define JOURNAL_TAIL_SHARED 0x08
+#define JOURNAL_SUPERS 2 // Superblock copies at the start of the area
+#define JOURNAL_MIN_RING 4
+
+// A file record as journaled, followed by the path, the inline data and the
+// sector list entries from "from" on
+typedef struct {
+	uint64_t tailSector;
+	int32_t handle;
+	int32_t length;
+	int32_t sectorCount;
+	uint32_t slot;
+	uint32_t from;
+	uint16_t tailOffset;
+	uint16_t tailCapacity;
+	uint16_t inlineLen;
+	uint8_t flags;
+	uint8_t pathLen;
+} JournalFile;
+
+// Header of a sector of the ring, the payload follows it
+typedef struct {
+	uint32_t magic;
+	uint16_t bytes; // Payload bytes used
+	uint8_t last;   // Last sector of its group
+	uint8_t unused;
+	uint64_t seq;
+	uint64_t epoch;
+	uint32_t crc;   // Of the header (with crc 0) and the payload
+} JournalBlock;
+
+#define JOURNAL_PAYLOAD (FS3_SECTOR_SIZE - sizeof(JournalBlock))
+
+typedef struct {
+	char *data;
+	uint64_t len;
+	uint64_t capacity;
+} JournalBuffer;
+
+typedef struct {
+	uint32_t from; // First sector list entry that changed
+	int8_t dirty;
+} JournalDirty;
+
+// Configuration, taken at the next mount
+uint32_t journalSectors = 0;
+uint64_t journalWindowNs = (uint64_t)FS3_JOURNAL_DEFAULT_WINDOW_MS * 1000000;
+
+// Layout of the mounted area, journalReserved is 0 when the journal is off
+uint32_t journalReserved;
+uint32_t journalAreaSectors; // Sectors of each checkpoint area
+uint32_t journalRingSectors;
+uint64_t journalRingStart;
+
+// Journal state
+int8_t journalActive = 0;
+FS3JournalSuper journalSuper; // The superblock on the disk
+uint64_t journalNext;         // Sequence number of the next sector of the ring
+uint64_t journalEpoch;
+int8_t journalStale;          // A group was lost, only a checkpoint brings the disk up to date
+JournalDirty *journalDirty = NULL;
+uint32_t journalDirtyCapacity;
+uint32_t *journalDirtyList = NULL;
+uint32_t journalDirtyCount;
+uint32_t journalDirtyListCapacity;
+JournalBuffer journalDirs;    // Directory records of the group
+uint32_t journalChanges;
+uint64_t journalFirstChange;  // Simulated time of the first change of the group
+
+// The checkpoint being written in the background
+JournalBuffer checkpointImage;
+uint64_t checkpointLsn;
+uint32_t checkpointWritten;
+uint32_t checkpointArea;
+int8_t checkpointRunning;
+
+// Metrics
+uint64_t journalGroups;
+uint64_t journalRecords;
+uint64_t journalBlocks;
+uint64_t journalCheckpoints;
+uint64_t journalReplayed;
+
+//
+// Implementation
+
+static int appendBytes(JournalBuffer *buf, const void *data, uint64_t len) {
+	uint64_t capacity = (buf->capacity > 0) ? buf->capacity : FS3_SECTOR_SIZE;
+	char *grown;
+	while(capacity < buf->len + len){
+		capacity *= 2;
+	}
+	if(capacity != buf->capacity){
+		if((grown = realloc(buf->data, capacity)) == NULL){
+			return(-1);
+		}
+		buf->data = grown;
+		buf->capacity = capacity;
+	}
+	memcpy(&buf->data[buf->len], data, len);
+	buf->len += len;
+	return(0);
+}
+
+static void freeBuffer(JournalBuffer *buf) {
+	free(buf->data);
+	memset(buf, 0x0, sizeof(JournalBuffer));
+}
+
+// Issues "count" commands on consecutive sectors of the area, or of the ring from seq on
+static int16_t areaIo(uint8_t op, uint64_t first, uint64_t seq, uint32_t count, char *buf) {
+	FS3ArrayOp *ops;
+	uint64_t idx;
+	uint32_t i;
+	int16_t ret;
+	if(count == 0){
+		return(0);
+	}
+	if((ops = malloc(sizeof(FS3ArrayOp) * count)) == NULL){
+		return(-1);
+	}
+	for(i = 0; i < count; i++){
+		idx = (first != UINT64_MAX) ? first + i : journalRingStart + (seq + i) % journalRingSectors;
+		ops[i] = (FS3ArrayOp){ .op = op, .track = idx / fs3TrackSize, .sect = idx % fs3TrackSize,
+			.buf = &buf[(uint64_t)i * FS3_SECTOR_SIZE] };
+	}
+	ret = fs3_bus_submit_raw(ops, count);
+	free(ops);
+	return(ret);
+}
+
+static uint32_t superCrc(FS3JournalSuper *super) {
+	FS3JournalSuper copy = *super;
+	copy.crc = 0;
+	return(fs3_crc32c(&copy, sizeof(copy)));
+}
+
+static int superValid(FS3JournalSuper *super) {
+	return(strncmp(super->magic, FS3_JOURNAL_MAGIC, sizeof(super->magic)) == 0 &&
+		super->version == FS3_JOURNAL_VERSION && super->crc == superCrc(super) &&
+		super->tracks == fs3Tracks && super->trackSize == fs3TrackSize && super->sectors == journalReserved &&
+		super->area < 2 && super->checkpointBytes <= (uint64_t)journalAreaSectors * FS3_SECTOR_SIZE);
+}
+
+// Appends the record of a file, with its sector list from entry "from" on
+static int encodeFile(JournalBuffer *buf, uint32_t slot, uint32_t from) {
+	File *file = FILE_AT(slot);
+	uint8_t type = JOURNAL_RECORD_FILE;
+	JournalFile record;
+	memset(&record, 0x0, sizeof(record));
+	record.slot = slot;
+	record.handle = file->handle;
+	record.length = file->length;
+	record.sectorCount = file->sectorCount;
+	record.from = (from < (uint32_t)file->sectorCount) ? from : (uint32_t)file->sectorCount;
+	record.flags = (file->isInline ? JOURNAL_INLINE : 0) | (file->isPacked ? JOURNAL_PACKED : 0) |
+		(file->isDeleted ? JOURNAL_DELETED : 0) | (file->cold->tailShared ? JOURNAL_TAIL_SHARED : 0);
+	record.tailSector = file->cold->tailSector;
+	record.tailOffset = file->cold->tailOffset;
+	record.tailCapacity = file->cold->tailCapacity;
+	record.pathLen = (file->cold->path != NULL) ? strlen(file->cold->path) : 0;
+	record.inlineLen = file->isInline ? CMPSC311_MINVAL(file->length, FS3_INLINE_MAX) : 0;
+	if(appendBytes(buf, &type, 1) != 0 || appendBytes(buf, &record, sizeof(record)) != 0 ||
+			appendBytes(buf, file->cold->path, record.pathLen) != 0 ||
+			appendBytes(buf, file->cold->inlineData, record.inlineLen) != 0 ||
+			appendBytes(buf, &file->sectorList[record.from], sizeof(uint32_t) * (record.sectorCount - record.from)) != 0){
+		return(-1);
+	}
+	return(0);
+}
+
+static int encodeDir(JournalBuffer *buf, const char *path, int8_t made) {
+	uint8_t head[3] = { JOURNAL_RECORD_DIR, (uint8_t)(made != 0), (uint8_t)strlen(path) };
+	if(appendBytes(buf, head, sizeof(head)) != 0 || appendBytes(buf, path, head[2]) != 0){
+		return(-1);
+	}
+	return(0);
+}
+
+// Forgets the changes gathered for the group
+static void clearGroup(void) {
+	uint32_t i;
+	for(i = 0; i < journalDirtyCount; i++){
+		journalDirty[journalDirtyList[i]].dirty = 0;
+	}
+	journalDirtyCount = 0;
+	journalDirs.len = 0;
+	journalChanges = 0;
+}
+
+static void noteChange(void) {
+	if(journalChanges++ == 0){
+		journalFirstChange = fs3_latency_clock();
+	}
+}
+
+// Installs one file record over the table
+static int applyFile(const JournalFile *record, const char *path, const char *inlineData, const char *entries) {
+	char pathCopy[FS3_MAX_PATH_LENGTH];
+	File *file;
+	uint32_t *list;
+	if(growFileTable(record->slot + 1) != 0){
+		return(-1);
+	}
+	if((int32_t)record->slot >= createdFilesSize){
+		createdFilesSize = record->slot + 1;
+	}
+	file = FILE_AT(record->slot);
+	// The entries before "from" were journaled earlier
+	if(record->from > (uint32_t)file->sectorCount){
+		return(-1);
+	}
+	if(record->sectorCount > file->sectorCapacity){
+		if((list = realloc(file->sectorList, sizeof(uint32_t) * record->sectorCount)) == NULL){
+			return(-1);
+		}
+		file->sectorList = list;
+		file->sectorCapacity = record->sectorCount;
+	}
+	memcpy(&file->sectorList[record->from], entries, sizeof(uint32_t) * (record->sectorCount - record->from));
+	file->sectorCount = record->sectorCount;
+	file->handle = record->handle;
+	file->length = record->length;
+	file->isInline = (record->flags & JOURNAL_INLINE) != 0;
+	file->isPacked = (record->flags & JOURNAL_PACKED) != 0;
+	file->isDeleted = (record->flags & JOURNAL_DELETED) != 0;
+	file->cold->tailShared = (record->flags & JOURNAL_TAIL_SHARED) != 0;
+	file->cold->tailSector = record->tailSector;
+	file->cold->tailOffset = record->tailOffset;
+	file->cold->tailCapacity = record->tailCapacity;
+	memcpy(file->cold->inlineData, inlineData, record->inlineLen);
+	memcpy(pathCopy, path, record->pathLen);
+	pathCopy[record->pathLen] = 0x0;
+	file->cold->path = NULL;
+	if(!file->isDeleted && (file->cold->path = fs3_names_intern(pathCopy)) == NULL){
+		return(-1);
+	}
+	return(0);
+}
+
+// Applies the records of a checkpoint or of a group, in order
+static int applyRecords(const char *data, uint64_t len) {
+	JournalFile record;
+	char path[FS3_MAX_PATH_LENGTH];
+	uint64_t pos = 0, need;
+	uint8_t type;
+	while(pos < len){
+		type = (uint8_t)data[pos++];
+		if(type == JOURNAL_RECORD_FILE){
+			if(len - pos < sizeof(record)){
+				return(-1);
+			}
+			memcpy(&record, &data[pos], sizeof(record));
+			pos += sizeof(record);
+			if(record.slot >= FS3_MAX_TOTAL_FILES || record.pathLen >= FS3_MAX_PATH_LENGTH ||
+					record.inlineLen > FS3_INLINE_MAX || record.sectorCount < 0 || record.from > (uint32_t)record.sectorCount){
+				return(-1);
+			}
+			need = record.pathLen + record.inlineLen + sizeof(uint32_t) * (uint64_t)(record.sectorCount - record.from);
+			if(len - pos < need || applyFile(&record, &data[pos], &data[pos + record.pathLen],
+					&data[pos + record.pathLen + record.inlineLen]) != 0){
+				return(-1);
+			}
+			pos += need;
+		}else if(type == JOURNAL_RECORD_DIR){
+			if(len - pos < 2 || len - pos - 2 < (uint8_t)data[pos + 1] || (uint8_t)data[pos + 1] >= FS3_MAX_PATH_LENGTH){
+				return(-1);
+			}
+			memcpy(path, &data[pos + 2], (uint8_t)data[pos + 1]);
+			path[(uint8_t)data[pos + 1]] = 0x0;
+			// A directory only goes away empty, and the files only come back at the end
+			if(data[pos]){
+				if(fs3_dir_make(path) == -1){
+					return(-1);
+				}
+			}else{
+				fs3_rmdir(path);
+			}
+			pos += 2 + (uint8_t)data[pos + 1];
+		}else{
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+// Rebuilds the sector map and the indexes from the replayed file table
+static int finishRecovery(void) {
+	uint64_t assigned = 0, sector;
+	int32_t i, j;
+	File *file;
+	for(i = 0; i < createdFilesSize; i++){
+		file = FILE_AT(i);
+		// A slot no record reached was never used
+		if(file->handle == 0){
+			file->handle = FS3_MAKE_HANDLE(i, 0);
+			file->isDeleted = 1;
+		}
+		// The list a replayed record left on a deleted slot is dropped, as an unlink does
+		if(file->isDeleted){
+			free(file->sectorList);
+			file->sectorList = NULL;
+			file->sectorCapacity = 0;
+			file->sectorCount = 0;
+			file->isPacked = 0;
+			continue;
+		}
+		if(file->cold->path == NULL || FS3_HANDLE_SLOT(file->handle) != (uint32_t)i){
+			return(-1);
+		}
+		for(j = 0; j < file->sectorCount; j++){
+			sector = FS3_BLOCK_SECTOR(file->sectorList[j]);
+			if(sector >= fs3DiskSectors){
+				return(-1);
+			}
+			assigned = CMPSC311_MAXVAL(assigned, sector + 1);
+		}
+		if(file->isPacked){
+			if(file->cold->tailSector >= fs3DiskSectors){
+				return(-1);
+			}
+			assigned = CMPSC311_MAXVAL(assigned, file->cold->tailSector + 1);
+		}
+	}
+	if(growSectorMap(assigned) != 0){
+		return(-1);
+	}
+	assignedSectors = assigned;
+	for(sector = 0; sector < assignedSectors; sector++){
+		SECTOR_OWNER(sector) = FS3_FREE_SECTOR;
+	}
+	for(i = 0; i < createdFilesSize; i++){
+		file = FILE_AT(i);
+		for(j = 0; j < file->sectorCount; j++){
+			sector = FS3_BLOCK_SECTOR(file->sectorList[j]);
+			SECTOR_OWNER(sector) = (file->sectorList[j] & FS3_BLOCK_COMPRESSED) ? FS3_PACK_OWNER : FS3_OWNER_ID(i);
+		}
+		if(file->isPacked){
+			SECTOR_OWNER(file->cold->tailSector) = FS3_PACK_OWNER;
+		}
+	}
+	rebuildAllocState();
+	return((rebuildFileIndex() == 0) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : recoverTable
+// Description  : Reads the checkpoint the superblock points at, then replays
+//                the groups of the ring from the superblock's sequence number
+//                on, up to the first group that did not make it to the disk
+//                whole. Only sectors of the epoch of the superblock count, the
+//                ones left over from an earlier mount are stale.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int recoverTable(void) {
+	JournalBuffer group;
+	JournalBlock block;
+	char sector[FS3_SECTOR_SIZE], *image;
+	uint32_t count = (journalSuper.checkpointBytes + FS3_SECTOR_SIZE - 1) / FS3_SECTOR_SIZE, crc;
+	uint64_t seq;
+	int ret = 0;
+	if((image = malloc((uint64_t)count * FS3_SECTOR_SIZE + 1)) == NULL){
+		return(-1);
+	}
+	if(areaIo(FS3_OP_RDSECT, JOURNAL_SUPERS + (uint64_t)journalSuper.area * journalAreaSectors, 0, count, image) != 0 ||
+			fs3_crc32c(image, journalSuper.checkpointBytes) != journalSuper.checkpointCrc ||
+			applyRecords(image, journalSuper.checkpointBytes) != 0){
+		logMessage(LOG_ERROR_LEVEL, "Journal checkpoint is damaged.");
+		free(image);
+		return(-1);
+	}
+	free(image);
+	memset(&group, 0x0, sizeof(group));
+	journalNext = journalSuper.lsn;
+	for(seq = journalSuper.lsn; seq - journalSuper.lsn < journalRingSectors && ret == 0; seq++){
+		if(areaIo(FS3_OP_RDSECT, UINT64_MAX, seq, 1, sector) != 0){
+			break;
+		}
+		memcpy(&block, sector, sizeof(block));
+		crc = block.crc;
+		block.crc = 0;
+		memcpy(sector, &block, sizeof(block));
+		if(block.magic != JOURNAL_BLOCK_MAGIC || block.seq != seq || block.epoch != journalSuper.epoch ||
+				block.bytes > JOURNAL_PAYLOAD || fs3_crc32c(sector, sizeof(block) + block.bytes) != crc){
+			break;
+		}
+		if(appendBytes(&group, &sector[sizeof(block)], block.bytes) != 0){
+			ret = -1;
+		}else if(block.last){
+			if((ret = applyRecords(group.data, group.len)) == 0){
+				journalReplayed++;
+				journalNext = seq + 1;
+			}
+			group.len = 0;
+		}
+	}
+	freeBuffer(&group);
+	if(ret != 0 || finishRecovery() != 0){
+		logMessage(LOG_ERROR_LEVEL, "Journal replay failed at sector %lu.", seq);
+		return(-1);
+	}
+	logMessage(FS3DriverLLevel, "Journal replayed %lu groups, %d files.", journalReplayed, createdFilesSize);
+	return(0);
+}
+
+// Builds a checkpoint of the whole table, to be written from the next sequence number on
+static int startCheckpoint(void) {
+	uint32_t i;
+	int32_t f;
+	checkpointImage.len = 0;
+	checkpointRunning = 0;
+	for(f = 0; f < createdFilesSize; f++){
+		if(encodeFile(&checkpointImage, f, 0) != 0){
+			return(-1);
+		}
+	}
+	for(i = FS3_DIR_ROOT + 1; i < fs3_dir_count(); i++){
+		if(fs3_dir_path(i) != NULL && encodeDir(&checkpointImage, fs3_dir_path(i), 1) != 0){
+			return(-1);
+		}
+	}
+	if(checkpointImage.len > (uint64_t)journalAreaSectors * FS3_SECTOR_SIZE){
+		logMessage(LOG_ERROR_LEVEL, "File table no longer fits the journal checkpoint area, journal stopped.");
+		journalActive = 0;
+		return(-1);
+	}
+	// Everything gathered for the group is in the checkpoint
+	clearGroup();
+	checkpointLsn = journalNext;
+	checkpointArea = journalSuper.area ^ 1;
+	checkpointWritten = 0;
+	checkpointRunning = 1;
+	return(0);
+}
+
+// Writes up to "count" more sectors of the checkpoint, and the superblock once they are all out
+static int stepCheckpoint(uint32_t count) {
+	uint32_t total = (checkpointImage.len + FS3_SECTOR_SIZE - 1) / FS3_SECTOR_SIZE;
+	uint64_t offset = (uint64_t)checkpointWritten * FS3_SECTOR_SIZE;
+	FS3JournalSuper super;
+	char *buf, sector[FS3_SECTOR_SIZE];
+	count = CMPSC311_MINVAL(count, total - checkpointWritten);
+	if(count > 0){
+		if((buf = calloc(count, FS3_SECTOR_SIZE)) == NULL){
+			checkpointRunning = 0;
+			return(-1);
+		}
+		memcpy(buf, &checkpointImage.data[offset], CMPSC311_MINVAL((uint64_t)count * FS3_SECTOR_SIZE, checkpointImage.len - offset));
+		if(areaIo(FS3_OP_WRSECT, JOURNAL_SUPERS + (uint64_t)checkpointArea * journalAreaSectors + checkpointWritten, 0, count, buf) != 0){
+			logMessage(LOG_WARNING_LEVEL, "Journal checkpoint failed writing sector %u.", checkpointWritten);
+			checkpointRunning = 0;
+			free(buf);
+			return(-1);
+		}
+		free(buf);
+		checkpointWritten += count;
+	}
+	if(checkpointWritten < total){
+		return(0);
+	}
+	// The checkpoint is only used once the superblock points at it
+	memset(&super, 0x0, sizeof(super));
+	strncpy(super.magic, FS3_JOURNAL_MAGIC, sizeof(super.magic));
+	super.version = FS3_JOURNAL_VERSION;
+	super.area = checkpointArea;
+	super.generation = journalSuper.generation + 1;
+	super.epoch = journalEpoch;
+	super.lsn = checkpointLsn;
+	super.checkpointBytes = checkpointImage.len;
+	super.checkpointCrc = fs3_crc32c(checkpointImage.data, checkpointImage.len);
+	super.tracks = fs3Tracks;
+	super.trackSize = fs3TrackSize;
+	super.sectors = journalReserved;
+	super.crc = superCrc(&super);
+	memset(sector, 0x0, FS3_SECTOR_SIZE);
+	memcpy(sector, &super, sizeof(super));
+	checkpointRunning = 0;
+	if(areaIo(FS3_OP_WRSECT, super.generation % JOURNAL_SUPERS, 0, 1, sector) != 0){
+		logMessage(LOG_WARNING_LEVEL, "Journal checkpoint failed writing the superblock.");
+		return(-1);
+	}
+	journalSuper = super;
+	journalCheckpoints++;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_journal_configure
+// Description  : Set the size of the metadata area and the commit window,
+//                taken at the next mount
+//
+// Inputs       : sectors - sectors kept at the start of the disk, 0 for none
+//                windowMs - longest a change waits for its group (simulated time)
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_journal_configure(uint32_t sectors, uint32_t windowMs) {
+	if(sectors > 0 && sectors < FS3_JOURNAL_MIN_SECTORS){
+		logMessage(LOG_ERROR_LEVEL, "Journal needs at least %d sectors.", FS3_JOURNAL_MIN_SECTORS);
+		return(-1);
+	}
+	journalSectors = sectors;
+	journalWindowNs = (uint64_t)windowMs * 1000000;
+	return(0);
+}
+
+// Drops the group and the checkpoint being written
+static void freeState(void) {
+	free(journalDirty);
+	free(journalDirtyList);
+	freeBuffer(&journalDirs);
+	freeBuffer(&checkpointImage);
+	journalDirty = NULL;
+	journalDirtyList = NULL;
+	journalDirtyCapacity = journalDirtyListCapacity = journalDirtyCount = 0;
+	journalActive = journalStale = checkpointRunning = 0;
+	journalChanges = 0;
+}
+
+uint64_t fs3_journal_init(uint64_t diskSectors) {
+	freeState();
+	journalGroups = journalRecords = journalBlocks = journalCheckpoints = journalReplayed = 0;
+	journalReserved = 0;
+	if(journalSectors == 0){
+		return(0);
+	}
+	if(journalSectors * 2 > diskSectors){
+		logMessage(LOG_WARNING_LEVEL, "Disk too small for a journal of %u sectors, journal off.", journalSectors);
+		return(0);
+	}
+	// A quarter of the area is the ring, the rest the two checkpoint areas
+	journalReserved = journalSectors;
+	journalRingSectors = CMPSC311_MAXVAL(JOURNAL_MIN_RING, journalReserved / 4);
+	journalAreaSectors = (journalReserved - JOURNAL_SUPERS - journalRingSectors) / 2;
+	journalRingStart = JOURNAL_SUPERS + 2 * (uint64_t)journalAreaSectors;
+	return(journalReserved);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_journal_mount
+// Description  : Finds the current superblock and, when asked to, replays the
+//                file table from it. The journal then starts a new epoch
+//                with a checkpoint of the table, an empty one on a disk
+//                without a journal.
+//
+// Inputs       : recover - 1 to read the file table back from the disk
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_journal_mount(int8_t recover) {
+	FS3JournalSuper supers[JOURNAL_SUPERS];
+	char sector[FS3_SECTOR_SIZE];
+	int best = -1, i;
+	if(journalReserved == 0){
+		return(0);
+	}
+	for(i = 0; i < JOURNAL_SUPERS; i++){
+		memset(&supers[i], 0x0, sizeof(FS3JournalSuper));
+		if(areaIo(FS3_OP_RDSECT, i, 0, 1, sector) == 0){
+			memcpy(&supers[i], sector, sizeof(FS3JournalSuper));
+		}
+		if(superValid(&supers[i]) && (best == -1 || supers[i].generation > supers[best].generation)){
+			best = i;
+		}
+	}
+	memset(&journalSuper, 0x0, sizeof(journalSuper));
+	journalNext = 0;
+	if(best != -1){
+		journalSuper = supers[best];
+		if(recover && recoverTable() != 0){
+			return(-1);
+		}
+		journalEpoch = journalSuper.epoch + 1;
+	}else{
+		// A disk without a journal gets an epoch no sector left on it can have
+		journalEpoch = ((uint64_t)time(NULL) << 16) | (fs3_latency_clock() & 0xFFFF);
+	}
+	journalActive = 1;
+	if(fs3_journal_checkpoint() != 0){
+		journalActive = 0;
+		return(-1);
+	}
+	logMessage(FS3DriverLLevel, "Journal of %u sectors mounted, %u in the ring.", journalReserved, journalRingSectors);
+	return(0);
+}
+
+int fs3_journal_unmount(void) {
+	int ret = 0;
+	if(journalActive){
+		ret = fs3_journal_checkpoint();
+	}
+	freeState();
+	return(ret);
+}
+
+void fs3_journal_drop(void) {
+	freeState();
+}
+
+void fs3_journal_touch(uint32_t slot, uint32_t from) {
+	uint32_t capacity;
+	JournalDirty *dirty;
+	uint32_t *list;
+	if(!journalActive){
+		return;
+	}
+	if(slot >= journalDirtyCapacity){
+		capacity = CMPSC311_MAXVAL(slot + 1, journalDirtyCapacity * 2);
+		if((dirty = realloc(journalDirty, sizeof(JournalDirty) * capacity)) == NULL){
+			journalStale = 1;
+			return;
+		}
+		memset(&dirty[journalDirtyCapacity], 0x0, sizeof(JournalDirty) * (capacity - journalDirtyCapacity));
+		journalDirty = dirty;
+		journalDirtyCapacity = capacity;
+	}
+	if(journalDirty[slot].dirty){
+		journalDirty[slot].from = CMPSC311_MINVAL(journalDirty[slot].from, from);
+	}else{
+		if(journalDirtyCount == journalDirtyListCapacity){
+			capacity = (journalDirtyListCapacity > 0) ? journalDirtyListCapacity * 2 : FS3_JOURNAL_GROUP_CHANGES;
+			if((list = realloc(journalDirtyList, sizeof(uint32_t) * capacity)) == NULL){
+				journalStale = 1;
+				return;
+			}
+			journalDirtyList = list;
+			journalDirtyListCapacity = capacity;
+		}
+		journalDirtyList[journalDirtyCount++] = slot;
+		journalDirty[slot].dirty = 1;
+		journalDirty[slot].from = from;
+	}
+	noteChange();
+}
+
+void fs3_journal_dir(const char *path, int8_t made) {
+	if(!journalActive){
+		return;
+	}
+	if(encodeDir(&journalDirs, path, made) != 0){
+		journalStale = 1;
+		return;
+	}
+	noteChange();
+}
+
+void fs3_journal_tick(void) {
+	if(!journalActive){
+		return;
+	}
+	if(journalStale || journalChanges >= FS3_JOURNAL_GROUP_CHANGES ||
+			(journalChanges > 0 && fs3_latency_clock() - journalFirstChange >= journalWindowNs)){
+		fs3_journal_commit();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_journal_commit
+// Description  : Writes the records of the files changed since the last
+//                group to the ring, as one group. A group that does not fit
+//                in the ring is written as a checkpoint instead. Past half
+//                the ring a checkpoint is started in the background, and
+//                every group carries a few sectors of it along, so the head
+//                only goes to the metadata area when a group is due.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_journal_commit(void) {
+	JournalBuffer group;
+	JournalBlock block;
+	uint32_t i, blocks;
+	uint64_t off;
+	char *sectors;
+	if(!journalActive || (journalChanges == 0 && !journalStale)){
+		return(0);
+	}
+	if(journalStale){
+		return(fs3_journal_checkpoint());
+	}
+	memset(&group, 0x0, sizeof(group));
+	if(appendBytes(&group, journalDirs.data, journalDirs.len) != 0){
+		freeBuffer(&group);
+		return(fs3_journal_checkpoint());
+	}
+	for(i = 0; i < journalDirtyCount; i++){
+		if((int32_t)journalDirtyList[i] < createdFilesSize &&
+				encodeFile(&group, journalDirtyList[i], journalDirty[journalDirtyList[i]].from) != 0){
+			freeBuffer(&group);
+			return(fs3_journal_checkpoint());
+		}
+	}
+	blocks = (group.len + JOURNAL_PAYLOAD - 1) / JOURNAL_PAYLOAD;
+	if(journalNext + blocks - journalSuper.lsn > journalRingSectors || (sectors = calloc(blocks, FS3_SECTOR_SIZE)) == NULL){
+		freeBuffer(&group);
+		return(fs3_journal_checkpoint());
+	}
+	for(i = 0, off = 0; i < blocks; i++, off += JOURNAL_PAYLOAD){
+		memset(&block, 0x0, sizeof(block));
+		block.magic = JOURNAL_BLOCK_MAGIC;
+		block.bytes = CMPSC311_MINVAL(JOURNAL_PAYLOAD, group.len - off);
+		block.last = (i + 1 == blocks);
+		block.seq = journalNext + i;
+		block.epoch = journalEpoch;
+		memcpy(&sectors[(uint64_t)i * FS3_SECTOR_SIZE], &block, sizeof(block));
+		memcpy(&sectors[(uint64_t)i * FS3_SECTOR_SIZE + sizeof(block)], &group.data[off], block.bytes);
+		block.crc = fs3_crc32c(&sectors[(uint64_t)i * FS3_SECTOR_SIZE], sizeof(block) + block.bytes);
+		memcpy(&sectors[(uint64_t)i * FS3_SECTOR_SIZE], &block, sizeof(block));
+	}
+	journalRecords += journalDirtyCount;
+	clearGroup();
+	freeBuffer(&group);
+	// A group the disk did not take whole leaves a hole later groups cannot be replayed over
+	if(areaIo(FS3_OP_WRSECT, UINT64_MAX, journalNext, blocks, sectors) != 0){
+		logMessage(LOG_ERROR_LEVEL, "Journal failed writing a group, the next commit is a checkpoint.");
+		journalStale = 1;
+		free(sectors);
+		return(-1);
+	}
+	free(sectors);
+	journalNext += blocks;
+	journalGroups++;
+	journalBlocks += blocks;
+	if(!checkpointRunning && journalNext - journalSuper.lsn >= journalRingSectors / 2){
+		startCheckpoint();
+	}
+	if(checkpointRunning){
+		stepCheckpoint(FS3_JOURNAL_CHECKPOINT_STEP);
+	}
+	return(0);
+}
+
+int fs3_journal_checkpoint(void) {
+	if(!journalActive){
+		return(0);
+	}
+	if(startCheckpoint() != 0 || stepCheckpoint(UINT32_MAX) != 0){
+		journalStale = journalActive;
+		return(-1);
+	}
+	journalStale = 0;
+	return(0);
+}
+
+int fs3_journal_enabled(void) {
+	return(journalReserved > 0);
+}
+
+int fs3_journal_log_metrics(void) {
+	logMessage(LOG_OUTPUT_LEVEL, "** FS3 Metadata Journal (%u sectors, %u in the ring) **", journalReserved, journalRingSectors);
+	logMessage(LOG_OUTPUT_LEVEL, "Groups committed         [%9lu]", journalGroups);
+	logMessage(LOG_OUTPUT_LEVEL, "File records journaled   [%9lu]", journalRecords);
+	logMessage(LOG_OUTPUT_LEVEL, "Journal sectors written  [%9lu]", journalBlocks);
+	logMessage(LOG_OUTPUT_LEVEL, "Checkpoints              [%9lu]", journalCheckpoints);
+	logMessage(LOG_OUTPUT_LEVEL, "Groups replayed at mount [%9lu]", journalReplayed);
+	return(0);
+}
@@ -0,0 +1,85 @@
+#ifndef FS3_JOURNAL_INCLUDED
+#define FS3_JOURNAL_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_journal.h
+//  Description    : This is the interface for the FS3 metadata journal. The
+//                   first sectors of the disk are kept for the file table: two
+//                   copies of a superblock, two checkpoint areas and a ring of
+//                   journal sectors. Changes to the file table are gathered
+//                   per file and written to the ring as one group commit, and
+//                   a checkpoint of the whole table is written in the
+//                   background once the ring fills up. A mount replays the
+//                   last checkpoint and the groups committed after it.
+//
+
+// Include
+#include <stdint.h>
+
+// Defines
+#define FS3_JOURNAL_MAGIC "FS3JRNL"
+#define FS3_JOURNAL_VERSION 1
+#define FS3_JOURNAL_MIN_SECTORS 16 // Smallest metadata area
+#define FS3_JOURNAL_GROUP_CHANGES 128 // Changes that make a group worth committing
+#define FS3_JOURNAL_DEFAULT_WINDOW_MS 50 // Longest a change waits for its group (simulated device time)
+#define FS3_JOURNAL_CHECKPOINT_STEP 4 // Checkpoint sectors written along with each group in the background
+#define FS3_JOURNAL_NO_ENTRIES UINT32_MAX // Only the fields of the file changed, not its sector list
+
+// The superblock, the copy with the higher generation is the current one
+typedef struct FS3JournalSupr {
+	char magic[8];
+	uint32_t version;
+	uint32_t area;            // Checkpoint area holding the checkpoint, 0 or 1
+	uint64_t generation;      // Bumped by every checkpoint
+	uint64_t epoch;           // Mount the journal sectors after the checkpoint were written by
+	uint64_t lsn;             // First journal sector to replay
+	uint64_t checkpointBytes;
+	uint32_t checkpointCrc;
+	uint32_t tracks;
+	uint32_t trackSize;
+	uint32_t sectors;         // Size of the metadata area
+	uint32_t crc;             // Of everything above
+} FS3JournalSuper;
+
+//
+// Journal Functions
+
+int fs3_journal_configure(uint32_t sectors, uint32_t windowMs);
+	// Keep the first "sectors" of the disk for the metadata journal from the next
+	// mount (0, the default, turns it off), a change is committed within windowMs
+
+uint64_t fs3_journal_init(uint64_t diskSectors);
+	// Reset the journal for a disk of diskSectors, returns the sectors it keeps
+
+int fs3_journal_mount(int8_t recover);
+	// Read the file table back from the disk (or start an empty one if there is
+	// none or recover is 0) and start journaling
+
+int fs3_journal_unmount(void);
+	// Commit what is left and write a checkpoint, so the next mount replays nothing
+void fs3_journal_drop(void);
+	// Stop journaling without committing or a checkpoint, leaving the disk as a crash would
+
+void fs3_journal_touch(uint32_t slot, uint32_t from);
+	// The file record of a slot changed, and its sector list from entry "from" on
+
+void fs3_journal_dir(const char *path, int8_t made);
+	// A directory was made (or removed)
+
+void fs3_journal_tick(void);
+	// End of a request, commits the group when it is due
+
+int fs3_journal_commit(void);
+	// Commit the changes gathered so far
+
+int fs3_journal_checkpoint(void);
+	// Write a checkpoint of the whole file table now
+
+int fs3_journal_enabled(void);
+	// 1 when the disk mounted last keeps a metadata journal
+
+int fs3_journal_log_metrics(void);
+	// Log the groups, journal sectors and checkpoints written
+
+#endif
@@ -0,0 +1,173 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_latency.c
+//  Description    : This is the implementation of the controller cost model
+//                   and simulated device clock for the FS3 filesystem.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_latency.h>
+
+//
+// Support Macros/Data
+static uint64_t linearCost(FS3LatencyModel *model, uint8_t op, uint32_t fromTrack, uint32_t toTrack);
+
+const char *FS3_LATENCY_LABELS[FS3_OP_MAXVAL] = { "mount", "tseek", "rdsect", "wrsect", "umount" };
+
+FS3LatencyModel linearModel = {
+	"linear",
+	linearCost,
+	{ FS3_LATENCY_MOUNT_NS, FS3_LATENCY_TSEEK_NS, FS3_LATENCY_RDSECT_NS,
+	  FS3_LATENCY_WRSECT_NS, FS3_LATENCY_UMOUNT_NS },
+	FS3_LATENCY_TRACK_NS
+};
+FS3LatencyModel *latencyModel = &linearModel;
+uint64_t simulatedClock;
+uint64_t simulatedOpTime[FS3_OP_MAXVAL];
+uint32_t modelHead[FS3_LATENCY_MAX_DEVICES]; // Track the model believes each head is on
+uint64_t batchBusy[FS3_LATENCY_MAX_DEVICES]; // Time each device has spent on the open batch
+int8_t batchOpen = 0;
+uint64_t overlappedTime; // Device time hidden by running devices side by side
+
+//
+// Implementation
+
+// Fixed cost per opcode, seeks also pay for every track crossed
+static uint64_t linearCost(FS3LatencyModel *model, uint8_t op, uint32_t fromTrack, uint32_t toTrack) {
+	uint64_t cost = model->opCost[op];
+	if(op == FS3_OP_TSEEK){
+		cost += model->trackCost * ((fromTrack > toTrack) ? (fromTrack - toTrack) : (toTrack - fromTrack));
+	}
+	return(cost);
+}
+
+void fs3_latency_init(void) {
+	simulatedClock = 0;
+	memset(simulatedOpTime, 0x0, sizeof(simulatedOpTime));
+	memset(modelHead, 0x0, sizeof(modelHead));
+	memset(batchBusy, 0x0, sizeof(batchBusy));
+	batchOpen = 0;
+	overlappedTime = 0;
+}
+
+int fs3_latency_set_model(FS3LatencyModel *model) {
+	if(model == NULL || model->cost == NULL){
+		return(-1);
+	}
+	latencyModel = model;
+	return(0);
+}
+
+FS3LatencyModel *fs3_latency_default_model(void) {
+	return(&linearModel);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_latency_configure
+// Description  : Set the costs of the default model from a specification
+//                like "tseek=400000,track=15000,rdsect=80000"
+//
+// Inputs       : spec - comma separated list of op=nanoseconds
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_latency_configure(const char *spec) {
+	char *copy, *item, *save = NULL, *eq;
+	unsigned long long ns;
+	int op, ret = 0;
+	if(spec == NULL || (copy = strdup(spec)) == NULL){
+		return(-1);
+	}
+	for(item = strtok_r(copy, ",", &save); item != NULL && ret == 0; item = strtok_r(NULL, ",", &save)){
+		if((eq = strchr(item, '=')) == NULL || sscanf(eq + 1, "%llu", &ns) != 1){
+			logMessage(LOG_ERROR_LEVEL, "Bad latency setting [%s]", item);
+			ret = -1;
+			break;
+		}
+		*eq = 0x0;
+		if(strcmp(item, "track") == 0){
+			linearModel.trackCost = ns;
+			continue;
+		}
+		for(op = 0; op < FS3_OP_MAXVAL && strcmp(item, FS3_LATENCY_LABELS[op]) != 0; op++);
+		if(op == FS3_OP_MAXVAL){
+			logMessage(LOG_ERROR_LEVEL, "Unknown latency opcode [%s]", item);
+			ret = -1;
+		}else{
+			linearModel.opCost[op] = ns;
+		}
+	}
+	free(copy);
+	return(ret);
+}
+
+void fs3_latency_charge(uint8_t op, uint32_t track) {
+	fs3_latency_charge_device(0, op, track);
+}
+
+void fs3_latency_charge_device(uint32_t device, uint8_t op, uint32_t track) {
+	uint64_t cost;
+	if(op >= FS3_OP_MAXVAL || device >= FS3_LATENCY_MAX_DEVICES){
+		return;
+	}
+	cost = latencyModel->cost(latencyModel, op, modelHead[device], track);
+	simulatedOpTime[op] += cost;
+	if(batchOpen){
+		batchBusy[device] += cost;
+	}else{
+		simulatedClock += cost;
+	}
+	if(op == FS3_OP_TSEEK){
+		modelHead[device] = track;
+	}else if(op == FS3_OP_MOUNT){
+		modelHead[device] = 0;
+	}
+}
+
+void fs3_latency_batch_begin(void) {
+	batchOpen = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_latency_batch_end
+// Description  : Close a batch, the devices ran side by side so the clock
+//                only moves by the time of the busiest one
+//
+// Inputs       : none
+// Outputs      : none
+
+void fs3_latency_batch_end(void) {
+	uint64_t busiest = 0, total = 0;
+	int i;
+	for(i = 0; i < FS3_LATENCY_MAX_DEVICES; i++){
+		busiest = (batchBusy[i] > busiest) ? batchBusy[i] : busiest;
+		total += batchBusy[i];
+		batchBusy[i] = 0;
+	}
+	simulatedClock += busiest;
+	overlappedTime += total - busiest;
+	batchOpen = 0;
+}
+
+uint64_t fs3_latency_clock(void) {
+	return(simulatedClock);
+}
+
+int fs3_latency_log_metrics(void) {
+	int op;
+	logMessage(LOG_OUTPUT_LEVEL, "** FS3 Simulated Device Time (%s model) **", latencyModel->name);
+	for(op = 0; op < FS3_OP_MAXVAL; op++){
+		logMessage(LOG_OUTPUT_LEVEL, "%-8s time [%12.3f ms]", FS3_LATENCY_LABELS[op], simulatedOpTime[op] / 1e6);
+	}
+	if(overlappedTime > 0){
+		logMessage(LOG_OUTPUT_LEVEL, "Overlap  time [%12.3f ms]", overlappedTime / 1e6);
+	}
+	logMessage(LOG_OUTPUT_LEVEL, "Total    time [%12.3f ms]", simulatedClock / 1e6);
+	return(0);
+}
@@ -0,0 +1,68 @@
+#ifndef FS3_LATENCY_INCLUDED
+#define FS3_LATENCY_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_latency.h
+//  Description    : This is the interface for the controller cost model. Every
+//                   command the driver sends over the bus is charged to a
+//                   simulated device clock, so changes can be compared by
+//                   modeled disk time rather than by operation counts.
+//
+
+// Include
+#include <stdint.h>
+#include <fs3_controller.h>
+
+// Default costs of the linear model (nanoseconds)
+#define FS3_LATENCY_MOUNT_NS     1000000 // Spin up and mount
+#define FS3_LATENCY_TSEEK_NS      500000 // Settle time of any seek
+#define FS3_LATENCY_TRACK_NS       20000 // Additional seek time per track crossed
+#define FS3_LATENCY_RDSECT_NS     100000 // Transfer a sector from the disk
+#define FS3_LATENCY_WRSECT_NS     120000 // Transfer a sector to the disk
+#define FS3_LATENCY_UMOUNT_NS    1000000 // Flush and unmount
+#define FS3_LATENCY_MAX_DEVICES 16 // Devices with a head of their own in the model
+
+// A cost model, cost returns the time (ns) taken by one command
+typedef struct FS3LatencyModl {
+	const char *name;
+	uint64_t (*cost)(struct FS3LatencyModl *model, uint8_t op, uint32_t fromTrack, uint32_t toTrack);
+	uint64_t opCost[FS3_OP_MAXVAL]; // Fixed cost of each opcode
+	uint64_t trackCost;             // Cost per track of seek distance
+} FS3LatencyModel;
+
+//
+// Latency Functions
+
+void fs3_latency_init(void);
+	// Reset the simulated clock (the model is kept)
+
+int fs3_latency_set_model(FS3LatencyModel *model);
+	// Replace the cost model used to charge commands
+
+FS3LatencyModel *fs3_latency_default_model(void);
+	// The built-in linear model (fixed cost per opcode plus cost per track sought)
+
+int fs3_latency_configure(const char *spec);
+	// Set costs of the default model, spec is "op=ns,..." with op one of
+	// mount, tseek, rdsect, wrsect, umount or track
+
+void fs3_latency_charge(uint8_t op, uint32_t track);
+	// Charge a command to the simulated clock
+
+void fs3_latency_charge_device(uint32_t device, uint8_t op, uint32_t track);
+	// Charge a command sent to one device of an array
+
+void fs3_latency_batch_begin(void);
+	// Commands charged until the batch ends run on their devices side by side
+
+void fs3_latency_batch_end(void);
+	// Move the clock by the busiest device of the batch
+
+uint64_t fs3_latency_clock(void);
+	// Total simulated device time (ns)
+
+int fs3_latency_log_metrics(void);
+	// Log the simulated device time per opcode
+
+#endif
@@ -0,0 +1,419 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_local_controller.c
+//  Description    : This is the implementation of the local, in-process
+//                   stand-in for the FS3 controller. The disk lives in an
+//                   mmap'ed image file, commands can be slowed down to model
+//                   a real device, and faults can be injected on the ret bit
+//                   or as torn writes. Several units (devices) can be served
+//                   for the driver's device array, each with its own image,
+//                   head and fault dice. A unit is only ever driven by one
+//                   thread at a time.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_local_controller.h>
+
+//
+// Support Macros/Data
+
+// Command block layout (same as the driver's construct_fs3_cmdblk)
+#define LOCAL_OPCODE_POS 60
+#define LOCAL_SEC_NUM_POS 44
+#define LOCAL_TRACK_NUM_POS 12
+#define LOCAL_RETURN_POS 11
+
+// Global Data (the log levels normally live in the controller library)
+unsigned long FS3ControllerLLevel;
+unsigned long FS3DriverLLevel;
+unsigned long FS3SimulatorLLevel;
+
+// Configuration
+char localImage[256] = FS3_LOCAL_DEFAULT_IMAGE;
+int8_t localReuse = 0;
+uint64_t localSeekNs = 0;
+uint64_t localTrackNs = 0;
+uint64_t localReadNs = 0;
+uint64_t localWriteNs = 0;
+double localFailRate = 0.0;
+uint64_t localFailAt = 0;
+double localTornRate = 0.0;
+double localFlipRate = 0.0;
+int32_t localFailUnit = -1; // The only unit faults are injected on, -1 for every unit
+unsigned int localSeed = 311;
+uint32_t localTracks = FS3_MAX_TRACKS;
+uint32_t localTrackSize = FS3_TRACK_SIZE;
+
+// Device state, one per unit
+typedef struct {
+	char *disk;
+	int fd;
+	uint32_t track;
+	uint64_t commands;
+	uint64_t imageSize; // Bytes mapped, the geometry at mount
+	uint32_t tracks;
+	uint32_t trackSize;
+	unsigned int seed;
+	// Metrics
+	uint32_t mountOps;
+	uint32_t tseekOps;
+	uint32_t rsectOps;
+	uint32_t wsectOps;
+	uint32_t unmntOps;
+	uint32_t faults;
+	uint32_t tornWrites;
+	uint32_t flippedReads;
+} LocalUnit;
+
+LocalUnit localUnits[FS3_LOCAL_MAX_UNITS] = { { .fd = -1 } };
+uint32_t localUnitCount = 1;
+uint32_t localArrayTracks = 0; // Geometry of every unit set by the device array, 0 if none
+uint32_t localArrayTrackSize = 0;
+
+//
+// Implementation
+
+// Busy wait, sleeping is far too coarse for sector-sized delays
+static void localDelay(uint64_t ns) {
+	struct timespec start, now;
+	if(ns == 0){
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}while((uint64_t)(now.tv_sec - start.tv_sec) * 1000000000 + (now.tv_nsec - start.tv_nsec) < ns);
+}
+
+// Whether faults are injected on a unit
+static int localFaulty(LocalUnit *unit) {
+	return(localFailUnit < 0 || unit == &localUnits[localFailUnit]);
+}
+
+// Roll the dice for an injected fault
+static int localChance(LocalUnit *unit, double rate) {
+	return(rate > 0.0 && localFaulty(unit) && ((double)rand_r(&unit->seed) / RAND_MAX) < rate);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_local_configure
+// Description  : Configure the controller from a comma separated list of
+//                key=value settings (see fs3_local_controller.h)
+//
+// Inputs       : spec - the settings
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_local_configure(const char *spec) {
+	char *copy, *item, *save = NULL, *val;
+	int ret = 0;
+	if(spec == NULL || (copy = strdup(spec)) == NULL){
+		return(-1);
+	}
+	for(item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)){
+		if((val = strchr(item, '=')) == NULL){
+			ret = -1;
+			break;
+		}
+		*val++ = 0x0;
+		if(strcmp(item, "image") == 0){
+			snprintf(localImage, sizeof(localImage), "%s", val);
+		}else if(strcmp(item, "reuse") == 0){
+			localReuse = (int8_t)atoi(val);
+		}else if(strcmp(item, "seek") == 0){
+			localSeekNs = strtoull(val, NULL, 10);
+		}else if(strcmp(item, "track") == 0){
+			localTrackNs = strtoull(val, NULL, 10);
+		}else if(strcmp(item, "read") == 0){
+			localReadNs = strtoull(val, NULL, 10);
+		}else if(strcmp(item, "write") == 0){
+			localWriteNs = strtoull(val, NULL, 10);
+		}else if(strcmp(item, "fail") == 0){
+			localFailRate = atof(val);
+		}else if(strcmp(item, "failat") == 0){
+			localFailAt = strtoull(val, NULL, 10);
+		}else if(strcmp(item, "torn") == 0){
+			localTornRate = atof(val);
+		}else if(strcmp(item, "flip") == 0){
+			localFlipRate = atof(val);
+		}else if(strcmp(item, "failunit") == 0){
+			localFailUnit = (atoi(val) < FS3_LOCAL_MAX_UNITS) ? atoi(val) : -1;
+		}else if(strcmp(item, "tracks") == 0){
+			localTracks = (uint32_t)strtoul(val, NULL, 10);
+		}else if(strcmp(item, "sectors") == 0){
+			localTrackSize = (uint32_t)strtoul(val, NULL, 10);
+		}else if(strcmp(item, "seed") == 0){
+			localSeed = (unsigned int)strtoul(val, NULL, 10);
+		}else{
+			ret = -1;
+			break;
+		}
+	}
+	if(ret == -1){
+		logMessage(LOG_ERROR_LEVEL, "FS3 local controller: bad setting [%s]", item);
+	}
+	free(copy);
+	return(ret);
+}
+
+int fs3_local_set_units(uint32_t units, uint32_t tracks, uint32_t trackSize) {
+	if(units == 0 || units > FS3_LOCAL_MAX_UNITS){
+		logMessage(LOG_ERROR_LEVEL, "FS3 local controller: cannot serve %u units.", units);
+		return(-1);
+	}
+	localUnitCount = units;
+	localArrayTracks = (units > 1) ? tracks : 0;
+	localArrayTrackSize = (units > 1) ? trackSize : 0;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : localMount
+// Description  : Map the disk image of a unit, creating (or wiping) it unless
+//                reuse is set. Unit 0 uses the configured image, unit n the
+//                image with ".n" appended.
+//
+// Inputs       : u - the unit
+// Outputs      : 0 if successful, -1 if failure
+
+static int localMount(uint32_t u) {
+	LocalUnit *unit = &localUnits[u];
+	char *env = getenv(FS3_LOCAL_ENV), image[sizeof(localImage) + 16];
+	int flags = O_RDWR | O_CREAT;
+	if(unit->disk != NULL){
+		logMessage(LOG_ERROR_LEVEL, "FS3 local controller: disk already mounted.");
+		return(-1);
+	}
+	if(env != NULL && fs3_local_configure(env) == -1){
+		return(-1);
+	}
+	unit->tracks = (localArrayTracks > 0) ? localArrayTracks : localTracks;
+	unit->trackSize = (localArrayTrackSize > 0) ? localArrayTrackSize : localTrackSize;
+	if(unit->tracks == 0 || unit->trackSize == 0){
+		logMessage(LOG_ERROR_LEVEL, "FS3 local controller: bad geometry %ux%u.", unit->tracks, unit->trackSize);
+		return(-1);
+	}
+	if(!localReuse){
+		flags |= O_TRUNC;
+	}
+	if(u == 0){
+		snprintf(image, sizeof(image), "%s", localImage);
+	}else{
+		snprintf(image, sizeof(image), "%s.%u", localImage, u);
+	}
+	if((unit->fd = open(image, flags, S_IRUSR | S_IWUSR)) == -1){
+		logMessage(LOG_ERROR_LEVEL, "FS3 local controller: failed opening image [%s]", image);
+		return(-1);
+	}
+	// The image is sparse, only the sectors written take space
+	unit->imageSize = (uint64_t)unit->tracks * unit->trackSize * FS3_SECTOR_SIZE;
+	if(ftruncate(unit->fd, unit->imageSize) == -1){
+		close(unit->fd);
+		unit->fd = -1;
+		return(-1);
+	}
+	unit->disk = mmap(NULL, unit->imageSize, PROT_READ | PROT_WRITE, MAP_SHARED, unit->fd, 0);
+	if(unit->disk == MAP_FAILED){
+		unit->disk = NULL;
+		close(unit->fd);
+		unit->fd = -1;
+		return(-1);
+	}
+	unit->track = 0;
+	unit->commands = 0;
+	unit->seed = localSeed + u;
+	logMessage(FS3ControllerLLevel, "FS3 local controller: mounted [%s]", image);
+	return(0);
+}
+
+static int localUnmount(uint32_t u) {
+	LocalUnit *unit = &localUnits[u];
+	if(unit->disk == NULL){
+		return(-1);
+	}
+	msync(unit->disk, unit->imageSize, MS_SYNC);
+	munmap(unit->disk, unit->imageSize);
+	close(unit->fd);
+	unit->disk = NULL;
+	unit->fd = -1;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_local_syscall
+// Description  : This is the bus interface of one unit
+//
+// Inputs       : u - the unit
+//                cmdblock - the command block to execute
+//                buf - the sector buffer for reads and writes
+// Outputs      : the command block with the ret bit set to 1 on failure
+
+FS3CmdBlk fs3_local_syscall(uint32_t u, FS3CmdBlk cmdblock, void *buf) {
+	LocalUnit *unit = &localUnits[(u < FS3_LOCAL_MAX_UNITS) ? u : 0];
+	uint8_t op = (uint8_t)((cmdblock >> LOCAL_OPCODE_POS) & 0xf);
+	uint16_t sec = (uint16_t)((cmdblock >> LOCAL_SEC_NUM_POS) & UINT16_MAX);
+	uint32_t trk = (uint32_t)((cmdblock >> LOCAL_TRACK_NUM_POS) & UINT32_MAX);
+	uint64_t torn, bit;
+	char *sector;
+	int ret = 0;
+
+	// Disk commands need a mounted disk and a valid target, and may be failed on purpose
+	if(u >= localUnitCount){
+		ret = -1;
+	}else if(op == FS3_OP_TSEEK || op == FS3_OP_RDSECT || op == FS3_OP_WRSECT){
+		unit->commands++;
+		if(unit->disk == NULL || (op == FS3_OP_TSEEK && trk >= unit->tracks) ||
+				(op != FS3_OP_TSEEK && (sec >= unit->trackSize || buf == NULL))){
+			ret = -1;
+		}else if((unit->commands == localFailAt && localFaulty(unit)) || localChance(unit, localFailRate)){
+			logMessage(FS3ControllerLLevel, "FS3 local controller: injected fault on unit %u command %lu", u, unit->commands);
+			unit->faults++;
+			ret = -1;
+		}
+	}
+
+	if(ret == 0){
+		switch(op){
+		case FS3_OP_MOUNT:
+			unit->mountOps++;
+			ret = localMount(u);
+			break;
+
+		case FS3_OP_TSEEK:
+			unit->tseekOps++;
+			localDelay(localSeekNs + localTrackNs * ((trk > unit->track) ? trk - unit->track : unit->track - trk));
+			unit->track = trk;
+			break;
+
+		case FS3_OP_RDSECT:
+			unit->rsectOps++;
+			localDelay(localReadNs);
+			sector = &unit->disk[((uint64_t)unit->track * unit->trackSize + sec) * FS3_SECTOR_SIZE];
+			memcpy(buf, sector, FS3_SECTOR_SIZE);
+			if(localChance(unit, localFlipRate)){
+				// Silent corruption on the way back, the ret bit stays clear
+				bit = (uint64_t)rand_r(&unit->seed) % (FS3_SECTOR_SIZE * 8);
+				((char *)buf)[bit / 8] ^= (char)(1 << (bit % 8));
+				logMessage(FS3ControllerLLevel, "FS3 local controller: flipped bit %lu of a read", bit);
+				unit->flippedReads++;
+			}
+			break;
+
+		case FS3_OP_WRSECT:
+			unit->wsectOps++;
+			localDelay(localWriteNs);
+			sector = &unit->disk[((uint64_t)unit->track * unit->trackSize + sec) * FS3_SECTOR_SIZE];
+			if(localChance(unit, localTornRate)){
+				// Only part of the sector reaches the platter
+				torn = (uint64_t)rand_r(&unit->seed) % FS3_SECTOR_SIZE;
+				memcpy(sector, buf, torn);
+				logMessage(FS3ControllerLLevel, "FS3 local controller: torn write, %lu bytes stored", torn);
+				unit->tornWrites++;
+				ret = -1;
+			}else{
+				memcpy(sector, buf, FS3_SECTOR_SIZE);
+			}
+			break;
+
+		case FS3_OP_UMOUNT:
+			unit->unmntOps++;
+			ret = localUnmount(u);
+			break;
+
+		default:
+			ret = -1;
+			break;
+		}
+	}
+
+	// Echo the command back with the return bit set as needed
+	cmdblock &= ~((FS3CmdBlk)1 << LOCAL_RETURN_POS);
+	if(ret != 0){
+		cmdblock |= ((FS3CmdBlk)1 << LOCAL_RETURN_POS);
+	}
+	return(cmdblock);
+}
+
+FS3CmdBlk fs3_syscall(FS3CmdBlk cmdblock, void *buf) {
+	return(fs3_local_syscall(0, cmdblock, buf));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_unit_test
+// Description  : This function runs the unit tests for the fs3 controller,
+//                writing random sectors and reading them back
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_unit_test(void) {
+	char wbuf[FS3_SECTOR_SIZE], rbuf[FS3_SECTOR_SIZE];
+	FS3CmdBlk cmd;
+	uint32_t trk, sec;
+	int i, j, ret = 0;
+
+	if(fs3_syscall((FS3CmdBlk)FS3_OP_MOUNT << LOCAL_OPCODE_POS, NULL) & ((FS3CmdBlk)1 << LOCAL_RETURN_POS)){
+		logMessage(LOG_ERROR_LEVEL, "FS3 local controller unit test: mount failed.");
+		return(-1);
+	}
+	for(i = 0; i < 256 && ret == 0; i++){
+		trk = (uint32_t)rand_r(&localSeed) % localUnits[0].tracks;
+		sec = (uint32_t)rand_r(&localSeed) % localUnits[0].trackSize;
+		for(j = 0; j < FS3_SECTOR_SIZE; j++){
+			wbuf[j] = (char)rand_r(&localSeed);
+		}
+		cmd = ((FS3CmdBlk)FS3_OP_TSEEK << LOCAL_OPCODE_POS) | ((FS3CmdBlk)trk << LOCAL_TRACK_NUM_POS);
+		fs3_syscall(cmd, NULL);
+		cmd = ((FS3CmdBlk)FS3_OP_WRSECT << LOCAL_OPCODE_POS) | ((FS3CmdBlk)sec << LOCAL_SEC_NUM_POS);
+		fs3_syscall(cmd, wbuf);
+		cmd = ((FS3CmdBlk)FS3_OP_RDSECT << LOCAL_OPCODE_POS) | ((FS3CmdBlk)sec << LOCAL_SEC_NUM_POS);
+		fs3_syscall(cmd, rbuf);
+		if(memcmp(wbuf, rbuf, FS3_SECTOR_SIZE) != 0){
+			logMessage(LOG_ERROR_LEVEL, "FS3 local controller unit test: track %u sector %u mismatch.", trk, sec);
+			ret = -1;
+		}
+	}
+	fs3_syscall((FS3CmdBlk)FS3_OP_UMOUNT << LOCAL_OPCODE_POS, NULL);
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_log_controller_metrics
+// Description  : Log the metrics for the controller
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_log_controller_metrics(void) {
+	uint32_t u;
+	for(u = 0; u < localUnitCount; u++){
+		if(localUnitCount == 1){
+			logMessage(LOG_OUTPUT_LEVEL, "** FS3 Controller Metrics (local) **");
+		}else{
+			logMessage(LOG_OUTPUT_LEVEL, "** FS3 Controller Metrics (local, unit %u) **", u);
+		}
+		logMessage(LOG_OUTPUT_LEVEL, "Mount operations         [%9u]", localUnits[u].mountOps);
+		logMessage(LOG_OUTPUT_LEVEL, "Track seek operations    [%9u]", localUnits[u].tseekOps);
+		logMessage(LOG_OUTPUT_LEVEL, "Read sector operations   [%9u]", localUnits[u].rsectOps);
+		logMessage(LOG_OUTPUT_LEVEL, "Write sector operations  [%9u]", localUnits[u].wsectOps);
+		logMessage(LOG_OUTPUT_LEVEL, "Unmount operations       [%9u]", localUnits[u].unmntOps);
+		logMessage(LOG_OUTPUT_LEVEL, "Injected faults          [%9u]", localUnits[u].faults);
+		logMessage(LOG_OUTPUT_LEVEL, "Torn writes              [%9u]", localUnits[u].tornWrites);
+		logMessage(LOG_OUTPUT_LEVEL, "Flipped reads            [%9u]", localUnits[u].flippedReads);
+	}
+	return(0);
+}
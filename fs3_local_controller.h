@@ -0,0 +1,47 @@
+#ifndef FS3_LOCAL_CONTROLLER_INCLUDED
+#define FS3_LOCAL_CONTROLLER_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_local_controller.h
+//  Description    : This is the interface for the local, in-process stand-in
+//                   for the FS3 controller. It implements the bus from
+//                   fs3_controller.h over an mmap'ed disk image file, with
+//                   configurable latency and fault injection. Build with
+//                   "make FS3_CONTROLLER=local" to use it instead of libfs3lib.
+//
+
+// Include
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_LOCAL_ENV "FS3_LOCAL_CONTROLLER" // Environment variable read at mount
+#define FS3_LOCAL_DEFAULT_IMAGE "fs3_disk.img" // Disk image used when none is set
+#define FS3_LOCAL_MAX_UNITS 16 // Devices served at once, for the driver's device array
+
+//
+// Local Controller Functions
+
+int fs3_local_configure(const char *spec);
+	// Configure the controller from a comma separated list of key=value:
+	//   image=<path>   disk image file backing the device
+	//   tracks=<n>     tracks of the device   sectors=<n>  sectors per track (default 64x1024)
+	//   reuse=<0|1>    keep the image contents at mount (default 0, fresh disk)
+	//   seek=<ns>      settle time of a seek     track=<ns>  time per track crossed
+	//   read=<ns>      time to read a sector     write=<ns>  time to write a sector
+	//   fail=<p>       probability a seek/read/write fails with the ret bit set
+	//   failat=<n>     fail the n-th command after mount (1 based)
+	//   torn=<p>       probability a write only stores a prefix of the sector and fails
+	//   flip=<p>       probability a read returns the sector with one bit flipped, without failing
+	//   failunit=<n>   inject the faults above on unit n of a device array only (default every unit)
+	//   seed=<n>       seed for the fault injection
+	// The FS3_LOCAL_CONTROLLER environment variable is applied the same way at mount.
+
+int fs3_local_set_units(uint32_t units, uint32_t tracks, uint32_t trackSize);
+	// Serve "units" devices of the given geometry (used over tracks= and sectors=
+	// when there is more than one), unit n > 0 uses the image with ".n" appended
+
+FS3CmdBlk fs3_local_syscall(uint32_t unit, FS3CmdBlk cmdblock, void *buf);
+	// The bus of one unit, fs3_syscall is the bus of unit 0
+
+#endif
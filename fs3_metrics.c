@@ -0,0 +1,383 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_metrics.c
+//  Description    : This is the implementation of the runtime metrics registry
+//                   for the FS3 filesystem. The cache, the driver and the bus
+//                   report events here, and the registry can be exported on
+//                   demand as JSON or in the Prometheus text format.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+
+// Project Includes
+#include <fs3_metrics.h>
+#include <fs3_driver.h>
+
+//
+// Support Macros/Data
+
+// Hit/miss pair used for the per-file and per-track tables
+typedef struct hitCountr {
+	uint64_t hits;
+	uint64_t misses;
+	int32_t handle; // File the per-file pair counts for, unused per track
+} hitCounter;
+
+// Counters kept for every driver request type
+typedef struct requestCountr {
+	uint64_t count;
+	uint64_t failures;
+	uint64_t bytes;
+	uint64_t rdsect;
+	uint64_t wrsect;
+	uint64_t sectors;
+	uint64_t sectorHist[FS3_METRICS_HIST_BUCKETS + 1]; // Last bucket is the overflow
+} requestCounter;
+
+// Labels used by both exporters
+const char *FS3_EVICT_LABELS[FS3_EVICT_MAXVAL] = { "capacity", "close", "invalidate" };
+const char *FS3_REQ_LABELS[FS3_REQ_MAXVAL] = { "read", "write" };
+const char *FS3_OP_LABELS[FS3_OP_MAXVAL] = { "mount", "tseek", "rdsect", "wrsect", "umount" };
+
+// Cache metrics
+hitCounter *trackAccess = NULL; // Grown to the highest track (and file) seen
+hitCounter *fileAccess = NULL;
+uint32_t trackAccessSize;
+uint32_t fileAccessSize;
+uint64_t evictions[FS3_EVICT_MAXVAL];
+uint64_t writebacks;
+uint64_t warmFetched;
+uint64_t warmHits;
+
+// Driver metrics
+uint64_t seeksIssued;
+uint64_t seeksAvoided;
+uint64_t appendsBuffered;
+uint64_t appendFlushes;
+requestCounter requests[FS3_REQ_MAXVAL];
+int8_t activeRequest;
+int32_t requestDepth;
+uint32_t requestSectors;
+
+// Bus metrics
+uint64_t busOps[FS3_OP_MAXVAL];
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : histBucket
+// Description  : Find the histogram bucket for a number of sectors, bucket 0
+//                holds empty requests and bucket n holds up to 2^(n-1)
+//
+// Inputs       : sectors - the number of sectors touched
+// Outputs      : the bucket index (FS3_METRICS_HIST_BUCKETS is the overflow)
+
+static int histBucket(uint32_t sectors) {
+	int bucket = 0;
+	uint64_t bound = 0;
+	while(bucket < FS3_METRICS_HIST_BUCKETS && sectors > bound){
+		bound = (bound == 0) ? 1 : bound * 2;
+		bucket++;
+	}
+	return(sectors > bound ? FS3_METRICS_HIST_BUCKETS : bucket);
+}
+
+// Upper bound of a histogram bucket
+static uint64_t histBound(int bucket) {
+	return(bucket == 0 ? 0 : ((uint64_t)1 << (bucket - 1)));
+}
+
+// Makes a counter array cover index "idx", returns 0 if it does
+static int growCounters(hitCounter **counters, uint32_t *size, uint32_t idx) {
+	uint32_t grown = (*size > 0) ? *size : FS3_METRICS_COUNTER_STEP;
+	hitCounter *bigger;
+	if(idx < *size){
+		return(0);
+	}
+	while(grown <= idx){
+		grown *= 2;
+	}
+	if((bigger = realloc(*counters, sizeof(hitCounter) * grown)) == NULL){
+		return(-1);
+	}
+	memset(&bigger[*size], 0x0, sizeof(hitCounter) * (grown - *size));
+	*counters = bigger;
+	*size = grown;
+	return(0);
+}
+
+void fs3_metrics_init(void) {
+	if(trackAccess != NULL){
+		memset(trackAccess, 0x0, sizeof(hitCounter) * trackAccessSize);
+	}
+	if(fileAccess != NULL){
+		memset(fileAccess, 0x0, sizeof(hitCounter) * fileAccessSize);
+	}
+	memset(evictions, 0x0, sizeof(evictions));
+	memset(requests, 0x0, sizeof(requests));
+	memset(busOps, 0x0, sizeof(busOps));
+	writebacks = 0;
+	warmFetched = 0;
+	warmHits = 0;
+	seeksIssued = 0;
+	seeksAvoided = 0;
+	appendsBuffered = 0;
+	appendFlushes = 0;
+	activeRequest = -1;
+	requestDepth = 0;
+	requestSectors = 0;
+}
+
+void fs3_metrics_track_access(FS3TrackIndex trk, int hit) {
+	if(growCounters(&trackAccess, &trackAccessSize, trk) != 0){
+		return;
+	}
+	if(hit){
+		trackAccess[trk].hits++;
+	}else{
+		trackAccess[trk].misses++;
+	}
+}
+
+void fs3_metrics_file_access(int32_t fd, int hit) {
+	// Counted per file slot, a reused slot starts over for the file now in it
+	uint32_t idx = FS3_HANDLE_SLOT(fd);
+	if(fd < FS3_STARTING_HANDLE || growCounters(&fileAccess, &fileAccessSize, idx) != 0){
+		return;
+	}
+	if(fileAccess[idx].handle != fd){
+		fileAccess[idx] = (hitCounter){ .handle = fd };
+	}
+	if(hit){
+		fileAccess[idx].hits++;
+	}else{
+		fileAccess[idx].misses++;
+	}
+}
+
+void fs3_metrics_eviction(FS3EvictReason reason, uint32_t lines) {
+	if(reason < FS3_EVICT_MAXVAL){
+		evictions[reason] += lines;
+	}
+}
+
+void fs3_metrics_writeback(void) {
+	writebacks++;
+}
+
+void fs3_metrics_warmup(int hit) {
+	if(hit){
+		warmHits++;
+	}else{
+		warmFetched++;
+	}
+}
+
+void fs3_metrics_seek(int avoided) {
+	if(avoided){
+		seeksAvoided++;
+	}else{
+		seeksIssued++;
+	}
+}
+
+void fs3_metrics_append(int flushed) {
+	if(flushed){
+		appendFlushes++;
+	}else{
+		appendsBuffered++;
+	}
+}
+
+void fs3_metrics_bus_op(uint8_t op) {
+	if(op >= FS3_OP_MAXVAL){
+		return;
+	}
+	busOps[op]++;
+	// Attribute sector transfers to the request that caused them
+	if(activeRequest != -1){
+		if(op == FS3_OP_RDSECT){
+			requests[activeRequest].rdsect++;
+		}else if(op == FS3_OP_WRSECT){
+			requests[activeRequest].wrsect++;
+		}
+	}
+}
+
+void fs3_metrics_begin_request(FS3RequestType type) {
+	// Nested requests are accounted to the outermost one
+	if(requestDepth++ == 0){
+		activeRequest = type;
+		requestSectors = 0;
+	}
+}
+
+void fs3_metrics_sector_touched(void) {
+	requestSectors++;
+}
+
+void fs3_metrics_end_request(int32_t bytes) {
+	requestCounter *req;
+	if(requestDepth == 0 || --requestDepth > 0){
+		return;
+	}
+	req = &requests[activeRequest];
+	req->count++;
+	if(bytes < 0){
+		req->failures++;
+	}else{
+		req->bytes += bytes;
+	}
+	req->sectors += requestSectors;
+	req->sectorHist[histBucket(requestSectors)]++;
+	activeRequest = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_metrics_export_json
+// Description  : Write the registry to out as a JSON document, the per-file
+//                and per-track tables only list entries that saw traffic
+//
+// Inputs       : out - the stream to write to
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_metrics_export_json(FILE *out) {
+	int i, j, first;
+	if(out == NULL){
+		return(-1);
+	}
+	fprintf(out, "{\n  \"cache\": {\n    \"tracks\": [");
+	for(i = 0, first = 1; i < (int)trackAccessSize; i++){
+		if(trackAccess[i].hits + trackAccess[i].misses == 0){
+			continue;
+		}
+		fprintf(out, "%s\n      {\"track\": %d, \"hits\": %lu, \"misses\": %lu}", first ? "" : ",",
+			i, trackAccess[i].hits, trackAccess[i].misses);
+		first = 0;
+	}
+	fprintf(out, "\n    ],\n    \"files\": [");
+	for(i = 0, first = 1; i < (int)fileAccessSize; i++){
+		if(fileAccess[i].hits + fileAccess[i].misses == 0){
+			continue;
+		}
+		fprintf(out, "%s\n      {\"handle\": %d, \"hits\": %lu, \"misses\": %lu}", first ? "" : ",",
+			fileAccess[i].handle, fileAccess[i].hits, fileAccess[i].misses);
+		first = 0;
+	}
+	fprintf(out, "\n    ],\n    \"evictions\": {");
+	for(i = 0; i < FS3_EVICT_MAXVAL; i++){
+		fprintf(out, "%s\"%s\": %lu", i ? ", " : "", FS3_EVICT_LABELS[i], evictions[i]);
+	}
+	fprintf(out, "},\n    \"writebacks\": %lu,\n    \"warmup\": {\"prefetched\": %lu, \"hits\": %lu}\n  },\n",
+		writebacks, warmFetched, warmHits);
+	fprintf(out, "  \"driver\": {\n    \"seeks\": {\"issued\": %lu, \"avoided\": %lu},\n"
+		"    \"appends\": {\"buffered\": %lu, \"flushes\": %lu},\n    \"requests\": {",
+		seeksIssued, seeksAvoided, appendsBuffered, appendFlushes);
+	for(i = 0; i < FS3_REQ_MAXVAL; i++){
+		requestCounter *req = &requests[i];
+		fprintf(out, "%s\n      \"%s\": {\"count\": %lu, \"failures\": %lu, \"bytes\": %lu, "
+			"\"rdsect\": %lu, \"wrsect\": %lu, \"sectors\": %lu, \"sectors_per_request\": {",
+			i ? "," : "", FS3_REQ_LABELS[i], req->count, req->failures, req->bytes,
+			req->rdsect, req->wrsect, req->sectors);
+		for(j = 0; j <= FS3_METRICS_HIST_BUCKETS; j++){
+			if(j == FS3_METRICS_HIST_BUCKETS){
+				fprintf(out, ", \"+Inf\": %lu", req->sectorHist[j]);
+			}else{
+				fprintf(out, "%s\"%lu\": %lu", j ? ", " : "", histBound(j), req->sectorHist[j]);
+			}
+		}
+		fprintf(out, "}}");
+	}
+	fprintf(out, "\n    }\n  },\n  \"bus\": {");
+	for(i = 0; i < FS3_OP_MAXVAL; i++){
+		fprintf(out, "%s\"%s\": %lu", i ? ", " : "", FS3_OP_LABELS[i], busOps[i]);
+	}
+	fprintf(out, "}\n}\n");
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_metrics_export_prometheus
+// Description  : Write the registry to out in the Prometheus text exposition
+//                format
+//
+// Inputs       : out - the stream to write to
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_metrics_export_prometheus(FILE *out) {
+	int i, j;
+	uint64_t cumulative;
+	if(out == NULL){
+		return(-1);
+	}
+	// Cache
+	fprintf(out, "# TYPE fs3_cache_track_hits_total counter\n");
+	fprintf(out, "# TYPE fs3_cache_track_misses_total counter\n");
+	for(i = 0; i < (int)trackAccessSize; i++){
+		if(trackAccess[i].hits + trackAccess[i].misses == 0){
+			continue;
+		}
+		fprintf(out, "fs3_cache_track_hits_total{track=\"%d\"} %lu\n", i, trackAccess[i].hits);
+		fprintf(out, "fs3_cache_track_misses_total{track=\"%d\"} %lu\n", i, trackAccess[i].misses);
+	}
+	fprintf(out, "# TYPE fs3_cache_file_hits_total counter\n");
+	fprintf(out, "# TYPE fs3_cache_file_misses_total counter\n");
+	for(i = 0; i < (int)fileAccessSize; i++){
+		if(fileAccess[i].hits + fileAccess[i].misses == 0){
+			continue;
+		}
+		fprintf(out, "fs3_cache_file_hits_total{handle=\"%d\"} %lu\n", fileAccess[i].handle, fileAccess[i].hits);
+		fprintf(out, "fs3_cache_file_misses_total{handle=\"%d\"} %lu\n", fileAccess[i].handle, fileAccess[i].misses);
+	}
+	fprintf(out, "# TYPE fs3_cache_evictions_total counter\n");
+	for(i = 0; i < FS3_EVICT_MAXVAL; i++){
+		fprintf(out, "fs3_cache_evictions_total{reason=\"%s\"} %lu\n", FS3_EVICT_LABELS[i], evictions[i]);
+	}
+	fprintf(out, "# TYPE fs3_cache_writebacks_total counter\n");
+	fprintf(out, "fs3_cache_writebacks_total %lu\n", writebacks);
+	fprintf(out, "# TYPE fs3_cache_warmup_lines_total counter\n");
+	fprintf(out, "fs3_cache_warmup_lines_total{result=\"prefetched\"} %lu\n", warmFetched);
+	fprintf(out, "fs3_cache_warmup_lines_total{result=\"hit\"} %lu\n", warmHits);
+	// Driver
+	fprintf(out, "# TYPE fs3_driver_seeks_total counter\n");
+	fprintf(out, "fs3_driver_seeks_total{result=\"issued\"} %lu\n", seeksIssued);
+	fprintf(out, "fs3_driver_seeks_total{result=\"avoided\"} %lu\n", seeksAvoided);
+	fprintf(out, "# TYPE fs3_driver_appends_total counter\n");
+	fprintf(out, "fs3_driver_appends_total{result=\"buffered\"} %lu\n", appendsBuffered);
+	fprintf(out, "fs3_driver_appends_total{result=\"flushed\"} %lu\n", appendFlushes);
+	fprintf(out, "# TYPE fs3_driver_requests_total counter\n");
+	fprintf(out, "# TYPE fs3_driver_request_failures_total counter\n");
+	fprintf(out, "# TYPE fs3_driver_bytes_total counter\n");
+	fprintf(out, "# TYPE fs3_driver_sector_ops_total counter\n");
+	for(i = 0; i < FS3_REQ_MAXVAL; i++){
+		fprintf(out, "fs3_driver_requests_total{op=\"%s\"} %lu\n", FS3_REQ_LABELS[i], requests[i].count);
+		fprintf(out, "fs3_driver_request_failures_total{op=\"%s\"} %lu\n", FS3_REQ_LABELS[i], requests[i].failures);
+		fprintf(out, "fs3_driver_bytes_total{op=\"%s\"} %lu\n", FS3_REQ_LABELS[i], requests[i].bytes);
+		fprintf(out, "fs3_driver_sector_ops_total{op=\"%s\",opcode=\"rdsect\"} %lu\n", FS3_REQ_LABELS[i], requests[i].rdsect);
+		fprintf(out, "fs3_driver_sector_ops_total{op=\"%s\",opcode=\"wrsect\"} %lu\n", FS3_REQ_LABELS[i], requests[i].wrsect);
+	}
+	fprintf(out, "# TYPE fs3_driver_request_sectors histogram\n");
+	for(i = 0; i < FS3_REQ_MAXVAL; i++){
+		cumulative = 0;
+		for(j = 0; j < FS3_METRICS_HIST_BUCKETS; j++){
+			cumulative += requests[i].sectorHist[j];
+			fprintf(out, "fs3_driver_request_sectors_bucket{op=\"%s\",le=\"%lu\"} %lu\n",
+				FS3_REQ_LABELS[i], histBound(j), cumulative);
+		}
+		fprintf(out, "fs3_driver_request_sectors_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", FS3_REQ_LABELS[i], requests[i].count);
+		fprintf(out, "fs3_driver_request_sectors_sum{op=\"%s\"} %lu\n", FS3_REQ_LABELS[i], requests[i].sectors);
+		fprintf(out, "fs3_driver_request_sectors_count{op=\"%s\"} %lu\n", FS3_REQ_LABELS[i], requests[i].count);
+	}
+	// Bus
+	fprintf(out, "# TYPE fs3_bus_commands_total counter\n");
+	for(i = 0; i < FS3_OP_MAXVAL; i++){
+		fprintf(out, "fs3_bus_commands_total{opcode=\"%s\"} %lu\n", FS3_OP_LABELS[i], busOps[i]);
+	}
+	return(0);
+}
@@ -0,0 +1,84 @@
+#ifndef FS3_METRICS_INCLUDED
+#define FS3_METRICS_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_metrics.h
+//  Description    : This is the interface for the runtime metrics registry
+//                   shared by the cache, the driver and the controller bus.
+//
+
+// Include
+#include <stdio.h>
+#include <stdint.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_METRICS_HIST_BUCKETS 12 // Sectors per request buckets (1, 2, 3-4, 5-8, ...)
+#define FS3_METRICS_COUNTER_STEP 64 // Per-track and per-file counters are grown from this
+
+// Reasons a line can leave the cache
+typedef enum {
+
+	FS3_EVICT_CAPACITY   = 0, // Least recently used line replaced by an insert
+	FS3_EVICT_CLOSE      = 1, // Line dropped when the cache was closed
+	FS3_EVICT_INVALIDATE = 2, // Line dropped because its sector was freed or moved
+	FS3_EVICT_MAXVAL     = 3  // Maximum eviction reason
+
+} FS3EvictReason;
+
+// Driver requests that are tracked individually
+typedef enum {
+
+	FS3_REQ_READ   = 0, // fs3_read
+	FS3_REQ_WRITE  = 1, // fs3_write
+	FS3_REQ_MAXVAL = 2  // Maximum request type
+
+} FS3RequestType;
+
+//
+// Metrics Functions
+
+void fs3_metrics_init(void);
+	// Reset every counter in the registry
+
+void fs3_metrics_track_access(FS3TrackIndex trk, int hit);
+	// Record a cache lookup for a sector on the given track
+
+void fs3_metrics_file_access(int32_t fd, int hit);
+	// Record a cache lookup made by the driver on behalf of a file
+
+void fs3_metrics_eviction(FS3EvictReason reason, uint32_t lines);
+	// Record lines leaving the cache
+
+void fs3_metrics_writeback(void);
+	// Record a modified sector being written back to the controller
+
+void fs3_metrics_warmup(int hit);
+	// Record a line prefetched from the saved hot set (or a lookup it served)
+
+void fs3_metrics_seek(int avoided);
+	// Record a track seek that was issued (or skipped because the head was there)
+
+void fs3_metrics_append(int flushed);
+	// Record a write taken into a file's append buffer (or the buffer being written out)
+
+void fs3_metrics_bus_op(uint8_t op);
+	// Record a command block sent over the bus
+
+void fs3_metrics_begin_request(FS3RequestType type);
+	// Start accounting for a driver request
+
+void fs3_metrics_sector_touched(void);
+	// Record a sector touched by the current request
+
+void fs3_metrics_end_request(int32_t bytes);
+	// Finish the current request, recording the bytes moved (-1 if it failed)
+
+int fs3_metrics_export_json(FILE *out);
+	// Write the registry to out as a JSON document
+
+int fs3_metrics_export_prometheus(FILE *out);
+	// Write the registry to out in the Prometheus text exposition format
+
+#endif
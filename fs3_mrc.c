@@ -0,0 +1,242 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_mrc.c
+//  Description    : This is the implementation of the miss-ratio-curve
+//                   estimator for the FS3 sector cache. Sectors are sampled
+//                   SHARDS-style by a spatial hash of their key, and the reuse
+//                   distance of each sampled access (the number of distinct
+//                   sampled sectors touched since its last access) is found
+//                   with a Fenwick tree over access times. Scaling distances
+//                   by 1/rate gives the LRU stack distance histogram, and the
+//                   hit ratio of a cache of c lines is the fraction of
+//                   accesses with a distance below c.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_mrc.h>
+
+//
+// Support Macros/Data
+#define FS3_MRC_INITIAL_TIMES 1024 // Initial size of the Fenwick tree (power of two)
+
+int8_t mrcEnabled = 0;
+double mrcRate;
+uint32_t mrcThreshold;
+uint64_t *mrcLastAccess; // Last access time of each sector, 0 if never seen
+uint64_t mrcSectors;     // Sectors of the disk
+uint32_t mrcTrackSize;
+int32_t *mrcTree;        // Fenwick tree marking the latest access time of each sector
+uint64_t mrcTreeSize;
+uint64_t mrcTime;
+uint64_t *mrcDistances;  // Histogram of scaled reuse distances, one per cache size up to the disk
+uint64_t mrcSampled;
+uint64_t mrcCold;
+
+//
+// Implementation
+
+// Spatial hash used to pick sampled sectors
+static uint32_t mrcHash(uint32_t key) {
+	key ^= key >> 16;
+	key *= 0x7feb352d;
+	key ^= key >> 15;
+	key *= 0x846ca68b;
+	key ^= key >> 16;
+	return(key);
+}
+
+// Add val at position pos of the Fenwick tree
+static void treeAdd(uint64_t pos, int32_t val) {
+	while(pos <= mrcTreeSize){
+		mrcTree[pos] += val;
+		pos += pos & (~pos + 1);
+	}
+}
+
+// Sum of the Fenwick tree over [1, pos]
+static int64_t treeSum(uint64_t pos) {
+	int64_t sum = 0;
+	while(pos > 0){
+		sum += mrcTree[pos];
+		pos -= pos & (~pos + 1);
+	}
+	return(sum);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : treeGrow
+// Description  : Double the Fenwick tree. Every new node below the new size
+//                only covers new (empty) positions, and the node at the new
+//                size covers everything, so it takes the current total.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int treeGrow(void) {
+	int64_t total = treeSum(mrcTreeSize);
+	uint64_t newSize = mrcTreeSize * 2;
+	int32_t *grown = realloc(mrcTree, sizeof(int32_t) * (newSize + 1));
+	if(grown == NULL){
+		return(-1);
+	}
+	mrcTree = grown;
+	memset(&mrcTree[mrcTreeSize + 1], 0x0, sizeof(int32_t) * (newSize - mrcTreeSize));
+	mrcTree[newSize] = (int32_t)total;
+	mrcTreeSize = newSize;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_mrc_init
+// Description  : Start tracking accesses
+//
+// Inputs       : rate - fraction of sectors sampled (1.0 tracks every sector)
+//                tracks, trackSize - the geometry of the disk
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_mrc_init(double rate, uint32_t tracks, uint32_t trackSize) {
+	if(rate <= 0.0 || rate > 1.0){
+		logMessage(LOG_ERROR_LEVEL, "MRC sampling rate must be in (0, 1], got %f", rate);
+		return(-1);
+	}
+	mrcRate = rate;
+	mrcThreshold = (uint32_t)(rate * FS3_MRC_HASH_MODULUS);
+	mrcTreeSize = FS3_MRC_INITIAL_TIMES;
+	mrcTime = 0;
+	mrcSampled = 0;
+	mrcCold = 0;
+	mrcSectors = (uint64_t)tracks * trackSize;
+	mrcTrackSize = trackSize;
+	mrcLastAccess = calloc(mrcSectors, sizeof(uint64_t));
+	mrcDistances = calloc(mrcSectors, sizeof(uint64_t));
+	mrcTree = calloc(mrcTreeSize + 1, sizeof(int32_t));
+	if(mrcLastAccess == NULL || mrcDistances == NULL || mrcTree == NULL){
+		fs3_mrc_close();
+		return(-1);
+	}
+	mrcEnabled = 1;
+	return(0);
+}
+
+int fs3_mrc_enabled(void) {
+	return(mrcEnabled);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_mrc_access
+// Description  : Feed a cache lookup to the estimator
+//
+// Inputs       : trk - the track of the sector looked up
+//                sct - the sector looked up
+// Outputs      : none
+
+void fs3_mrc_access(FS3TrackIndex trk, FS3SectorIndex sct) {
+	uint32_t key = (uint32_t)trk * mrcTrackSize + sct;
+	uint64_t last, distance;
+	if(!mrcEnabled || key >= mrcSectors){
+		return;
+	}
+	// Only follow the sectors picked by the spatial hash
+	if(mrcRate < 1.0 && (mrcHash(key) % FS3_MRC_HASH_MODULUS) >= mrcThreshold){
+		return;
+	}
+	if(mrcTime + 1 > mrcTreeSize && treeGrow() == -1){
+		logMessage(LOG_ERROR_LEVEL, "MRC estimator out of memory, disabling.");
+		fs3_mrc_close();
+		return;
+	}
+	mrcSampled++;
+	mrcTime++;
+	last = mrcLastAccess[key];
+	if(last == 0){
+		mrcCold++;
+	}else{
+		// Distinct sampled sectors touched since the last access, scaled to the whole disk
+		distance = (uint64_t)((treeSum(mrcTime - 1) - treeSum(last)) / mrcRate);
+		if(distance < mrcSectors){
+			mrcDistances[distance]++;
+		}
+		treeAdd(last, -1);
+	}
+	treeAdd(mrcTime, 1);
+	mrcLastAccess[key] = mrcTime;
+}
+
+double fs3_mrc_hit_ratio(uint32_t lines) {
+	uint64_t hits = 0;
+	uint32_t i;
+	if(!mrcEnabled || mrcSampled == 0){
+		return(0.0);
+	}
+	for(i = 0; i < lines && i < mrcSectors; i++){
+		hits += mrcDistances[i];
+	}
+	return((double)hits / mrcSampled);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_mrc_report
+// Description  : Write the predicted hit ratio for every cache size from one
+//                line up to the whole disk as CSV
+//
+// Inputs       : out - the stream to write to
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_mrc_report(FILE *out) {
+	uint64_t hits = 0;
+	uint32_t lines;
+	if(!mrcEnabled || out == NULL){
+		return(-1);
+	}
+	fprintf(out, "cache_lines,predicted_hit_ratio\n");
+	for(lines = 1; lines <= mrcSectors; lines++){
+		hits += mrcDistances[lines - 1];
+		fprintf(out, "%u,%.6f\n", lines, (mrcSampled == 0) ? 0.0 : (double)hits / mrcSampled);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_mrc_log_summary
+// Description  : Log the curve at power-of-two sizes and at the configured size
+//
+// Inputs       : configured - the cache size the run used
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_mrc_log_summary(uint32_t configured) {
+	uint32_t lines;
+	if(!mrcEnabled){
+		return(-1);
+	}
+	logMessage(LOG_OUTPUT_LEVEL, "MRC sampled accesses [%lu] (rate %.4f, %lu cold)", mrcSampled, mrcRate, mrcCold);
+	for(lines = 1; lines <= mrcSectors; lines *= 2){
+		logMessage(LOG_OUTPUT_LEVEL, "MRC cache lines [%6u] predicted hit ratio [%%%.2f]%s",
+			lines, fs3_mrc_hit_ratio(lines) * 100, (lines == configured) ? " <- configured" : "");
+	}
+	if((configured & (configured - 1)) != 0){
+		logMessage(LOG_OUTPUT_LEVEL, "MRC cache lines [%6u] predicted hit ratio [%%%.2f] <- configured",
+			configured, fs3_mrc_hit_ratio(configured) * 100);
+	}
+	return(0);
+}
+
+int fs3_mrc_close(void) {
+	free(mrcLastAccess);
+	free(mrcDistances);
+	free(mrcTree);
+	mrcLastAccess = NULL;
+	mrcDistances = NULL;
+	mrcTree = NULL;
+	mrcEnabled = 0;
+	return(0);
+}
@@ -0,0 +1,45 @@
+#ifndef FS3_MRC_INCLUDED
+#define FS3_MRC_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_mrc.h
+//  Description    : This is the interface for the miss-ratio-curve estimator
+//                   used to size the FS3 sector cache. It follows the cache
+//                   access stream and predicts the LRU hit ratio of every
+//                   cache size in a single pass.
+//
+
+// Include
+#include <stdio.h>
+#include <stdint.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_MRC_HASH_MODULUS (1 << 24) // Sampling space for the spatial hash
+
+//
+// MRC Functions
+
+int fs3_mrc_init(double rate, uint32_t tracks, uint32_t trackSize);
+	// Start tracking accesses, sampling a fraction rate (0 < rate <= 1) of the sectors of the disk
+
+int fs3_mrc_enabled(void);
+	// Is the estimator tracking accesses?
+
+void fs3_mrc_access(FS3TrackIndex trk, FS3SectorIndex sct);
+	// Feed a cache lookup to the estimator
+
+double fs3_mrc_hit_ratio(uint32_t lines);
+	// Predicted hit ratio of an LRU cache with the given number of lines
+
+int fs3_mrc_report(FILE *out);
+	// Write the predicted hit ratio for every cache size as CSV
+
+int fs3_mrc_log_summary(uint32_t configured);
+	// Log the curve at power-of-two sizes and at the configured size
+
+int fs3_mrc_close(void);
+	// Stop tracking and free the estimator
+
+#endif
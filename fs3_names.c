@@ -0,0 +1,196 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_names.c
+//  Description    : This is the implementation of the FS3 path table. Paths
+//                   are copied into arena chunks that are never moved, so the
+//                   file records keep plain pointers to them, and found
+//                   through an open addressing index that doubles whenever
+//                   it is half full. Paths are never removed before unmount,
+//                   a path that is unlinked is simply unbound. The directory
+//                   bound to a path is kept alongside the file slot, so the
+//                   index doubles as the lookup cache for directories.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_names.h>
+
+//
+// Support Macros/Data
+#define NAMES_MASK (namesIndexSize - 1)
+
+typedef struct NameChunk {
+	struct NameChunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+} NameChunk;
+
+typedef struct {
+	uint64_t hash;
+	const char *name; // NULL when the slot is unused
+	int64_t slot;     // File slot bound to the path, -1 if none
+	int64_t dir;      // Directory bound to the path, -1 if none
+} NameSlot;
+
+NameChunk *namesArena = NULL;
+NameSlot *namesIndex = NULL;
+uint64_t namesIndexSize;
+uint64_t namesEntries;
+
+//
+// Implementation
+
+// FNV-1a over the path
+uint64_t fs3_names_hash(const char *path) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while(*path){
+		h ^= (unsigned char)*path++;
+		h *= 0x100000001b3ULL;
+	}
+	return(h);
+}
+
+// Copies a path into the arena
+static const char *namesCopy(const char *path) {
+	size_t len = strlen(path) + 1, size;
+	NameChunk *chunk = namesArena;
+	if(chunk == NULL || chunk->used + len > chunk->size){
+		size = (len > FS3_NAMES_ARENA_CHUNK) ? len : FS3_NAMES_ARENA_CHUNK;
+		if((chunk = malloc(sizeof(NameChunk) + size)) == NULL){
+			return(NULL);
+		}
+		chunk->next = namesArena;
+		chunk->used = 0;
+		chunk->size = size;
+		namesArena = chunk;
+	}
+	memcpy(&chunk->data[chunk->used], path, len);
+	chunk->used += len;
+	return(&chunk->data[chunk->used - len]);
+}
+
+// The index slot holding a path, or the empty slot it would go in
+static NameSlot *namesFind(const char *path, uint64_t hash) {
+	uint64_t slot;
+	for(slot = hash & NAMES_MASK; namesIndex[slot].name != NULL; slot = (slot + 1) & NAMES_MASK){
+		if(namesIndex[slot].hash == hash && strcmp(namesIndex[slot].name, path) == 0){
+			break;
+		}
+	}
+	return(&namesIndex[slot]);
+}
+
+// Doubles the index, every entry is placed again
+static int namesGrow(void) {
+	NameSlot *old = namesIndex;
+	uint64_t i, slot, oldSize = namesIndexSize;
+	if((namesIndex = calloc(oldSize * 2, sizeof(NameSlot))) == NULL){
+		namesIndex = old;
+		return(-1);
+	}
+	namesIndexSize = oldSize * 2;
+	for(i = 0; i < oldSize; i++){
+		if(old[i].name != NULL){
+			for(slot = old[i].hash & NAMES_MASK; namesIndex[slot].name != NULL; slot = (slot + 1) & NAMES_MASK);
+			namesIndex[slot] = old[i];
+		}
+	}
+	free(old);
+	return(0);
+}
+
+int fs3_names_init(void) {
+	fs3_names_close();
+	if((namesIndex = calloc(FS3_NAMES_INITIAL_SIZE, sizeof(NameSlot))) == NULL){
+		logMessage(LOG_ERROR_LEVEL, "Failure allocating the path table.");
+		return(-1);
+	}
+	namesIndexSize = FS3_NAMES_INITIAL_SIZE;
+	namesEntries = 0;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_names_intern
+// Description  : Find the pooled copy of a path, adding it to the table
+//                (unbound) the first time it is seen
+//
+// Inputs       : path - the path
+// Outputs      : the pooled path, NULL if the table cannot hold it
+
+const char *fs3_names_intern(const char *path) {
+	uint64_t hash = fs3_names_hash(path);
+	NameSlot *entry;
+	if(namesIndex == NULL){
+		return(NULL);
+	}
+	if((entry = namesFind(path, hash))->name != NULL){
+		return(entry->name);
+	}
+	if(2 * (namesEntries + 1) > namesIndexSize){
+		if(namesGrow() != 0){
+			return(NULL);
+		}
+		entry = namesFind(path, hash);
+	}
+	if((entry->name = namesCopy(path)) == NULL){
+		return(NULL);
+	}
+	entry->hash = hash;
+	entry->slot = -1;
+	entry->dir = -1;
+	namesEntries++;
+	return(entry->name);
+}
+
+int64_t fs3_names_lookup(const char *path) {
+	NameSlot *entry;
+	if(namesIndex == NULL){
+		return(-1);
+	}
+	entry = namesFind(path, fs3_names_hash(path));
+	return((entry->name != NULL) ? entry->slot : -1);
+}
+
+int fs3_names_bind(const char *path, int64_t slot) {
+	if(fs3_names_intern(path) == NULL){
+		return(-1);
+	}
+	namesFind(path, fs3_names_hash(path))->slot = slot;
+	return(0);
+}
+
+int64_t fs3_names_lookup_dir(const char *path) {
+	NameSlot *entry;
+	if(namesIndex == NULL){
+		return(-1);
+	}
+	entry = namesFind(path, fs3_names_hash(path));
+	return((entry->name != NULL) ? entry->dir : -1);
+}
+
+int fs3_names_bind_dir(const char *path, int64_t dir) {
+	if(fs3_names_intern(path) == NULL){
+		return(-1);
+	}
+	namesFind(path, fs3_names_hash(path))->dir = dir;
+	return(0);
+}
+
+int fs3_names_close(void) {
+	NameChunk *chunk;
+	while((chunk = namesArena) != NULL){
+		namesArena = chunk->next;
+		free(chunk);
+	}
+	free(namesIndex);
+	namesIndex = NULL;
+	namesEntries = 0;
+	return(0);
+}
@@ -0,0 +1,47 @@
+#ifndef FS3_NAMES_INCLUDED
+#define FS3_NAMES_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_names.h
+//  Description    : This is the interface for the FS3 path table. Every path
+//                   is stored once in an arena and indexed by its hash, with
+//                   the file slot currently bound to it, so opening a file by
+//                   name does not walk the file table.
+//
+
+// Include
+#include <stdint.h>
+
+// Defines
+#define FS3_NAMES_ARENA_CHUNK 65536 // Bytes of path text allocated at a time
+#define FS3_NAMES_INITIAL_SIZE 256 // Index slots at mount, a power of two
+
+//
+// Path Table Functions
+
+int fs3_names_init(void);
+	// Reset the table, forgetting every path
+
+const char *fs3_names_intern(const char *path);
+	// The pooled copy of a path (the same pointer for equal paths), NULL on failure
+
+int64_t fs3_names_lookup(const char *path);
+	// The file slot bound to a path, -1 if there is none
+
+int fs3_names_bind(const char *path, int64_t slot);
+	// Bind a path to a file slot (-1 unbinds it), interning it if needed
+
+int64_t fs3_names_lookup_dir(const char *path);
+	// The directory bound to a path, -1 if there is none
+
+int fs3_names_bind_dir(const char *path, int64_t dir);
+	// Bind a path to a directory (-1 unbinds it), interning it if needed
+
+uint64_t fs3_names_hash(const char *path);
+	// The hash the table uses for a path
+
+int fs3_names_close(void);
+	// Free the arena and the index
+
+#endif
@@ -0,0 +1,494 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_shm_cache.c
+//  Description    : This is the implementation of the FS3 shared sector
+//                   cache. The segment is a header, the buckets and then the
+//                   lines, a key always hashes to the same bucket and takes
+//                   the least recently used of its ways. A writer holds the
+//                   futex lock of the bucket and makes the sequence number
+//                   odd while it changes it, a reader copies the line it wants
+//                   and starts over if the sequence number was odd or moved.
+//                   The recency of a line is set on a hit without the lock, a
+//                   lost update only makes the eviction order slightly off.
+//                   A process that dies inside a bucket leaves it locked for
+//                   the others, only a segment whose processes have all exited
+//                   is laid out again.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_shm_cache.h>
+#include <fs3_driver.h>
+
+//
+// Support Macros/Data
+#define SHM_HEADER_BYTES ((sizeof(FS3ShmCacheHeader) + 63) & ~(size_t)63)
+#define SHM_RELAXED(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define SHM_COUNT(x) __atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+
+char *shmName = NULL;
+size_t shmSize;
+int shmFd = -1; // Held open for the segment lock
+FS3ShmCacheHeader *shmHeader = NULL;
+FS3ShmCacheBucket *shmBuckets;
+FS3ShmCacheLine *shmLines;
+
+//
+// Implementation
+
+// Bytes of a segment with the given buckets
+static size_t segmentSize(uint32_t buckets, uint32_t ways) {
+	return(SHM_HEADER_BYTES + (size_t)buckets * sizeof(FS3ShmCacheBucket) + (size_t)buckets * ways * sizeof(FS3ShmCacheLine));
+}
+
+// The bucket a key lives in, neighbouring sectors go to different buckets
+static uint32_t bucketOf(FS3TrackIndex trk, FS3SectorIndex sct) {
+	uint64_t key = (uint64_t)trk * shmHeader->trackSize + sct;
+	return((uint32_t)(((key * 0x9e3779b97f4a7c15ull) >> 32) % shmHeader->buckets));
+}
+
+static long futex(uint32_t *word, int op, uint32_t val) {
+	return(syscall(SYS_futex, word, op, val, NULL, NULL, 0));
+}
+
+// The lock word is 0 when free, 1 when held and 2 when someone sleeps on it
+static void lockBucket(FS3ShmCacheBucket *bucket) {
+	uint32_t c = 0;
+	if(__atomic_compare_exchange_n(&bucket->lock, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+		return;
+	}
+	SHM_COUNT(shmHeader->contended);
+	if(c != 2){
+		c = __atomic_exchange_n(&bucket->lock, 2, __ATOMIC_ACQUIRE);
+	}
+	while(c != 0){
+		futex(&bucket->lock, FUTEX_WAIT, 2);
+		c = __atomic_exchange_n(&bucket->lock, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void unlockBucket(FS3ShmCacheBucket *bucket) {
+	if(__atomic_exchange_n(&bucket->lock, 0, __ATOMIC_RELEASE) == 2){
+		futex(&bucket->lock, FUTEX_WAKE, 1);
+	}
+}
+
+// Brackets a change to a bucket, with its lock held
+static void writeBegin(FS3ShmCacheBucket *bucket) {
+	__atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void writeEnd(FS3ShmCacheBucket *bucket) {
+	__atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELEASE);
+}
+
+// The way of a bucket holding the key, -1 if none (with the lock held)
+static int findWay(uint32_t b, FS3TrackIndex trk, FS3SectorIndex sct) {
+	FS3ShmCacheLine *line = &shmLines[(size_t)b * shmHeader->ways];
+	uint32_t w;
+	for(w = 0; w < shmHeader->ways; w++){
+		if(line[w].valid && line[w].track == trk && line[w].sector == sct){
+			return(w);
+		}
+	}
+	return(-1);
+}
+
+// Puts a line in its bucket with the given recency, replacing the key if
+// it is there, then a free way, then the least recently used one
+static int insertLine(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf, uint64_t count) {
+	uint32_t b = bucketOf(trk, sct), w;
+	FS3ShmCacheBucket *bucket = &shmBuckets[b];
+	FS3ShmCacheLine *line = &shmLines[(size_t)b * shmHeader->ways], *victim = NULL;
+	int way;
+	lockBucket(bucket);
+	if((way = findWay(b, trk, sct)) != -1){
+		victim = &line[way];
+	}else{
+		for(w = 0; w < shmHeader->ways && victim == NULL; w++){
+			if(!line[w].valid){
+				victim = &line[w];
+			}
+		}
+		if(victim == NULL){
+			victim = &line[0];
+			for(w = 1; w < shmHeader->ways; w++){
+				if(SHM_RELAXED(line[w].count) < SHM_RELAXED(victim->count)){
+					victim = &line[w];
+				}
+			}
+			SHM_COUNT(shmHeader->evictions);
+		}
+		SHM_COUNT(shmHeader->inserts);
+	}
+	writeBegin(bucket);
+	victim->track = trk;
+	victim->sector = sct;
+	victim->valid = 1;
+	memcpy(victim->content, buf, FS3_SECTOR_SIZE);
+	__atomic_store_n(&victim->count, count, __ATOMIC_RELAXED);
+	writeEnd(bucket);
+	unlockBucket(bucket);
+	return(way != -1);
+}
+
+// The processes still attached, entries of processes that exited without
+// detaching are cleared (with the segment lock held)
+static uint32_t liveProcesses(FS3ShmCacheHeader *header) {
+	uint32_t i, live = 0;
+	for(i = 0; i < FS3_SHM_CACHE_MAX_PROCS; i++){
+		if(header->pids[i] != 0 && kill(header->pids[i], 0) == -1 && errno == ESRCH){
+			header->pids[i] = 0;
+		}
+		live += (header->pids[i] != 0);
+	}
+	return(live);
+}
+
+// Sizes and lays out the segment afresh, every lock free and every line
+// invalid (with the segment lock held)
+static void *layOut(int fd, uint32_t buckets, uint32_t tracks, uint32_t trackSize) {
+	FS3ShmCacheHeader *header;
+	void *map;
+	shmSize = segmentSize(buckets, FS3_SHM_CACHE_WAYS);
+	if(ftruncate(fd, 0) == -1 || ftruncate(fd, shmSize) == -1 ||
+			(map = mmap(NULL, shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+		return(NULL);
+	}
+	header = map;
+	memcpy(header->magic, FS3_SHM_CACHE_MAGIC, sizeof(header->magic));
+	header->version = FS3_SHM_CACHE_VERSION;
+	header->buckets = buckets;
+	header->ways = FS3_SHM_CACHE_WAYS;
+	header->tracks = tracks;
+	header->trackSize = trackSize;
+	header->ready = 1;
+	return(map);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_shm_cache_open
+// Description  : Attach to the shared cache "name", creating it if no
+//                process has it. Attaching and detaching hold a lock on the
+//                segment, so only one process lays it out, and a segment
+//                left behind by processes that all exited without detaching
+//                is laid out afresh rather than trusted.
+//
+// Inputs       : name - the POSIX shared-memory name ("/fs3cache")
+//                lines - the lines of a new segment
+//                tracks - the tracks of the disk
+//                trackSize - the sectors per track of the disk
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_shm_cache_open(const char *name, uint32_t lines, uint32_t tracks, uint32_t trackSize) {
+	uint32_t buckets = (lines + FS3_SHM_CACHE_WAYS - 1) / FS3_SHM_CACHE_WAYS, i;
+	FS3ShmCacheHeader *header = NULL;
+	struct stat st;
+	int fd;
+
+	if(shmHeader != NULL){
+		logMessage(LOG_ERROR_LEVEL, "Shared cache [%s] is already open.", shmName);
+		return(-1);
+	}
+	buckets = (buckets == 0) ? 1 : buckets;
+	for(;;){
+		if((fd = shm_open(name, O_RDWR | O_CREAT, 0600)) == -1){
+			logMessage(LOG_ERROR_LEVEL, "Failure opening shared cache [%s]: %s", name, strerror(errno));
+			return(-1);
+		}
+		if(flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1){
+			logMessage(LOG_ERROR_LEVEL, "Failure locking shared cache [%s]: %s", name, strerror(errno));
+			close(fd);
+			return(-1);
+		}
+		// Start over if the last process removed it while this one waited
+		if(st.st_nlink > 0){
+			break;
+		}
+		close(fd);
+	}
+
+	// Keep a segment in use, as long as it was made for the same disk
+	if((size_t)st.st_size >= SHM_HEADER_BYTES){
+		shmSize = st.st_size;
+		if((header = mmap(NULL, shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+			logMessage(LOG_ERROR_LEVEL, "Failure mapping shared cache [%s]: %s", name, strerror(errno));
+			close(fd);
+			return(-1);
+		}
+		if(header->ready && (memcmp(header->magic, FS3_SHM_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+				header->version != FS3_SHM_CACHE_VERSION || header->buckets == 0 || header->ways == 0 ||
+				shmSize < segmentSize(header->buckets, header->ways))){
+			logMessage(LOG_ERROR_LEVEL, "Shared cache [%s] is not an FS3 cache.", name);
+			munmap(header, shmSize);
+			close(fd);
+			return(-1);
+		}
+		if(!header->ready || liveProcesses(header) == 0){
+			munmap(header, shmSize);
+			header = NULL;
+		}else if(header->tracks != tracks || header->trackSize != trackSize){
+			logMessage(LOG_ERROR_LEVEL, "Shared cache [%s] belongs to a %ux%u disk, not %ux%u.", name,
+				header->tracks, header->trackSize, tracks, trackSize);
+			munmap(header, shmSize);
+			close(fd);
+			return(-1);
+		}
+	}
+	if(header == NULL && (header = layOut(fd, buckets, tracks, trackSize)) == NULL){
+		logMessage(LOG_ERROR_LEVEL, "Failure sizing shared cache [%s]: %s", name, strerror(errno));
+		close(fd);
+		return(-1);
+	}
+
+	for(i = 0; i < FS3_SHM_CACHE_MAX_PROCS && header->pids[i] != 0; i++);
+	if(i == FS3_SHM_CACHE_MAX_PROCS){
+		logMessage(LOG_ERROR_LEVEL, "Shared cache [%s] already has %d processes attached.", name, FS3_SHM_CACHE_MAX_PROCS);
+		munmap(header, shmSize);
+		close(fd);
+		return(-1);
+	}
+	header->pids[i] = getpid();
+	flock(fd, LOCK_UN);
+	shmFd = fd;
+	shmHeader = header;
+	shmBuckets = (FS3ShmCacheBucket *)((char *)header + SHM_HEADER_BYTES);
+	shmLines = (FS3ShmCacheLine *)&shmBuckets[header->buckets];
+	shmName = strdup(name);
+	logMessage(FS3DriverLLevel, "Attached to shared cache [%s], %u lines.", name, fs3_shm_cache_lines());
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_shm_cache_close
+// Description  : Detach from the shared cache, the last process removes the
+//                segment
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_shm_cache_close(void) {
+	uint32_t i;
+	if(shmHeader == NULL){
+		return(-1);
+	}
+	flock(shmFd, LOCK_EX);
+	for(i = 0; i < FS3_SHM_CACHE_MAX_PROCS; i++){
+		if(shmHeader->pids[i] == getpid()){
+			shmHeader->pids[i] = 0;
+		}
+	}
+	if(liveProcesses(shmHeader) == 0){
+		shm_unlink(shmName);
+	}
+	munmap(shmHeader, shmSize);
+	flock(shmFd, LOCK_UN);
+	close(shmFd);
+	shmHeader = NULL;
+	free(shmName);
+	shmName = NULL;
+	return(0);
+}
+
+uint32_t fs3_shm_cache_lines(void) {
+	return((shmHeader == NULL) ? 0 : shmHeader->buckets * shmHeader->ways);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_shm_cache_get
+// Description  : Copy a line out of the shared cache without taking the
+//                bucket lock, the copy is repeated until no writer was in
+//                the bucket while it was made
+//
+// Inputs       : trk - the track number of the sector to find
+//                sct - the sector number of the sector to find
+//                buf - the buffer to copy the line to
+//                touch - count the access and refresh the line
+// Outputs      : 1 if found, 0 if not
+
+int fs3_shm_cache_get(FS3TrackIndex trk, FS3SectorIndex sct, void *buf, int8_t touch) {
+	uint32_t b = bucketOf(trk, sct), seq, w;
+	FS3ShmCacheBucket *bucket = &shmBuckets[b];
+	FS3ShmCacheLine *line = &shmLines[(size_t)b * shmHeader->ways];
+	int way;
+
+	for(;;){
+		while((seq = __atomic_load_n(&bucket->seq, __ATOMIC_ACQUIRE)) & 1){
+			sched_yield();
+		}
+		way = -1;
+		for(w = 0; w < shmHeader->ways && way == -1; w++){
+			if(SHM_RELAXED(line[w].valid) && SHM_RELAXED(line[w].track) == trk && SHM_RELAXED(line[w].sector) == sct){
+				memcpy(buf, line[w].content, FS3_SECTOR_SIZE);
+				way = w;
+			}
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&bucket->seq, __ATOMIC_RELAXED) == seq){
+			break;
+		}
+		SHM_COUNT(shmHeader->retries);
+	}
+
+	if(touch){
+		SHM_COUNT(shmHeader->gets);
+		if(way == -1){
+			SHM_COUNT(shmHeader->misses);
+		}else{
+			SHM_COUNT(shmHeader->hits);
+			__atomic_store_n(&line[way].count, SHM_COUNT(shmHeader->clock), __ATOMIC_RELAXED);
+		}
+	}
+	return(way != -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_shm_cache_put
+// Description  : Put a line in the shared cache as the most recently used
+//
+// Inputs       : trk - the track number of the sector
+//                sct - the sector number of the sector
+//                buf - the contents of the sector
+// Outputs      : 0 if successful
+
+int fs3_shm_cache_put(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf) {
+	insertLine(trk, sct, buf, SHM_COUNT(shmHeader->clock));
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_shm_cache_update
+// Description  : Replace the contents of a line if it is cached, without
+//                counting an access
+//
+// Inputs       : trk - the track number of the sector
+//                sct - the sector number of the sector
+//                buf - the new contents of the sector
+// Outputs      : 1 if the line was cached, 0 if not
+
+int fs3_shm_cache_update(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf) {
+	uint32_t b = bucketOf(trk, sct);
+	FS3ShmCacheBucket *bucket = &shmBuckets[b];
+	int way;
+	lockBucket(bucket);
+	if((way = findWay(b, trk, sct)) != -1){
+		writeBegin(bucket);
+		memcpy(shmLines[(size_t)b * shmHeader->ways + way].content, buf, FS3_SECTOR_SIZE);
+		writeEnd(bucket);
+	}
+	unlockBucket(bucket);
+	return(way != -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_shm_cache_invalidate
+// Description  : Drop a line from the shared cache
+//
+// Inputs       : trk - the track number of the sector
+//                sct - the sector number of the sector
+// Outputs      : 1 if the line was cached, 0 if not
+
+int fs3_shm_cache_invalidate(FS3TrackIndex trk, FS3SectorIndex sct) {
+	uint32_t b = bucketOf(trk, sct);
+	FS3ShmCacheBucket *bucket = &shmBuckets[b];
+	int way;
+	lockBucket(bucket);
+	if((way = findWay(b, trk, sct)) != -1){
+		writeBegin(bucket);
+		shmLines[(size_t)b * shmHeader->ways + way].valid = 0;
+		writeEnd(bucket);
+	}
+	unlockBucket(bucket);
+	return(way != -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_shm_cache_move
+// Description  : Re-key a line whose sector moved on disk, it is taken out
+//                of its bucket and put in the bucket of the new key with the
+//                recency it had
+//
+// Inputs       : trk - the track number the sector moved from
+//                sct - the sector number the sector moved from
+//                newTrk - the track number the sector moved to
+//                newSct - the sector number the sector moved to
+// Outputs      : 1 if the line was cached, 0 if not
+
+int fs3_shm_cache_move(FS3TrackIndex trk, FS3SectorIndex sct, FS3TrackIndex newTrk, FS3SectorIndex newSct) {
+	char content[FS3_SECTOR_SIZE];
+	uint32_t b = bucketOf(trk, sct);
+	FS3ShmCacheBucket *bucket = &shmBuckets[b];
+	FS3ShmCacheLine *line;
+	uint64_t count = 0;
+	int way;
+	lockBucket(bucket);
+	if((way = findWay(b, trk, sct)) != -1){
+		line = &shmLines[(size_t)b * shmHeader->ways + way];
+		memcpy(content, line->content, FS3_SECTOR_SIZE);
+		count = SHM_RELAXED(line->count);
+		writeBegin(bucket);
+		line->valid = 0;
+		writeEnd(bucket);
+	}
+	unlockBucket(bucket);
+	if(way != -1){
+		insertLine(newTrk, newSct, content, count);
+	}
+	return(way != -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_shm_cache_log_metrics
+// Description  : Log the counters shared by every process using the cache
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if the cache is not open
+
+int fs3_shm_cache_log_metrics(void) {
+	uint32_t i, attached = 0;
+	uint64_t gets, hits;
+	if(shmHeader == NULL){
+		return(-1);
+	}
+	gets = SHM_RELAXED(shmHeader->gets);
+	hits = SHM_RELAXED(shmHeader->hits);
+	for(i = 0; i < FS3_SHM_CACHE_MAX_PROCS; i++){
+		attached += (SHM_RELAXED(shmHeader->pids[i]) != 0);
+	}
+	logMessage(LOG_OUTPUT_LEVEL, "Shared cache [%s] (%u lines, %u processes attached)", shmName,
+		fs3_shm_cache_lines(), attached);
+	logMessage(LOG_OUTPUT_LEVEL, "Shared cache inserts    [    %lu]", SHM_RELAXED(shmHeader->inserts));
+	logMessage(LOG_OUTPUT_LEVEL, "Shared cache gets       [    %lu]", gets);
+	logMessage(LOG_OUTPUT_LEVEL, "Shared cache hits       [    %lu]", hits);
+	logMessage(LOG_OUTPUT_LEVEL, "Shared cache misses     [    %lu]", SHM_RELAXED(shmHeader->misses));
+	logMessage(LOG_OUTPUT_LEVEL, "Shared cache hit ratio  [%%%.2f]", (gets == 0) ? 0.0 : ((double)hits/gets) * 100);
+	logMessage(LOG_OUTPUT_LEVEL, "Shared cache evictions  [    %lu]", SHM_RELAXED(shmHeader->evictions));
+	logMessage(LOG_OUTPUT_LEVEL, "Shared cache read retries [  %lu]", SHM_RELAXED(shmHeader->retries));
+	logMessage(LOG_OUTPUT_LEVEL, "Shared cache lock waits [    %lu]", SHM_RELAXED(shmHeader->contended));
+	return(0);
+}
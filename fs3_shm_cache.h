@@ -0,0 +1,94 @@
+#ifndef FS3_SHM_CACHE_INCLUDED
+#define FS3_SHM_CACHE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_shm_cache.h
+//  Description    : This is the interface for the FS3 shared sector cache, a
+//                   cache backend that lives in a POSIX shared-memory segment
+//                   so every process driving the same disk shares one budget
+//                   of lines and one set of hit counters. Lines are kept in
+//                   set-associative buckets, a writer takes the futex lock of
+//                   its bucket and readers only check the sequence number of
+//                   the bucket around their copy of a line.
+//
+
+// Include
+#include <stdint.h>
+#include <sys/types.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_SHM_CACHE_MAGIC "FS3SHMC"
+#define FS3_SHM_CACHE_VERSION 1
+#define FS3_SHM_CACHE_WAYS 8 // Lines per bucket
+#define FS3_SHM_CACHE_MAX_PROCS 64 // Processes attached at once
+
+// The header at the start of the segment, the counters are shared by every process
+typedef struct FS3ShmCacheHdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t ready;     // Set once the segment is laid out
+	uint32_t buckets;
+	uint32_t ways;
+	uint32_t tracks;    // Geometry of the disk the keys belong to
+	uint32_t trackSize;
+	uint64_t clock;     // Recency of the last access
+	uint64_t gets;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t inserts;
+	uint64_t evictions;
+	uint64_t retries;   // Reads repeated because a writer was in the bucket
+	uint64_t contended; // Bucket locks that had to wait
+	pid_t pids[FS3_SHM_CACHE_MAX_PROCS]; // Processes attached, 0 for a free entry
+} FS3ShmCacheHeader;
+
+// A bucket, on a cache line of its own
+typedef struct FS3ShmCacheBkt {
+	uint32_t lock;      // Futex word, 0 free, 1 held, 2 held with waiters
+	uint32_t seq;       // Odd while a writer is changing the bucket
+	char pad[56];
+} FS3ShmCacheBucket;
+
+typedef struct FS3ShmCacheLn {
+	uint32_t track;
+	uint16_t sector;
+	uint8_t valid;
+	uint8_t unused;
+	uint64_t count;     // Recency, set without the lock on a hit
+	char content[FS3_SECTOR_SIZE];
+} FS3ShmCacheLine;
+
+//
+// Shared Cache Functions
+
+int fs3_shm_cache_open(const char *name, uint32_t lines, uint32_t tracks, uint32_t trackSize);
+	// Attach to the segment "name", creating it with room for "lines" lines if
+	// no live process has it (the lines of a segment in use are kept)
+
+int fs3_shm_cache_close(void);
+	// Detach from the segment, the last process to leave removes it
+
+uint32_t fs3_shm_cache_lines(void);
+	// Lines in the segment
+
+int fs3_shm_cache_get(FS3TrackIndex trk, FS3SectorIndex sct, void *buf, int8_t touch);
+	// Copy a line to buf, 1 if it was cached. touch counts the access and refreshes the line.
+
+int fs3_shm_cache_put(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf);
+	// Put a line in the cache, replacing the contents if it is already there
+
+int fs3_shm_cache_update(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf);
+	// Replace the contents of a line only if it is cached, 1 if it was
+
+int fs3_shm_cache_invalidate(FS3TrackIndex trk, FS3SectorIndex sct);
+	// Drop a line, 1 if it was cached
+
+int fs3_shm_cache_move(FS3TrackIndex trk, FS3SectorIndex sct, FS3TrackIndex newTrk, FS3SectorIndex newSct);
+	// Re-key a line whose sector moved on disk, 1 if it was cached
+
+int fs3_shm_cache_log_metrics(void);
+	// Log the counters shared by every process
+
+#endif
@@ -17,26 +17,69 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 // Project Includes
 #include <fs3_driver.h>
 #include <fs3_controller.h>
 #include <fs3_cache.h>
+#include <fs3_metrics.h>
+#include <fs3_mrc.h>
+#include <fs3_latency.h>
+#include <fs3_snapshot.h>
+#include <fs3_dedup.h>
+#include <fs3_compress.h>
+#include <fs3_checksum.h>
+#include <fs3_array.h>
+#include <fs3_journal.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 // Defines
 #define FS3_WORKLOAD_DIR "workload"
 #define FS3_SIM_MAX_OPEN_FILES 256
-#define FS3_ARGUMENTS "huvc:l:"
+#define FS3_SIM_VALIDATE_THREADS 4 // Threads comparing files at the end of the run
+#define FS3_ARGUMENTS "huvdDenc:l:j:p:r:R:t:s:w:i:k:z:V:g:S:MJ:H:C:"
 #define USAGE \
-	"USAGE: fs3_sim [-h] [-v] [-c <cache size>] [-l <logfile>] <workload-file>\n" \
+	"USAGE: fs3_sim [-h] [-v] [-d] [-D] [-e] [-n] [-c <cache size>] [-l <logfile>]\n" \
+	"               [-j <file>] [-p <file>] [-r <file>] [-R <rate>] [-t <costs>]\n" \
+	"               [-s <image>] [-w <image>] [-i <bytes>] [-k <bytes>] [-z <bytes>]\n" \
+	"               [-V <threads>] [-g <tracks>x<sectors>] [-S <units>[x<sectors>]] [-M]\n" \
+	"               [-J <sectors>[x<ms>]] [-H <file>] [-C <name>] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -v - verbose output\n" \
+	"    -d - defragment the disk after the workload, before validating it\n" \
+	"    -D - store sectors with identical contents once (deduplication)\n" \
+	"    -e - checksum every sector (CRC32C) and verify it when read from the disk\n" \
+	"    -n - do not write the .cmm copy of each file when validating it\n" \
 	"    -c - set the cache size (in number of sectors)\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
+	"    -j - export the runtime metrics as JSON to <file> at the end of the run\n" \
+	"    -p - export the runtime metrics in Prometheus text format to <file>\n" \
+	"    -r - predict the hit ratio of every cache size, writing the curve to <file>\n" \
+	"    -R - sample this fraction of sectors for the -r prediction (default 1.0)\n" \
+	"    -t - set the device cost model, e.g. tseek=500000,track=20000,rdsect=100000\n" \
+	"         (nanoseconds, ops are mount, tseek, rdsect, wrsect, umount and track)\n" \
+	"    -s - save a snapshot of the disk to <image> at the end of the run\n" \
+	"    -w - warm start, mount the disk from the snapshot <image>\n" \
+	"    -i - keep files up to <bytes> inline in the file table (default 256, 0 disables)\n" \
+	"    -k - pack file tails up to <bytes> into shared sectors (default 0, off)\n" \
+	"    -z - pack sectors that compress to <bytes> into shared sectors (default 0, off)\n" \
+	"    -V - compare files against the workload sources on <threads> threads (default 4)\n" \
+	"    -g - set the disk geometry (default 64x1024), the controller must match it\n" \
+	"         (e.g. the tracks= and sectors= settings of the local controller)\n" \
+	"    -S - stripe the disk over <units> controller units, <sectors> per stripe unit\n" \
+	"         (default 16), the units need the local controller\n" \
+	"    -M - mirror the disk on two controller units, reads go to the nearest head\n" \
+	"    -J - journal the file table in the first <sectors> of the disk, committing\n" \
+	"         changes in groups at least every <ms> of device time (default 50)\n" \
+	"    -H - prefetch the cache hot set saved in <file> at start, save it there at the end\n" \
+	"    -C - keep the cache in the shared-memory segment <name> (e.g. /fs3cache), shared\n" \
+	"         with every other process naming it, the first one sets its size\n" \
 	"\n" \
 	"    <workload-file> - file contain the workload to simulate\n" \
 	"\n" \
@@ -44,19 +87,39 @@
 // This is the file table
 typedef struct {
 	char     *filename;  // This is the filename for the test file
-	int16_t   fhandle;   // This is a file handle for the opened file
+	int32_t   fhandle;   // This is a file handle for the opened file
 } FS3SimulationTable;
 
+// A file read back from FS3, waiting to be compared against its source
+typedef struct {
+	char     *filename;  // The name of the file in the workload
+	char     *membuf;    // Its contents as read back from FS3
+	off_t     length;    // The length of the source file
+	int       result;    // 0 if the file matched its source
+	char      message[512]; // What went wrong, logged once the workers are done
+} FS3ValidationJob;
+
 //
 // Global Data
 int verbose;
 uint16_t fs3CacheSize = FS3_DEFAULT_CACHE_SIZE; 
+char *fs3MetricsJson = NULL;
+char *fs3MetricsProm = NULL;
+char *fs3MrcFile = NULL;
+char *fs3SnapshotSave = NULL;
+char *fs3SnapshotWarm = NULL;
+double fs3MrcRate = 1.0;
+int fs3Defrag = 0;
+int fs3ValidateThreads = FS3_SIM_VALIDATE_THREADS;
+int fs3WriteBackups = 1;
 
 //
 // Functional Prototypes
 
 int simulate_FS3( char *wload );              // control loop of the FS3 simulation
-int validate_file(char *fname, int16_t mfh);  // Validate a file in the filesystem
+int validate_files(FS3SimulationTable *ftable); // Validate every file in the filesystem
+int export_metrics(char *fname, int (*exporter)(FILE *)); // Write the metrics registry to a file
+int export_mrc(char *fname);                  // Write the predicted miss ratio curve to a file
 
 //
 // Functions
@@ -74,6 +137,7 @@ int main( int argc, char *argv[] ) {
 
 	// Local variables
 	int ch, verbose = 0, log_initialized = 0, unit_tests = 0;
+	unsigned int sizeBytes, tracks, trackSize, units, stripeUnit, journalSize, journalWindow;
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, FS3_ARGUMENTS)) != -1) {
@@ -87,6 +151,29 @@ int main( int argc, char *argv[] ) {
 			verbose = 1;
 			break;
 
+		case 'd': // Defragment Flag
+			fs3Defrag = 1;
+			break;
+
+		case 'D': // Deduplication Flag
+			fs3_set_dedup(1);
+			break;
+
+		case 'e': // Checksum Flag
+			fs3_set_checksums(1);
+			break;
+
+		case 'n': // No backup files Flag
+			fs3WriteBackups = 0;
+			break;
+
+		case 'V': // Set the validation threads
+			if ( (sscanf(optarg, "%d", &fs3ValidateThreads) != 1) || (fs3ValidateThreads < 1) ) {
+				logMessage(LOG_ERROR_LEVEL, "Failed parsing validation threads [%s]", optarg);
+				return(-1);
+			}
+			break;
+
 		case 'u': // Unit test Flag
 			unit_tests = 1;
 			break;
@@ -103,6 +190,102 @@ int main( int argc, char *argv[] ) {
 			}
 			break;
 
+		case 'j': // Export metrics as JSON
+			fs3MetricsJson = optarg;
+			break;
+
+		case 'p': // Export metrics in Prometheus format
+			fs3MetricsProm = optarg;
+			break;
+
+		case 'r': // Predict the miss ratio curve
+			fs3MrcFile = optarg;
+			break;
+
+		case 'R': // Set the miss ratio curve sampling rate
+			if ( sscanf(optarg, "%lf", &fs3MrcRate) != 1) {
+				logMessage(LOG_ERROR_LEVEL, "Failed parsing sampling rate [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 't': // Set the device cost model
+			if ( fs3_latency_configure(optarg) == -1 ) {
+				logMessage(LOG_ERROR_LEVEL, "Failed parsing device costs [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 's': // Save a snapshot at the end of the run
+			fs3SnapshotSave = optarg;
+			break;
+
+		case 'w': // Warm start from a snapshot
+			fs3SnapshotWarm = optarg;
+			break;
+
+		case 'i': // Set the inline file threshold
+			if ( sscanf(optarg, "%u", &sizeBytes) != 1 || fs3_set_inline_threshold(sizeBytes) == -1 ) {
+				logMessage(LOG_ERROR_LEVEL, "Failed parsing inline threshold [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'k': // Set the tail packing threshold
+			if ( sscanf(optarg, "%u", &sizeBytes) != 1 || fs3_set_tail_packing(sizeBytes) == -1 ) {
+				logMessage(LOG_ERROR_LEVEL, "Failed parsing tail packing threshold [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'z': // Set the compression threshold
+			if ( sscanf(optarg, "%u", &sizeBytes) != 1 || fs3_set_compression(sizeBytes) == -1 ) {
+				logMessage(LOG_ERROR_LEVEL, "Failed parsing compression threshold [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'g': // Set the disk geometry
+			if ( sscanf(optarg, "%ux%u", &tracks, &trackSize) != 2 || fs3_set_geometry(tracks, trackSize) == -1 ) {
+				logMessage(LOG_ERROR_LEVEL, "Failed parsing disk geometry [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'S': // Stripe the disk over several units
+			stripeUnit = FS3_ARRAY_DEFAULT_UNIT;
+			if ( sscanf(optarg, "%ux%u", &units, &stripeUnit) < 1 || fs3_array_configure(units, stripeUnit) == -1 ) {
+				logMessage(LOG_ERROR_LEVEL, "Failed parsing device array [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'M': // Mirror the disk on two units
+			if ( fs3_array_mirror() == -1 ) {
+				return(-1);
+			}
+			break;
+
+		case 'H': // Keep the cache hot set across runs
+			if ( fs3_set_cache_warmup(optarg) == -1 ) {
+				return(-1);
+			}
+			break;
+
+		case 'C': // Share the cache with other processes
+			if ( fs3_set_cache_shared(optarg) == -1 ) {
+				return(-1);
+			}
+			break;
+
+		case 'J': // Journal the file table
+			journalWindow = FS3_JOURNAL_DEFAULT_WINDOW_MS;
+			if ( sscanf(optarg, "%ux%u", &journalSize, &journalWindow) < 1 || fs3_journal_configure(journalSize, journalWindow) == -1 ) {
+				logMessage(LOG_ERROR_LEVEL, "Failed parsing journal size [%s]", optarg);
+				return(-1);
+			}
+			break;
+
 		default:  // Default (unknown)
 			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
 			return( -1 );
@@ -127,7 +310,7 @@ int main( int argc, char *argv[] ) {
 		// Run the unit tests
 		enableLogLevels( LOG_INFO_LEVEL );
 		logMessage(LOG_INFO_LEVEL, "Running unit tests ....\n\n");
-		if (fs3_unit_test() == 0) {
+		if (fs3_unit_test() == 0 && fs3_driver_unit_test() == 0 && fs3_array_unit_test() == 0) {
 			logMessage(LOG_INFO_LEVEL, "Unit tests completed successfully.\n\n");
 		} else {
 			logMessage(LOG_ERROR_LEVEL, "Unit tests failed, aborting.\n\n");
@@ -169,6 +352,7 @@ int simulate_FS3( char *wload ) {
 	FILE *fhandle = NULL;
 	int32_t err=0, len, off, fields, linecount;
 	FS3SimulationTable ftable[FS3_SIM_MAX_OPEN_FILES];
+	struct timeval start, end;
 	int idx, i;
 
 	// Setup the file table
@@ -183,11 +367,18 @@ int simulate_FS3( char *wload ) {
 	}
 
 	// Startup the interface
-	if ( (fs3_mount_disk() == -1) || (fs3_init_cache(fs3CacheSize) == -1) ){
+	gettimeofday(&start, NULL);
+	if ( (((fs3SnapshotWarm == NULL) ? fs3_mount_disk() : fs3_mount_snapshot(fs3SnapshotWarm)) == -1) ||
+			(fs3_init_cache(fs3CacheSize) == -1) ){
 		logMessage( LOG_ERROR_LEVEL, "FS3 simulator failed initialization.");
 		fclose( fhandle );
 		return( -1 );
 	}
+	if ( (fs3MrcFile != NULL) && (fs3_mrc_init(fs3MrcRate, fs3Tracks, fs3TrackSize) == -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "FS3 simulator failed miss ratio curve initialization.");
+		fclose( fhandle );
+		return( -1 );
+	}
 	logMessage(FS3SimulatorLLevel, "FS3 simulator initialization complete.");
 
 	// While file not done
@@ -249,13 +440,6 @@ int simulate_FS3( char *wload ) {
 				// Log the command executed
 				logMessage(FS3SimulatorLLevel, "FS3_SIM : Writing %d bytes at position %d from file [%s]", len, off, fname);
 
-				// First perform the seek
-				if (fs3_seek(ftable[idx].fhandle, off)) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
-
 				// Now see if we need more data to fill, terminate the lines
 				CMPSC311_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
 				CMPSC311_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
@@ -267,10 +451,10 @@ int simulate_FS3( char *wload ) {
 					}
 				}
 
-				// Now perform the write
-				if (fs3_write(ftable[idx].fhandle, text, len) != len) {
+				// Now perform the positional write (the file position is left alone)
+				if (fs3_pwrite(ftable[idx].fhandle, text, len, off) != len) {
 					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", fname, len);
+					logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d at position %d failed, aborting simulation.", fname, len, off);
 					return(-1);
 				}
 
@@ -342,34 +526,78 @@ int simulate_FS3( char *wload ) {
 		}
 	}
 
-	// Now walk the the table looking for the file
+	// Defragment first, so validation reads the new layout
+	if ( fs3Defrag ) {
+		uint64_t switches = fs3_track_switches();
+		int32_t copied;
+		if ( (copied = fs3_defrag()) == -1 ) {
+			logMessage(LOG_ERROR_LEVEL, "FS3 simulation failed, defragmentation failed.");
+			fclose( fhandle );
+			return(-1);
+		}
+		logMessage(LOG_OUTPUT_LEVEL, "Defragmented disk, copied [%d] sectors, track switches [%lu] -> [%lu].",
+			copied, switches, fs3_track_switches());
+	}
+
+	// Now check every file against its source
+	if (validate_files(ftable) != 0) {
+		fclose( fhandle );
+		return(-1);
+	}
 	for (i=0; i<FS3_SIM_MAX_OPEN_FILES; i++) {
 		if (ftable[i].filename != NULL) {
-			if (validate_file(ftable[i].filename, ftable[i].fhandle) != 0) {
-				logMessage(LOG_ERROR_LEVEL, "FS3 Validation failed on file [%s].", ftable[i].filename,fname);
-				fclose( fhandle );
-				return(-1);
-			}
-
-			// Clean up the file
-			logMessage(FS3SimulatorLLevel, "Contents of file [%s] validated.", ftable[i].filename);
 			fs3_close(ftable[i].fhandle);
 			free(ftable[i].filename);
 			ftable[i].filename = NULL;
 		}
 	}
 
+	// Save the disk for later warm starts
+	if ( (fs3SnapshotSave != NULL) && (fs3_snapshot_save(fs3SnapshotSave) == -1) ) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 simulation failed, snapshot [%s] failed.", fs3SnapshotSave);
+		fclose( fhandle );
+		return(-1);
+	}
+
 	// Log cache metrics, shut down the interface
 	if ( fs3_log_cache_metrics() == -1 ) {
 		logMessage(LOG_ERROR_LEVEL, "FS3 simulation failed, controller metrics failed");
 		return(-1);
 	}
+	if ( (export_metrics(fs3MetricsJson, fs3_metrics_export_json) == -1) ||
+			(export_metrics(fs3MetricsProm, fs3_metrics_export_prometheus) == -1) ) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 simulation failed, metrics export failed");
+		return(-1);
+	}
+	if ( export_mrc(fs3MrcFile) == -1 ) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 simulation failed, miss ratio curve export failed");
+		return(-1);
+	}
 	if ((fs3_unmount_disk() == -1) || (fs3_close_cache() == -1)) {
 		logMessage( LOG_ERROR_LEVEL, "FS3 simulator failed shutdown.");
 		fclose( fhandle );
 		return( -1 );
 	}
+	gettimeofday(&end, NULL);
 	fs3_log_controller_metrics();
+	fs3_latency_log_metrics();
+	if ( fs3_array_devices() > 1 ) {
+		fs3_array_log_metrics();
+	}
+	if ( fs3_journal_enabled() ) {
+		fs3_journal_log_metrics();
+	}
+	if ( dedupWrites ) {
+		fs3_dedup_log_metrics();
+	}
+	if ( compressThreshold > 0 ) {
+		fs3_compress_log_metrics();
+	}
+	if ( checksumSectors ) {
+		fs3_checksum_log_metrics();
+	}
+	logMessage(LOG_OUTPUT_LEVEL, "Simulated device time [%12.3f ms], wall time [%12.3f ms]",
+		fs3_latency_clock() / 1e6, compareTimes(&start, &end) / 1e3);
 	logMessage(FS3SimulatorLLevel, "FS3 simulator shutdown complete.");
 	logMessage(LOG_OUTPUT_LEVEL, "FS3 simulation: all tests successful!!!.");
 
@@ -380,81 +608,239 @@ int simulate_FS3( char *wload ) {
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : validate_file
-// Description  : Vadliate a file in the filesystem
+// Function     : compare_file
+// Description  : Compare a file read back from FS3 against its source, which
+//                is mapped rather than read, and write the .cmm copy of it
+//                so people can debug. Runs on the validation threads, so it
+//                leaves its messages in the job instead of logging them.
 //
-// Inputs       : fname - the name of the file to validate
-//                mfh - the disk file handle
-// Outputs      : 0 if successful test, -1 if failure
+// Inputs       : job - the file to compare
+// Outputs      : 0 if it matches, -1 if not
 
-int validate_file(char *fname, int16_t mfh) {
+int compare_file(FS3ValidationJob *job) {
 
 	// Local variables
-	char filename[256], bkfile[256], *filbuf, *membuf;
-	struct stat stats;
-	int idx, fh;
+	char filename[256], bkfile[256], *filbuf;
+	off_t idx, chunk;
+	ssize_t written;
+	int fh;
 
-	// First figure out how big the file is, setup buffer
-	snprintf(filename, 256, "%s/%s", FS3_WORKLOAD_DIR, fname);
-	if ((stat(filename, &stats) != 0) || (stats.st_size == 0)) {
-		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], missing or "
-			"unknown source.", filename);
-		return(-1);		
+	// Map the source
+	snprintf(filename, 256, "%s/%s", FS3_WORKLOAD_DIR, job->filename);
+	if ((fh=open(filename, O_RDONLY)) == -1) {
+		snprintf(job->message, sizeof(job->message), "Failure validating file [%s], open failed ", filename);
+		return(-1);
 	}
-	if ( ((filbuf = malloc(stats.st_size)) == NULL) || ((membuf = malloc(stats.st_size)) == NULL) ) {
-		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], failed "
-			"buffer allocation.", filename);
-		return(-1);		
+	filbuf = mmap(NULL, job->length, PROT_READ, MAP_PRIVATE, fh, 0);
+	close(fh);
+	if (filbuf == MAP_FAILED) {
+		snprintf(job->message, sizeof(job->message), "Failure validating file [%s], map failed ", filename);
+		return(-1);
 	}
 
-	// Now open the file and read the contents
-	if ((fh=open(filename, O_RDONLY)) == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], open failed ", filename);
-		return(-1);		
+	// Now create a backup of the disk file, a write at a time until it is all out
+	if (fs3WriteBackups) {
+		snprintf(bkfile, 256, "%s/%s.cmm", FS3_WORKLOAD_DIR, job->filename);
+		if ((fh=open(bkfile, O_RDWR|O_CREAT|O_TRUNC, S_IRWXU)) == -1) {
+			snprintf(job->message, sizeof(job->message), "Failure creating backup file [%s], open failed (%s) ",
+				bkfile, strerror(errno));
+			munmap(filbuf, job->length);
+			return(-1);
+		}
+		for (idx=0; idx<job->length; idx+=written) {
+			if ((written = write(fh, &job->membuf[idx], job->length - idx)) <= 0) {
+				snprintf(job->message, sizeof(job->message), "Failure writing backup file [%s].", bkfile);
+				close(fh);
+				munmap(filbuf, job->length);
+				return(-1);
+			}
+		}
+		close(fh);
 	}
-	if ((read(fh, filbuf, stats.st_size)) == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], read failed ", filename);
-		return(-1);
+
+	// Compare a page at a time, only a page that differs is walked byte for byte
+	for (idx=0; idx<job->length; idx+=chunk) {
+		chunk = CMPSC311_MINVAL(4096, job->length - idx);
+		if (memcmp(&job->membuf[idx], &filbuf[idx], chunk) != 0) {
+			while (job->membuf[idx] == filbuf[idx]) {
+				idx++;
+			}
+			snprintf(job->message, sizeof(job->message), "Validation of [%s] failed at offset %ld (mem %x/'%c' "
+				"!= fil %x/'%c')", job->filename, (long)idx, job->membuf[idx], job->membuf[idx], filbuf[idx], filbuf[idx]);
+			munmap(filbuf, job->length);
+			return(-1);
+		}
 	}
-	close(fh);
+	munmap(filbuf, job->length);
+	return(0);
+}
 
-	// Seek to the beginning of the disk file, read the contents
-	if (fs3_seek(mfh, 0) == -1) {
-		// Failed, error out
-		logMessage(LOG_ERROR_LEVEL, "Read fs3 file [%s] see to zero failed.", fname);
-		return(-1);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : validate_worker
+// Description  : Take files off the shared job list until there are none left
+//
+// Inputs       : arg - the job list
+// Outputs      : NULL
+
+static FS3ValidationJob *validateJobs;
+static int validateJobCount, validateNextJob;
+static pthread_mutex_t validateLock = PTHREAD_MUTEX_INITIALIZER;
+
+void *validate_worker(void *arg) {
+	int job;
+	while (1) {
+		pthread_mutex_lock(&validateLock);
+		job = validateNextJob++;
+		pthread_mutex_unlock(&validateLock);
+		if (job >= validateJobCount) {
+			return(NULL);
+		}
+		validateJobs[job].result = compare_file(&validateJobs[job]);
 	}
-	if (fs3_read(mfh, membuf, stats.st_size) != stats.st_size) {
-		// Failed, error out
-		logMessage(LOG_ERROR_LEVEL, "Read fs3 file [%s] of length %d failed.", fname, stats.st_size);
-		return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : validate_files
+// Description  : Vadliate every file in the filesystem. The files are read
+//                back one after the other (the driver is not thread safe),
+//                then compared against their sources on a pool of threads.
+//                Results are logged in table order once the pool is done.
+//
+// Inputs       : ftable - the simulation file table
+// Outputs      : 0 if every file matched, -1 if failure
+
+int validate_files(FS3SimulationTable *ftable) {
+
+	// Local variables
+	FS3ValidationJob jobs[FS3_SIM_MAX_OPEN_FILES];
+	pthread_t threads[FS3_SIM_MAX_OPEN_FILES];
+	struct stat stats;
+	char filename[256];
+	int i, started, count = 0, ret = 0;
+
+	// Read back every file, sized by its source
+	for (i=0; (i<FS3_SIM_MAX_OPEN_FILES) && (ret == 0); i++) {
+		if (ftable[i].filename == NULL) {
+			continue;
+		}
+		memset(&jobs[count], 0x0, sizeof(FS3ValidationJob));
+		jobs[count].filename = ftable[i].filename;
+		snprintf(filename, 256, "%s/%s", FS3_WORKLOAD_DIR, ftable[i].filename);
+		if ((stat(filename, &stats) != 0) || (stats.st_size == 0)) {
+			logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], missing or "
+				"unknown source.", filename);
+			ret = -1;
+		} else if ((jobs[count].membuf = malloc(stats.st_size)) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], failed "
+				"buffer allocation.", filename);
+			ret = -1;
+		} else if (fs3_seek(ftable[i].fhandle, 0) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "Read fs3 file [%s] see to zero failed.", ftable[i].filename);
+			ret = -1;
+		} else if (fs3_read(ftable[i].fhandle, jobs[count].membuf, stats.st_size) != stats.st_size) {
+			logMessage(LOG_ERROR_LEVEL, "Read fs3 file [%s] of length %ld failed.", ftable[i].filename, (long)stats.st_size);
+			ret = -1;
+		}
+		jobs[count].length = stats.st_size;
+		count++;
+	}
+	if (ret != 0) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 Validation failed on file [%s].", jobs[count-1].filename);
 	}
 
-	// Now create a backup of the disk file so people can debug
-	snprintf(bkfile, 256, "%s/%s.cmm", FS3_WORKLOAD_DIR, fname);
-	if ((fh=open(bkfile, O_RDWR|O_CREAT|O_TRUNC, S_IRWXU)) == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Failure creating backup file [%s], open failed (%s) ", 
-			bkfile, strerror(errno));
-		return(-1);		
+	// Compare them on the pool, the calling thread only waits
+	validateJobs = jobs;
+	validateJobCount = (ret == 0) ? count : 0;
+	validateNextJob = 0;
+	for (started=0; started<CMPSC311_MINVAL(fs3ValidateThreads, validateJobCount); started++) {
+		if (pthread_create(&threads[started], NULL, validate_worker, NULL) != 0) {
+			break;
+		}
 	}
-	if ((write(fh, membuf, stats.st_size)) == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Failure writing backup file [%s].", bkfile);
-		return(-1);
+	if ((started == 0) && (validateJobCount > 0)) {
+		validate_worker(NULL);
+	}
+	for (i=0; i<started; i++) {
+		pthread_join(threads[i], NULL);
 	}
-	close(fh);
 
-	// Now walk the buffers and compare byte for byte
-	for (idx=0; idx<stats.st_size; idx++) {
-		if (membuf[idx] != filbuf[idx]) {
-			logMessage(LOG_ERROR_LEVEL, "Validation of [%s] failed at offset %d (mem %x/'%c' "
-				"!= fil %x/'%c')", fname, idx, membuf[idx], membuf[idx], filbuf[idx], filbuf[idx]);
-			return(-1);
+	// Log the results in order, stopping at the first failure
+	for (i=0; (i<validateJobCount) && (ret == 0); i++) {
+		if (jobs[i].result != 0) {
+			logMessage(LOG_ERROR_LEVEL, "%s", jobs[i].message);
+			logMessage(LOG_ERROR_LEVEL, "FS3 Validation failed on file [%s].", jobs[i].filename);
+			ret = -1;
+		} else {
+			logMessage(LOG_OUTPUT_LEVEL, "Validation of [%s], length %ld sucessful.", jobs[i].filename, (long)jobs[i].length);
+			logMessage(FS3SimulatorLLevel, "Contents of file [%s] validated.", jobs[i].filename);
 		}
 	}
+	for (i=0; i<count; i++) {
+		free(jobs[i].membuf);
+	}
+	return(ret);
+}
 
-	// Free the buffers, log success, and return successfully
-	free(filbuf);
-	free(membuf);
-	logMessage(LOG_OUTPUT_LEVEL, "Validation of [%s], length %d sucessful.", fname, stats.st_size);
-	return( 0 );
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : export_metrics
+// Description  : Write the metrics registry to a file using an exporter
+//
+// Inputs       : fname - the file to write (nothing is done if NULL)
+//                exporter - the function that formats the registry
+// Outputs      : 0 if successful, -1 if failure
+
+int export_metrics(char *fname, int (*exporter)(FILE *)) {
+
+	// Local variables
+	FILE *out;
+	int ret;
+
+	// Nothing requested, nothing to do
+	if (fname == NULL) {
+		return( 0 );
+	}
+	if ((out = fopen(fname, "w")) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failure opening metrics file [%s], error: %s.", 
+			fname, strerror(errno));
+		return( -1 );
+	}
+	ret = exporter(out);
+	fclose(out);
+	logMessage(FS3SimulatorLLevel, "Metrics written to [%s].", fname);
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : export_mrc
+// Description  : Log a summary of the predicted miss ratio curve and write
+//                the full curve to a file
+//
+// Inputs       : fname - the file to write (nothing is done if NULL)
+// Outputs      : 0 if successful, -1 if failure
+
+int export_mrc(char *fname) {
+
+	// Local variables
+	FILE *out;
+	int ret;
+
+	// Nothing requested, nothing to do
+	if (fname == NULL) {
+		return( 0 );
+	}
+	fs3_mrc_log_summary(fs3CacheSize);
+	if ((out = fopen(fname, "w")) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failure opening curve file [%s], error: %s.", 
+			fname, strerror(errno));
+		return( -1 );
+	}
+	ret = fs3_mrc_report(out);
+	fclose(out);
+	fs3_mrc_close();
+	logMessage(FS3SimulatorLLevel, "Miss ratio curve written to [%s].", fname);
+	return( ret );
 }
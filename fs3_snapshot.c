@@ -0,0 +1,383 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_snapshot.c
+//  Description    : This is the implementation of FS3 disk-image snapshots.
+//                   Warm mounts map the image instead of reading it: the
+//                   sector map and checksums are read back for the sectors
+//                   in use only, and sectors are copied out of the image the
+//                   first time they are needed rather than written back to
+//                   the controller at mount. The image carries the geometry
+//                   of the disk it was taken from.
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_snapshot.h>
+#include <fs3_driver.h>
+#include <fs3_checksum.h>
+#include <fs3_names.h>
+#include <fs3_dir.h>
+#include <fs3_journal.h>
+
+//
+// Support Macros/Data
+#define SNAPSHOT_ROUNDUP(x) ((((x) + FS3_SNAPSHOT_ALIGN - 1) / FS3_SNAPSHOT_ALIGN) * FS3_SNAPSHOT_ALIGN)
+
+// A file record as saved, the hot and cold halves and the path together
+typedef struct {
+	char path[FS3_MAX_PATH_LENGTH];
+	int32_t handle;
+	int32_t length;
+	int32_t sectorCount;
+	int8_t isInline;
+	int8_t isPacked;
+	int8_t isDeleted;
+	int8_t tailShared;
+	uint16_t tailOffset;
+	uint16_t tailCapacity;
+	uint64_t tailSector;
+	char inlineData[FS3_INLINE_MAX];
+} SnapshotFile;
+
+char *snapshotImage = NULL;    // Mapped image of the warm mount
+uint64_t snapshotSize;
+uint64_t snapshotSectors;      // Sectors held by the image
+uint64_t snapshotDataOffset;
+uint8_t *snapshotPending;      // 1 while the controller does not have the sector yet
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_snapshot_save
+// Description  : Dump the mounted filesystem to an image file. The image is
+//                written next to the target and renamed over it, so saving
+//                over the image that is currently mounted is safe.
+//
+// Inputs       : path - the image file to create
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_snapshot_save(const char *path) {
+	FS3SnapshotHeader header;
+	char tmpPath[FS3_MAX_PATH_LENGTH + 8], sector[FS3_SECTOR_SIZE];
+	SnapshotFile record;
+	char dirPath[FS3_MAX_PATH_LENGTH];
+	const char *dir;
+	uint64_t i;
+	uint32_t crc;
+	uint8_t known;
+	int32_t f;
+	File *file;
+	FILE *out;
+	int ret = 0;
+
+	// Appends still in memory belong in the image
+	if(fs3_flush_appends() != 0){
+		return -1;
+	}
+
+	// Lay out the sections
+	memset(&header, 0x0, sizeof(header));
+	strncpy(header.magic, FS3_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = FS3_SNAPSHOT_VERSION;
+	header.tracks = fs3Tracks;
+	header.trackSize = fs3TrackSize;
+	header.sectorSize = FS3_SECTOR_SIZE;
+	header.createdFilesSize = createdFilesSize;
+	header.assignedSectors = assignedSectors;
+	header.filesOffset = FS3_SNAPSHOT_ALIGN;
+	header.dirsOffset = SNAPSHOT_ROUNDUP(header.filesOffset + sizeof(SnapshotFile) * createdFilesSize);
+	for(i = FS3_DIR_ROOT + 1; i < fs3_dir_count(); i++){
+		header.dirCount += (fs3_dir_path(i) != NULL);
+	}
+	header.listsOffset = SNAPSHOT_ROUNDUP(header.dirsOffset + sizeof(dirPath) * header.dirCount);
+	for(f = 0; f < createdFilesSize; f++){
+		header.listsSize += FILE_AT(f)->sectorCount;
+	}
+	header.mapOffset = SNAPSHOT_ROUNDUP(header.listsOffset + sizeof(uint32_t) * header.listsSize);
+	header.crcOffset = SNAPSHOT_ROUNDUP(header.mapOffset + sizeof(uint16_t) * assignedSectors);
+	header.dataOffset = SNAPSHOT_ROUNDUP(header.crcOffset + (sizeof(uint32_t) + sizeof(uint8_t)) * assignedSectors);
+
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+	if((out = fopen(tmpPath, "w")) == NULL){
+		logMessage(LOG_ERROR_LEVEL, "Failure creating snapshot [%s]: %s", tmpPath, strerror(errno));
+		return(-1);
+	}
+	if(fwrite(&header, sizeof(header), 1, out) != 1 ||
+			fseek(out, header.filesOffset, SEEK_SET) != 0){
+		ret = -1;
+	}
+	for(f = 0; f < createdFilesSize && ret == 0; f++){
+		file = FILE_AT(f);
+		memset(&record, 0x0, sizeof(record));
+		if(file->cold->path != NULL){
+			strncpy(record.path, file->cold->path, sizeof(record.path) - 1);
+		}
+		record.handle = file->handle;
+		record.length = file->length;
+		record.sectorCount = file->sectorCount;
+		record.isInline = file->isInline;
+		record.isPacked = file->isPacked;
+		record.isDeleted = file->isDeleted;
+		record.tailShared = file->cold->tailShared;
+		record.tailOffset = file->cold->tailOffset;
+		record.tailCapacity = file->cold->tailCapacity;
+		record.tailSector = file->cold->tailSector;
+		memcpy(record.inlineData, file->cold->inlineData, FS3_INLINE_MAX);
+		if(fwrite(&record, sizeof(record), 1, out) != 1){
+			ret = -1;
+		}
+	}
+	// Directories are saved by path, the ones holding files would come back anyway
+	if(ret == -1 || fseek(out, header.dirsOffset, SEEK_SET) != 0){
+		ret = -1;
+	}
+	for(i = FS3_DIR_ROOT + 1; i < fs3_dir_count() && ret == 0; i++){
+		if((dir = fs3_dir_path(i)) != NULL){
+			memset(dirPath, 0x0, sizeof(dirPath));
+			strncpy(dirPath, dir, sizeof(dirPath) - 1);
+			if(fwrite(dirPath, sizeof(dirPath), 1, out) != 1){
+				ret = -1;
+			}
+		}
+	}
+	if(ret == -1 || fseek(out, header.listsOffset, SEEK_SET) != 0){
+		ret = -1;
+	}
+	for(f = 0; f < createdFilesSize && ret == 0; f++){
+		if(fwrite(FILE_AT(f)->sectorList, sizeof(uint32_t), FILE_AT(f)->sectorCount, out) != (size_t)FILE_AT(f)->sectorCount){
+			ret = -1;
+		}
+	}
+	// The map and the checksums cover the sectors in use, one track at a time
+	if(ret == -1 || fseek(out, header.mapOffset, SEEK_SET) != 0){
+		ret = -1;
+	}
+	for(i = 0; i < assignedSectors && ret == 0; i += fs3TrackSize){
+		uint64_t n = (assignedSectors - i < fs3TrackSize) ? assignedSectors - i : fs3TrackSize;
+		if(fwrite(TRACK_META(i)->owner, sizeof(uint16_t), n, out) != n){
+			ret = -1;
+		}
+	}
+	if(ret == -1 || fseek(out, header.crcOffset, SEEK_SET) != 0){
+		ret = -1;
+	}
+	for(i = 0; i < assignedSectors && ret == 0; i++){
+		crc = 0;
+		fs3_checksum_get(i / fs3TrackSize, i % fs3TrackSize, &crc);
+		if(fwrite(&crc, sizeof(uint32_t), 1, out) != 1){
+			ret = -1;
+		}
+	}
+	for(i = 0; i < assignedSectors && ret == 0; i++){
+		known = fs3_checksum_get(i / fs3TrackSize, i % fs3TrackSize, &crc);
+		if(fwrite(&known, sizeof(uint8_t), 1, out) != 1){
+			ret = -1;
+		}
+	}
+	if(ret == -1 || fseek(out, header.dataOffset, SEEK_SET) != 0){
+		ret = -1;
+	}
+	// Every sector in use lies below assignedSectors
+	for(i = 0; i < assignedSectors && ret == 0; i++){
+		if(fs3_bus_read(i / fs3TrackSize, i % fs3TrackSize, sector) != 0 ||
+				fwrite(sector, FS3_SECTOR_SIZE, 1, out) != 1){
+			ret = -1;
+		}
+	}
+	// Empty trailing sections still have to lie inside the image
+	if(ret == 0 && (fflush(out) != 0 || ftruncate(fileno(out), header.dataOffset + assignedSectors * FS3_SECTOR_SIZE) != 0)){
+		ret = -1;
+	}
+	if(fclose(out) != 0 || ret == -1 || rename(tmpPath, path) != 0){
+		logMessage(LOG_ERROR_LEVEL, "Failure writing snapshot [%s].", path);
+		unlink(tmpPath);
+		return(-1);
+	}
+	logMessage(FS3DriverLLevel, "Snapshot [%s] saved, %d files, %lu sectors.", path, createdFilesSize, assignedSectors);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_mount_snapshot
+// Description  : Mount the disk with the state saved in an image file
+//
+// Inputs       : path - the image file to mount from
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_mount_snapshot(const char *path) {
+	FS3SnapshotHeader *header;
+	struct stat stats;
+	SnapshotFile *records;
+	char *dirPaths;
+	int32_t f;
+	uint32_t *lists, *crcs;
+	uint16_t *owners;
+	uint8_t *known;
+	uint64_t listed = 0, i;
+	int fd;
+
+	// Map the image and check it matches this disk
+	if((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &stats) == -1){
+		logMessage(LOG_ERROR_LEVEL, "Failure opening snapshot [%s]: %s", path, strerror(errno));
+		if(fd != -1){
+			close(fd);
+		}
+		return(-1);
+	}
+	snapshotSize = stats.st_size;
+	snapshotImage = (snapshotSize < sizeof(FS3SnapshotHeader)) ? MAP_FAILED :
+		mmap(NULL, snapshotSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(snapshotImage == MAP_FAILED){
+		snapshotImage = NULL;
+		logMessage(LOG_ERROR_LEVEL, "Failure mapping snapshot [%s].", path);
+		return(-1);
+	}
+	header = (FS3SnapshotHeader *)snapshotImage;
+	if(strncmp(header->magic, FS3_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != FS3_SNAPSHOT_VERSION || header->sectorSize != FS3_SECTOR_SIZE ||
+			fs3_set_geometry(header->tracks, header->trackSize) != 0 ||
+			header->assignedSectors > (uint64_t)header->tracks * header->trackSize ||
+			header->createdFilesSize < 0 || header->createdFilesSize > FS3_MAX_TOTAL_FILES ||
+			header->filesOffset + header->createdFilesSize * sizeof(SnapshotFile) > header->dirsOffset ||
+			header->dirsOffset + header->dirCount * (uint64_t)FS3_MAX_PATH_LENGTH > header->listsOffset ||
+			header->listsOffset + header->listsSize * sizeof(uint32_t) > header->mapOffset ||
+			header->mapOffset + header->assignedSectors * sizeof(uint16_t) > header->crcOffset ||
+			header->crcOffset + header->assignedSectors * (sizeof(uint32_t) + sizeof(uint8_t)) > header->dataOffset ||
+			header->dataOffset + header->assignedSectors * FS3_SECTOR_SIZE > snapshotSize){
+		logMessage(LOG_ERROR_LEVEL, "Snapshot [%s] is not a valid image for this disk.", path);
+		fs3_snapshot_close();
+		return(-1);
+	}
+
+	// Mount as usual (with the geometry of the image), then install the saved
+	// state over the fresh one
+	if(mountDisk(0) == -1 || header->assignedSectors > fs3DiskSectors){
+		logMessage(LOG_ERROR_LEVEL, "Snapshot [%s] does not fit next to the metadata journal.", path);
+		fs3_snapshot_close();
+		return(-1);
+	}
+	if(growFileTable(header->createdFilesSize) != 0){
+		fs3_snapshot_close();
+		return(-1);
+	}
+	// Every file gets its own copy of its sector list
+	records = (SnapshotFile *)&snapshotImage[header->filesOffset];
+	lists = (uint32_t *)&snapshotImage[header->listsOffset];
+	for(f = 0; f < header->createdFilesSize; f++){
+		File *file = FILE_AT(f);
+		SnapshotFile *record = &records[f];
+		createdFilesSize = f + 1;
+		record->path[FS3_MAX_PATH_LENGTH - 1] = 0x0;
+		file->handle = record->handle;
+		file->length = record->length;
+		file->isInline = record->isInline;
+		file->isPacked = record->isPacked;
+		file->isDeleted = record->isDeleted;
+		file->cold->tailShared = record->tailShared;
+		file->cold->tailOffset = record->tailOffset;
+		file->cold->tailCapacity = record->tailCapacity;
+		file->cold->tailSector = record->tailSector;
+		memcpy(file->cold->inlineData, record->inlineData, FS3_INLINE_MAX);
+		file->cold->path = record->isDeleted ? NULL : fs3_names_intern(record->path);
+		if(record->sectorCount < 0 || listed + (uint64_t)record->sectorCount > header->listsSize ||
+				(record->sectorCount > 0 && (file->sectorList = malloc(sizeof(uint32_t) * record->sectorCount)) == NULL)){
+			logMessage(LOG_ERROR_LEVEL, "Snapshot [%s] has a bad sector list.", path);
+			fs3_snapshot_close();
+			return(-1);
+		}
+		if(record->sectorCount > 0){
+			memcpy(file->sectorList, &lists[listed], sizeof(uint32_t) * record->sectorCount);
+			file->sectorCount = file->sectorCapacity = record->sectorCount;
+			listed += record->sectorCount;
+		}
+		if(!record->isDeleted && (file->cold->path == NULL || FS3_HANDLE_SLOT(file->handle) != (uint32_t)f)){
+			logMessage(LOG_ERROR_LEVEL, "Snapshot [%s] has a bad file record.", path);
+			fs3_snapshot_close();
+			return(-1);
+		}
+	}
+	dirPaths = (char *)&snapshotImage[header->dirsOffset];
+	for(i = 0; i < header->dirCount; i++){
+		dirPaths[(i + 1) * FS3_MAX_PATH_LENGTH - 1] = 0x0;
+		if(fs3_dir_make(&dirPaths[i * FS3_MAX_PATH_LENGTH]) == -1){
+			fs3_snapshot_close();
+			return(-1);
+		}
+	}
+	if(rebuildFileIndex() != 0){
+		fs3_snapshot_close();
+		return(-1);
+	}
+	if(growSectorMap(header->assignedSectors) != 0){
+		fs3_snapshot_close();
+		return(-1);
+	}
+	assignedSectors = header->assignedSectors;
+	owners = (uint16_t *)&snapshotImage[header->mapOffset];
+	crcs = (uint32_t *)&snapshotImage[header->crcOffset];
+	known = (uint8_t *)&crcs[assignedSectors];
+	for(i = 0; i < assignedSectors; i++){
+		SECTOR_OWNER(i) = owners[i];
+		if(known[i]){
+			fs3_checksum_set(i / fs3TrackSize, i % fs3TrackSize, crcs[i]);
+		}
+	}
+	rebuildAllocState();
+	if(fs3_journal_checkpoint() != 0){
+		fs3_snapshot_close();
+		return(-1);
+	}
+
+	// Every saved sector is served from the image until it is rewritten
+	snapshotSectors = header->assignedSectors;
+	snapshotDataOffset = header->dataOffset;
+	if((snapshotPending = malloc(snapshotSectors + 1)) == NULL){
+		fs3_snapshot_close();
+		return(-1);
+	}
+	memset(snapshotPending, 1, snapshotSectors);
+	logMessage(FS3DriverLLevel, "Mounted snapshot [%s], %d files, %lu sectors.", path, createdFilesSize, assignedSectors);
+	return(0);
+}
+
+int fs3_snapshot_fetch(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+	uint64_t idx = (uint64_t)trk * fs3TrackSize + sct;
+	if(snapshotImage == NULL || idx >= snapshotSectors || !snapshotPending[idx]){
+		return(-1);
+	}
+	memcpy(buf, &snapshotImage[snapshotDataOffset + idx * FS3_SECTOR_SIZE], FS3_SECTOR_SIZE);
+	return(0);
+}
+
+void fs3_snapshot_release(FS3TrackIndex trk, FS3SectorIndex sct) {
+	uint64_t idx = (uint64_t)trk * fs3TrackSize + sct;
+	if(snapshotImage != NULL && idx < snapshotSectors){
+		snapshotPending[idx] = 0;
+	}
+}
+
+int fs3_snapshot_close(void) {
+	if(snapshotImage == NULL){
+		return(0);
+	}
+	munmap(snapshotImage, snapshotSize);
+	free(snapshotPending);
+	snapshotImage = NULL;
+	snapshotPending = NULL;
+	snapshotSectors = 0;
+	return(0);
+}
@@ -0,0 +1,63 @@
+#ifndef FS3_SNAPSHOT_INCLUDED
+#define FS3_SNAPSHOT_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_snapshot.h
+//  Description    : This is the interface for FS3 disk-image snapshots. A
+//                   snapshot holds the file table, the sector map and the
+//                   contents of every assigned sector, and a later run can
+//                   mount from it without replaying the workload.
+//
+
+// Include
+#include <stdint.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_SNAPSHOT_MAGIC "FS3SNAP"
+#define FS3_SNAPSHOT_VERSION 10
+#define FS3_SNAPSHOT_ALIGN 4096 // Sections start on page boundaries so they can be mapped
+
+// Snapshot file header, followed by a record per file slot, the path of every
+// directory but the root, the sector list of every file (one after the other),
+// then the owner, the checksum and whether the checksum is known of every
+// assigned sector, and the sector contents, all in allocation order
+typedef struct FS3SnapshotHeadr {
+	char magic[8];
+	uint32_t version;
+	uint32_t tracks;
+	uint32_t trackSize;
+	uint32_t sectorSize;
+	int32_t createdFilesSize;
+	uint32_t dirCount;
+	uint64_t assignedSectors;
+	uint64_t filesOffset;
+	uint64_t dirsOffset;
+	uint64_t listsOffset;
+	uint64_t listsSize;
+	uint64_t mapOffset;
+	uint64_t crcOffset;
+	uint64_t dataOffset;
+} FS3SnapshotHeader;
+
+//
+// Snapshot Functions
+
+int fs3_snapshot_save(const char *path);
+	// Dump the mounted filesystem to an image file
+
+int32_t fs3_mount_snapshot(const char *path);
+	// Mount the disk with the state saved in an image file, sector contents
+	// are served from the mapped image until they are first written
+
+int fs3_snapshot_fetch(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
+	// Copy a sector still held by the mounted image into buf, -1 if it is not held
+
+void fs3_snapshot_release(FS3TrackIndex trk, FS3SectorIndex sct);
+	// The controller now has the sector, stop serving it from the image
+
+int fs3_snapshot_close(void);
+	// Unmap the mounted image
+
+#endif